@@ -25,17 +25,51 @@
 #include "hairgap.h"
 
 #define USAGE\
-    "Usage: hairgapr [-h] [-m MEM_LIMIT] [-p PORT] [-t TIMEOUT] bind_ip\n"\
+    "Usage: hairgapr [-hCDHPST] [-a STAGE=CPUS] [-B BUSY_POLL] [-L NAME]"\
+    " [-m MEM_LIMIT] [-p PORT] [-q DEPTH] [-R PRIO] [-r TRACE] [-s SYNC]"\
+    " [-t TIMEOUT]"\
+    " [-w WRITERS] bind_ip\n"\
     "\n"\
     "Hairgap receiver, to reliably receive data over a unidirectional "\
     "network.\n"\
     "\n"\
     "Options:\n"\
     "    -h              Prints this help and exits.\n"\
+    "    -C              Print stats on the channels between the pipeline\n"\
+    "                    threads at the end (and on SIGUSR1).\n"\
+    "    -D              Write the output with O_DIRECT (bypassing the page\n"\
+    "                    cache), implies asynchronous writes.\n"\
+    "    -H              Back the pipeline buffers with huge pages.\n"\
+    "    -P              Prefault (lock in memory if allowed) the pipeline\n"\
+    "                    buffers at allocation.\n"\
+    "    -S              Receive, decode and write in a single thread (for\n"\
+    "                    small machines), implies a single writer.\n"\
+    "    -T              Measure the one-way delay, jitter and spacing of\n"\
+    "                    the packets sent with hairgaps -T.\n"\
+    "    -a STAGE=CPUS   Pin the threads of STAGE (net, decode or write) to\n"\
+    "                    CPUS (e.g. 2,4-5), and allocate the buffers they\n"\
+    "                    fill on their NUMA node. Repeatable.\n"\
+    "    -B BUSY_POLL    Busy-poll the socket (kernel busy polling budget of\n"\
+    "                    BUSY_POLL us) rather than sleeping between packets,\n"\
+    "                    for a lower latency. Burns a CPU, best used with\n"\
+    "                    -a net=CPU.\n"\
+    "    -L NAME         Publish live stats in the shared memory segment\n"\
+    "                    /hgap-NAME during the transfer (see hgap-stat).\n"\
     "    -m MEM_LIMIT    Rough memory limit in megabytes.\n"\
     "    -p PORT         Bind port port.\n"\
+    "    -q DEPTH        Write the output asynchronously (io_uring) with up\n"\
+    "                    to DEPTH writes of coalesced chunks in flight.\n"\
+    "    -R PRIO         Run the net thread with the SCHED_FIFO real-time\n"\
+    "                    priority PRIO.\n"\
+    "    -r TRACE        Record the headers of the packets received in the\n"\
+    "                    file TRACE, to replay them with hgap-replay.\n"\
+    "    -s SYNC         Flush the output to disk in the background every\n"\
+    "                    SYNC megabytes (0: only at the end).\n"\
     "    -t TIMEOUT      Set timeout in seconds. If no packets are received \n"\
-    "                    for <timeout> seconds, the transfer is interrupted.\n"
+    "                    for <timeout> seconds, the transfer is interrupted.\n"\
+    "    -w WRITERS      Number of writer threads. With more than 1, chunks\n"\
+    "                    are written at their position as soon as they are\n"\
+    "                    decoded (the output must be a regular file).\n"
 
 int
 main(int argc, char* argv[])
@@ -44,7 +78,7 @@ main(int argc, char* argv[])
     hgap_defaults(&config);
 
     int c = 0;
-    while ((c = getopt(argc, argv, "p:t:m:h")) != -1) {
+    while ((c = getopt(argc, argv, "p:t:m:w:q:s:a:B:L:R:r:CDHPSTh")) != -1) {
         switch (c) {
         case 'p':
             // FIXME: atoi
@@ -56,6 +90,52 @@ main(int argc, char* argv[])
         case 'm':
             config.mem_limit = atoll(optarg) * 1024 * 1024;
             break;
+        case 'w':
+            config.n_writers = atoi(optarg);
+            break;
+        case 'q':
+            config.aio_depth = atoi(optarg);
+            break;
+        case 's':
+            config.sync_interval = atoll(optarg) * 1024 * 1024;
+            break;
+        case 'C':
+            config.chan_stats = 1;
+            break;
+        case 'a':
+            if (hgap_config_place_stage(&config, optarg) != HGAP_SUCCESS) {
+                ERROR("Invalid stage placement %s\n", optarg);
+                ERROR(USAGE);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'B':
+            config.busy_poll = atoi(optarg);
+            break;
+        case 'R':
+            config.rt_prio = atoi(optarg);
+            break;
+        case 'H':
+            config.alloc_flags |= HGAP_ALLOC_ALIGNED | HGAP_ALLOC_HUGEPAGES;
+            break;
+        case 'P':
+            config.alloc_flags |= HGAP_ALLOC_ALIGNED | HGAP_ALLOC_PREFAULT;
+            break;
+        case 'S':
+            config.single_thread = 1;
+            break;
+        case 'D':
+            config.direct_io = 1;
+            break;
+        case 'L':
+            config.stats_name = optarg;
+            break;
+        case 'T':
+            config.timestamps = 1;
+            break;
+        case 'r':
+            config.trace_path = optarg;
+            break;
         case 'h':
             fputs(USAGE, stdout);
             exit(EXIT_SUCCESS);
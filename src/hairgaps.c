@@ -30,6 +30,7 @@
 
 #define USAGE\
     "Usage: hairgaps [Options] dest_ip\n"\
+    "       hairgaps [Options] -w STORE\n"\
     "\n"\
     "Hairgap sender, to reliably send data over a unidirectional network.\n"\
     "\n"\
@@ -44,10 +45,30 @@
     "                    make the transfer more robust to big loss bursts,\n"\
     "                    but possibly slower. 2 <= NUM <= 64000.\n"\
     "    -M MTU          Size in bytes of the UDP payloads to send.\n"\
-    "    -k KEEPALIVE    Keepalive period in ms. Default is 500ms. 0\n"\
-    "                    disables keepalives.\n"
-
-    //"    -m MEM_LIMIT    Rough memory limit in megabytes.\n"
+    "    -k KEEPALIVE    Keepalive period in ms: a keepalive is sent when\n"\
+    "                    nothing else has been sent for that long. Default is\n"\
+    "                    500ms. 0 disables keepalives.\n"\
+    "    -m MEM_LIMIT    Rough memory limit in megabytes.\n"\
+    "    -C              Print stats on the channels between the pipeline\n"\
+    "                    threads at the end (and on SIGUSR1).\n"\
+    "    -H              Back the pipeline buffers with huge pages.\n"\
+    "    -P              Prefault (lock in memory if allowed) the pipeline\n"\
+    "                    buffers at allocation.\n"\
+    "    -a STAGE=CPUS   Pin the thread of STAGE (read, encode or send) to\n"\
+    "                    CPUS (e.g. 2,4-5), and allocate the buffers it\n"\
+    "                    fills on their NUMA node. Repeatable.\n"\
+    "    -R PRIO         Run the send thread with the SCHED_FIFO real-time\n"\
+    "                    priority PRIO.\n"\
+    "    -L NAME         Publish live stats in the shared memory segment\n"\
+    "                    /hgap-NAME during the transfer (see hgap-stat).\n"\
+    "    -T              Append the send time to every data packet, for the\n"\
+    "                    latency measurements of hairgapr -T.\n"\
+    "    -w STORE        Encode the input into the packet store STORE\n"\
+    "                    instead of sending it, and report the encoding\n"\
+    "                    throughput.\n"\
+    "    -s STORE        Send the packet store STORE instead of the input,\n"\
+    "                    without encoding it again. -N, -M, -r and -T are\n"\
+    "                    those given to -w.\n"
 
 
 int
@@ -55,10 +76,11 @@ main(int argc, char *argv[])
 {
     struct hgap_config config;
     hgap_defaults(&config);
+    int to_store = 0;
 
     int c = 0;
     // TODO: arg control, no atof, etc...
-    while ((c = getopt(argc, argv, "p:b:r:N:M:k:h")) != -1) {
+    while ((c = getopt(argc, argv, "p:b:r:N:M:k:m:a:R:L:w:s:CHPTh")) != -1) {
         switch (c) {
         case 'p':
             config.port = atoi(optarg);
@@ -75,14 +97,45 @@ main(int argc, char *argv[])
         case 'M':
             config.pkt_size = atol(optarg);
             break;
-        /*
         case 'm':
             config.mem_limit = atoll(optarg) * 1024 * 1024;
             break;
-        */
+        case 'C':
+            config.chan_stats = 1;
+            break;
+        case 'a':
+            if (hgap_config_place_stage(&config, optarg) != HGAP_SUCCESS) {
+                ERROR("Invalid stage placement %s\n", optarg);
+                ERROR(USAGE);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'R':
+            config.rt_prio = atoi(optarg);
+            break;
+        case 'H':
+            config.alloc_flags |= HGAP_ALLOC_ALIGNED | HGAP_ALLOC_HUGEPAGES;
+            break;
+        case 'P':
+            config.alloc_flags |= HGAP_ALLOC_ALIGNED | HGAP_ALLOC_PREFAULT;
+            break;
         case 'k':
             config.keepalive = atoi(optarg);
             break;
+        case 'L':
+            config.stats_name = optarg;
+            break;
+        case 'T':
+            config.timestamps = 1;
+            break;
+        case 'w':
+            config.store_path = optarg;
+            to_store = 1;
+            break;
+        case 's':
+            config.store_path = optarg;
+            to_store = 0;
+            break;
         case 'h':
             fputs(USAGE, stdout);
             exit(EXIT_SUCCESS);
@@ -93,11 +146,20 @@ main(int argc, char *argv[])
         }
     }
 
-    if (argc < 2 || argc < optind) {
+    if (argc < 2 || argc < optind || (!to_store && optind == argc)) {
         fprintf(stderr, USAGE);
         exit(EXIT_FAILURE);
     }
 
+    if (to_store) {
+        hgap_config_dump(&config, stderr);
+        int ret = hgap_store(&config);
+        if (ret != HGAP_SUCCESS) {
+            HGAP_PERROR(ret, "Encoding failed");
+        }
+        return ret;
+    }
+
     config.addr = argv[optind];
 
     INFO("starting with:\n"
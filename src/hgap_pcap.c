@@ -0,0 +1,319 @@
+/*
+ * This file is part of hairgap.
+ * Copyright (C) 2017  Florent MONJALET <florent.monjalet@cea.fr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <wirehair.h>
+
+#include "common.h"
+#include "encoding.h"
+#include "hairgap.h"
+#include "pcap.h"
+#include "proto.h"
+
+#define USAGE\
+    "Usage: hgap-pcap [-hv] [-p PORT] [-o OUT] CAPTURE\n"\
+    "\n"\
+    "Feeds the hairgap packets of a pcap or pcapng capture to the decoder\n"\
+    "as fast as possible, writes the decoded chunks to OUT and reports the\n"\
+    "decoding throughput and the time spent on each chunk. The packets are\n"\
+    "all loaded in memory first, so that only the decoder and the writes are\n"\
+    "timed.\n"\
+    "\n"\
+    "Options:\n"\
+    "    -h              Prints this help and exits.\n"\
+    "    -v              Prints every chunk decoded.\n"\
+    "    -p PORT         UDP destination port of the transfer (default:\n"\
+    "                    11011, 0 for any).\n"\
+    "    -o OUT          File to write the received data to (default:\n"\
+    "                    /dev/null).\n"
+
+#define MB (1024 * 1024.)
+// Bucket i holds the chunk decoding times in [2^i, 2^(i + 1)) ns
+#define CHUNK_BUCKETS 40
+
+/**
+ * The payloads of the capture, back to back.
+ */
+struct capture {
+    char *data;
+    size_t size;
+    size_t cap;
+    size_t *offsets;
+    size_t n_pkts;
+    size_t cap_pkts;
+};
+
+struct chunk_times {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint64_t buckets[CHUNK_BUCKETS];
+};
+
+static void *
+grow(void *ptr, size_t used, size_t *cap, size_t need)
+{
+    if (need <= *cap) {
+        return ptr;
+    }
+    size_t new_cap = MAX(*cap * 2, need);
+    void *ret = xmalloc(new_cap);
+    memcpy(ret, ptr, used);
+    free(ptr);
+    *cap = new_cap;
+    return ret;
+}
+
+static void
+capture_add(struct capture *cap, const void *payload, size_t len)
+{
+    size_t offsets_size = cap->cap_pkts * sizeof *cap->offsets;
+    cap->offsets = grow(cap->offsets, cap->n_pkts * sizeof *cap->offsets,
+                        &offsets_size, (cap->n_pkts + 1) * sizeof *cap->offsets);
+    cap->cap_pkts = offsets_size / sizeof *cap->offsets;
+    cap->data = grow(cap->data, cap->size, &cap->cap, cap->size + len);
+
+    cap->offsets[cap->n_pkts++] = cap->size;
+    memcpy(cap->data + cap->size, payload, len);
+    cap->size += len;
+}
+
+/**
+ * Loads the payloads of the datagrams to port from the capture path.
+ */
+static int
+capture_load(struct capture *cap, const char *path, uint16_t port)
+{
+    struct hgap_pcap *pcap = hgap_pcap_open(path);
+    if (pcap == NULL) {
+        fprintf(stderr, "Could not read capture %s: %s\n", path,
+                strerror(errno));
+        return -1;
+    }
+
+    const void *payload;
+    size_t len;
+    int ret;
+    while ((ret = hgap_pcap_next_udp(pcap, port, &payload, &len)) == 1) {
+        capture_add(cap, payload, len);
+    }
+    if (ret == -1) {
+        fprintf(stderr, "Corrupted capture after %zu datagrams: %s\n",
+                cap->n_pkts, strerror(errno));
+    }
+    if (hgap_pcap_truncated(pcap) > 0) {
+        WARN("%"PRIu64" frames truncated by the capture\n",
+             hgap_pcap_truncated(pcap));
+    }
+
+    hgap_pcap_close(pcap);
+    return ret;
+}
+
+static void
+chunk_times_record(struct chunk_times *times, uint64_t ns)
+{
+    times->min = times->count == 0 ? ns : MIN(times->min, ns);
+    times->max = MAX(times->max, ns);
+    times->count++;
+    times->sum += ns;
+    times->buckets[hgap_log2_bucket(ns, CHUNK_BUCKETS)]++;
+}
+
+static void
+report(struct hgap_decoder *dec, uint64_t n_pkts, uint64_t bytes,
+       uint64_t decode_ns, uint64_t write_ns,
+       const struct chunk_times *times)
+{
+    struct hgap_recv_stats stats;
+    hgap_decoder_stats(dec, &stats);
+    double secs = decode_ns / 1e9;
+
+    printf("%"PRIu64" packets, %"PRIu64" chunks (%.3f MB) decoded in %.3fs: "
+           "%.1f MB/s, %.0f packets/s; written in %.3fs\n", n_pkts,
+           times->count, bytes / MB, secs, secs > 0 ? bytes / MB / secs : 0,
+           secs > 0 ? n_pkts / secs : 0, write_ns / 1e9);
+    printf("%"PRIu64" packets missing, %"PRIu64" unusable", stats.link_losses,
+           stats.decoder_drops);
+    if (stats.chunks > 0) {
+        printf(", redundancy margin %.1f%% at worst", 100. * stats.min_margin);
+    }
+    printf("\n");
+
+    if (times->count == 0) {
+        return;
+    }
+    printf("Chunk decoding time (min, mean, max; histogram: bucket upper "
+           "bound: %% of the chunks): ");
+    hgap_print_ns(stdout, times->min);
+    printf(", ");
+    hgap_print_ns(stdout, (double) times->sum / times->count);
+    printf(", ");
+    hgap_print_ns(stdout, times->max);
+    printf(";");
+    for (int i = 0; i < CHUNK_BUCKETS; i++) {
+        if (times->buckets[i] > 0) {
+            printf(" <");
+            hgap_print_ns(stdout, (double) (2ULL << i));
+            printf(": %.1f", 100. * times->buckets[i] / times->count);
+        }
+    }
+    printf("\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+    int verbose = 0;
+    long port = HGAP_PORT;
+    const char *out_path = "/dev/null";
+
+    int c = 0;
+    while ((c = getopt(argc, argv, "p:o:vh")) != -1) {
+        switch (c) {
+        case 'p':
+            port = atol(optarg);
+            break;
+        case 'o':
+            out_path = optarg;
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        case 'h':
+            fputs(USAGE, stdout);
+            exit(EXIT_SUCCESS);
+        default:
+            ERROR(USAGE);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (optind != argc - 1 || port < 0 || port > UINT16_MAX) {
+        fprintf(stderr, USAGE);
+        exit(EXIT_FAILURE);
+    }
+
+    struct capture cap;
+    memset(&cap, 0, sizeof cap);
+    if (capture_load(&cap, argv[optind], (uint16_t) port) == -1) {
+        exit(EXIT_FAILURE);
+    }
+
+    int fd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        fprintf(stderr, "Could not open %s: %s\n", out_path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    if (wirehair_init() == 0) {
+        ERROR("Could not initialize wirehair\n");
+        exit(EXIT_FAILURE);
+    }
+
+    struct hgap_decoder *dec = hgap_decoder_new();
+    char *out = NULL;
+    size_t out_size = 0;
+    struct chunk_times times;
+    memset(&times, 0, sizeof times);
+
+    uint64_t n_pkts = 0;
+    uint64_t bytes = 0;
+    uint64_t decode_ns = 0;
+    uint64_t write_ns = 0;
+    // Spent in the decoder since the last chunk emitted
+    uint64_t chunk_ns = 0;
+    int retval = EXIT_FAILURE;
+
+    for (size_t i = 0; i < cap.n_pkts; i++) {
+        size_t end = i + 1 < cap.n_pkts ? cap.offsets[i + 1] : cap.size;
+        n_pkts++;
+
+        uint64_t start = hgap_now_ns();
+        ssize_t ready = hgap_decoder_read(dec, cap.data + cap.offsets[i],
+                                          end - cap.offsets[i]);
+        uint64_t elapsed = hgap_now_ns() - start;
+        decode_ns += elapsed;
+        chunk_ns += elapsed;
+        if (ready == -HGAP_EOT) {
+            retval = EXIT_SUCCESS;
+            break;
+        } else if (ready < 0) {
+            fprintf(stderr, "Packet %"PRIu64": %s\n", n_pkts,
+                    hgap_err_str((int) -ready));
+            goto out;
+        } else if (ready == 0) {
+            continue;
+        }
+
+        if ((size_t) ready > out_size) {
+            free(out);
+            out_size = ready;
+            out = xmalloc(out_size);
+        }
+        start = hgap_now_ns();
+        int ret = hgap_decoder_emit(dec, out, ready);
+        elapsed = hgap_now_ns() - start;
+        decode_ns += elapsed;
+        chunk_ns += elapsed;
+        uint64_t num = hgap_decoder_chunk_num(dec);
+        if (ret != HGAP_SUCCESS) {
+            fprintf(stderr, "Chunk %"PRIu64": %s\n", num, hgap_err_str(ret));
+            goto out;
+        }
+        chunk_times_record(&times, chunk_ns);
+        if (verbose) {
+            printf("chunk %"PRIu64": %zd bytes, decoded in ", num, ready);
+            hgap_print_ns(stdout, chunk_ns);
+            printf("\n");
+        }
+        chunk_ns = 0;
+
+        start = hgap_now_ns();
+        if (hgap_pwrite_all(fd, out, ready, bytes) < ready) {
+            fprintf(stderr, "Could not write to %s: %s\n", out_path,
+                    strerror(errno));
+            goto out;
+        }
+        write_ns += hgap_now_ns() - start;
+        bytes += ready;
+    }
+
+    if (retval != EXIT_SUCCESS) {
+        fprintf(stderr, "The capture ends before the end of the transfer\n");
+    }
+
+out:
+    report(dec, n_pkts, bytes, decode_ns, write_ns, &times);
+
+    free(out);
+    hgap_decoder_free(dec);
+    close(fd);
+    free(cap.offsets);
+    free(cap.data);
+
+    return retval;
+}
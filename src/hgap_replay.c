@@ -0,0 +1,332 @@
+/*
+ * This file is part of hairgap.
+ * Copyright (C) 2017  Florent MONJALET <florent.monjalet@cea.fr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <wirehair.h>
+
+#include "common.h"
+#include "encoding.h"
+#include "hairgap.h"
+#include "pcap.h"
+#include "proto.h"
+#include "trace.h"
+
+#define USAGE\
+    "Usage: hgap-replay [-hv] [-w CAPTURE] TRACE\n"\
+    "\n"\
+    "Replays the packets recorded by hairgapr -r TRACE through the decoder,\n"\
+    "in the same order and with the same losses, to reproduce a failed\n"\
+    "transfer or benchmark the decoder offline. The payloads are not in the\n"\
+    "trace: the packets are regenerated by encoding pseudo-random chunks of\n"\
+    "the recorded sizes, and the decoded chunks are checked against them.\n"\
+    "\n"\
+    "Options:\n"\
+    "    -h              Prints this help and exits.\n"\
+    "    -v              Prints every chunk decoded.\n"\
+    "    -w CAPTURE      Also writes the regenerated packets to the pcap file\n"\
+    "                    CAPTURE, as sent to 127.0.0.1:11011 (see hgap-pcap).\n"
+
+#define MB (1024 * 1024.)
+
+/**
+ * The chunk whose packets are being regenerated, and its data.
+ */
+struct replay_chunk {
+    uint64_t num;
+    uint32_t size;
+    uint32_t data_size;
+    char *data;
+    struct hgap_encoder *enc;
+    struct hgap_enc_chunk *chunk;
+};
+
+// Deterministic content of chunk num
+static void
+fill_chunk(char *data, size_t size, uint64_t num)
+{
+    uint64_t state = (num + 1) * 0x9e3779b97f4a7c15ULL;
+    for (size_t i = 0; i < size; i += sizeof state) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        memcpy(data + i, &state, MIN(sizeof state, size - i));
+    }
+}
+
+static void
+replay_chunk_free(struct replay_chunk *rc)
+{
+    if (rc->chunk != NULL) {
+        hgap_enc_chunk_free(rc->chunk);
+        hgap_encoder_free(rc->enc);
+    }
+    free(rc->data);
+    memset(rc, 0, sizeof *rc);
+}
+
+/**
+ * Makes rc the chunk of rec, encoding it if it is not already.
+ */
+static int
+replay_chunk_load(struct replay_chunk *rc, const struct hgap_trace_rec *rec)
+{
+    if (rc->chunk != NULL && rc->num == rec->chunk_num &&
+        rc->size == rec->chunk_size && rc->data_size == rec->data_size) {
+        return HGAP_SUCCESS;
+    }
+
+    replay_chunk_free(rc);
+    rc->num = rec->chunk_num;
+    rc->size = rec->chunk_size;
+    rc->data_size = rec->data_size;
+    rc->data = xmalloc(MAX(rc->size, 1));
+    fill_chunk(rc->data, rc->size, rc->num);
+
+    // Same packet size as the sender, the decoder deduces it from data_size
+    rc->enc = hgap_encoder_new(rc->data_size + HGAP_HEADER_LEN);
+    rc->chunk = hgap_enc_chunk_new();
+    return hgap_enc_chunk_init(rc->enc, rc->chunk, rc->data, rc->size);
+}
+
+/**
+ * Regenerates the packet of rec in pkt (HGAP_MAX_PKT_SIZE bytes).
+ *
+ * @return its length, or < 0 (-HGAP_ERR_*) if it cannot be regenerated.
+ */
+static ssize_t
+make_pkt(struct replay_chunk *rc, const struct hgap_trace_rec *rec, char *pkt)
+{
+    size_t len = MIN(rec->len, HGAP_MAX_PKT_SIZE);
+    memset(pkt, 0, len);
+
+    if (len < HGAP_HEADER_LEN) {
+        return len;
+    }
+
+    struct hgap_header hdr = {
+        .chunk_num = rec->chunk_num,
+        .chunk_size = rec->chunk_size,
+        .data_id = rec->data_id,
+        .data_size = rec->data_size,
+    };
+    if (hgap_pkt_type(&hdr, sizeof hdr) != HGAP_PKT_DATA ||
+        rec->data_size == 0 || rec->chunk_size > HGAP_MAX_CHUNK_SIZE ||
+        rec->data_size + HGAP_HEADER_LEN > len) {
+        // Control or bogus packet, the header is all that matters
+        hgap_write_header(&hdr, pkt);
+        return len;
+    }
+
+    int ret = replay_chunk_load(rc, rec);
+    if (ret != HGAP_SUCCESS) {
+        return -ret;
+    }
+    size_t size = len;
+    hgap_enc_chunk_seek(rc->chunk, rec->data_id);
+    if (hgap_enc_chunk_emit(rc->chunk, pkt, &size) < 0) {
+        return -HGAP_ERR_WIREHAIR_ERROR;
+    }
+    // The encoder numbers its chunks from 0
+    hgap_write_header(&hdr, pkt);
+
+    return len;
+}
+
+static void
+report(struct hgap_decoder *dec, uint64_t n_recs, uint64_t chunks,
+       uint64_t bytes, uint64_t decode_ns)
+{
+    struct hgap_recv_stats stats;
+    hgap_decoder_stats(dec, &stats);
+    double secs = decode_ns / 1e9;
+
+    printf("%"PRIu64" packets replayed, %"PRIu64" chunks (%.3f MB) decoded "
+           "in %.3fs: %.1f MB/s, %.0f packets/s\n", n_recs, chunks, bytes / MB,
+           secs, secs > 0 ? bytes / MB / secs : 0,
+           secs > 0 ? n_recs / secs : 0);
+    printf("%"PRIu64" packets missing, %"PRIu64" unusable", stats.link_losses,
+           stats.decoder_drops);
+    if (stats.chunks > 0) {
+        printf(", redundancy margin %.1f%% at worst", 100. * stats.min_margin);
+    }
+    printf("\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+    int verbose = 0;
+    const char *capture_path = NULL;
+
+    int c = 0;
+    while ((c = getopt(argc, argv, "w:vh")) != -1) {
+        switch (c) {
+        case 'w':
+            capture_path = optarg;
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        case 'h':
+            fputs(USAGE, stdout);
+            exit(EXIT_SUCCESS);
+        default:
+            ERROR(USAGE);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (optind != argc - 1) {
+        fprintf(stderr, USAGE);
+        exit(EXIT_FAILURE);
+    }
+
+    struct hgap_trace_reader *reader = hgap_trace_reader_new(argv[optind]);
+    if (reader == NULL) {
+        fprintf(stderr, "Could not read trace %s: %s\n", argv[optind],
+                strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    struct hgap_pcap_writer *capture = NULL;
+    if (capture_path != NULL &&
+        (capture = hgap_pcap_writer_new(capture_path)) == NULL) {
+        fprintf(stderr, "Could not create capture %s: %s\n", capture_path,
+                strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    if (wirehair_init() == 0) {
+        ERROR("Could not initialize wirehair\n");
+        exit(EXIT_FAILURE);
+    }
+
+    struct hgap_decoder *dec = hgap_decoder_new();
+    struct replay_chunk rc;
+    memset(&rc, 0, sizeof rc);
+    char *pkt = xmalloc(HGAP_MAX_PKT_SIZE);
+    char *out = NULL;
+    size_t out_size = 0;
+    char *expected = NULL;
+    size_t expected_size = 0;
+
+    struct hgap_trace_rec rec;
+    uint64_t n_recs = 0;
+    uint64_t chunk_recs = 0;
+    uint64_t last_chunk = HGAP_FIRST_RESERVED;
+    uint64_t chunks = 0;
+    uint64_t bytes = 0;
+    uint64_t decode_ns = 0;
+    int retval = EXIT_FAILURE;
+    int ret;
+
+    while ((ret = hgap_trace_reader_next(reader, &rec)) == 1) {
+        n_recs++;
+        if (rec.chunk_num != last_chunk) {
+            last_chunk = rec.chunk_num;
+            chunk_recs = 0;
+        }
+        chunk_recs++;
+
+        ssize_t len = make_pkt(&rc, &rec, pkt);
+        if (len < 0) {
+            HGAP_PERROR((int) -len, "Could not regenerate a packet");
+            goto out;
+        }
+        if (capture != NULL) {
+            hgap_pcap_write_udp(capture, rec.ns, HGAP_PORT, pkt, len);
+        }
+
+        uint64_t start = hgap_now_ns();
+        ssize_t ready = hgap_decoder_read(dec, pkt, len);
+        decode_ns += hgap_now_ns() - start;
+        if (ready == -HGAP_EOT) {
+            retval = EXIT_SUCCESS;
+            break;
+        } else if (ready < 0) {
+            fprintf(stderr, "Packet %"PRIu64" (chunk %"PRIu64", id %"PRIu32
+                    ", at %.6fs): %s\n", n_recs, rec.chunk_num, rec.data_id,
+                    rec.ns / 1e9, hgap_err_str((int) -ready));
+            goto out;
+        } else if (ready == 0) {
+            continue;
+        }
+
+        if ((size_t) ready > out_size) {
+            free(out);
+            out_size = ready;
+            out = xmalloc(out_size);
+        }
+        start = hgap_now_ns();
+        ret = hgap_decoder_emit(dec, out, ready);
+        decode_ns += hgap_now_ns() - start;
+        uint64_t num = hgap_decoder_chunk_num(dec);
+        if (ret != HGAP_SUCCESS) {
+            fprintf(stderr, "Chunk %"PRIu64": %s\n", num, hgap_err_str(ret));
+            goto out;
+        }
+
+        if ((size_t) ready > expected_size) {
+            free(expected);
+            expected_size = ready;
+            expected = xmalloc(expected_size);
+        }
+        fill_chunk(expected, ready, num);
+        if (memcmp(out, expected, ready) != 0) {
+            fprintf(stderr, "Chunk %"PRIu64": decoded data is corrupted\n",
+                    num);
+            goto out;
+        }
+
+        chunks++;
+        bytes += ready;
+        if (verbose) {
+            printf("chunk %"PRIu64": %zd bytes, decodable after %"PRIu64
+                   " packets of the trace\n", num, ready, chunk_recs);
+        }
+    }
+
+    if (ret == -1) {
+        fprintf(stderr, "Truncated trace after %"PRIu64" packets\n", n_recs);
+    } else if (retval != EXIT_SUCCESS) {
+        fprintf(stderr, "The trace ends before the end of the transfer\n");
+    }
+
+out:
+    report(dec, n_recs, chunks, bytes, decode_ns);
+
+    replay_chunk_free(&rc);
+    free(expected);
+    free(out);
+    free(pkt);
+    hgap_decoder_free(dec);
+    hgap_trace_reader_free(reader);
+    if (capture != NULL && hgap_pcap_writer_free(capture) == -1) {
+        fprintf(stderr, "Could not write capture %s: %s\n", capture_path,
+                strerror(errno));
+        retval = EXIT_FAILURE;
+    }
+
+    return retval;
+}
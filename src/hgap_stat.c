@@ -0,0 +1,197 @@
+/*
+ * This file is part of hairgap.
+ * Copyright (C) 2017  Florent MONJALET <florent.monjalet@cea.fr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "livestats.h"
+
+#define USAGE\
+    "Usage: hgap-stat [-hjw] [-i INTERVAL] [-n COUNT] NAME\n"\
+    "\n"\
+    "Prints the live stats of the hairgap transfer started with -L NAME,\n"\
+    "until it ends.\n"\
+    "\n"\
+    "Options:\n"\
+    "    -h              Prints this help and exits.\n"\
+    "    -j              One JSON object per line (all the counters, their\n"\
+    "                    rates per second and the channel depths).\n"\
+    "    -w              Wait for the transfer to start.\n"\
+    "    -i INTERVAL     Seconds between two reports (default: 1).\n"\
+    "    -n COUNT        Exit after COUNT reports.\n"
+
+#define MB (1024 * 1024.)
+
+static void
+print_json(const struct hgap_live *live, const uint64_t *cur,
+           const uint64_t *prev, double dt, int done)
+{
+    printf("{\"name\": \"%s\", \"role\": \"%s\", \"pid\": %"PRIu32", "
+           "\"elapsed\": %.3f, \"done\": %s, \"counters\": {", live->name,
+           live->role == HGAP_LIVE_SENDER ? "sender" : "receiver", live->pid,
+           (hgap_now_ns() - live->start_ns) / 1e9, done ? "true" : "false");
+    for (int i = 0; i < HGAP_LIVE_N_COUNTERS; i++) {
+        printf("%s\"%s\": %"PRIu64, i > 0 ? ", " : "",
+               hgap_live_counter_name(i), cur[i]);
+    }
+    printf("}, \"rates\": {");
+    for (int i = 0; i < HGAP_LIVE_N_COUNTERS; i++) {
+        printf("%s\"%s\": %.1f", i > 0 ? ", " : "", hgap_live_counter_name(i),
+               (cur[i] - prev[i]) / dt);
+    }
+    printf("}, \"queues\": {");
+    uint32_t n_queues = __atomic_load_n(&live->n_queues, __ATOMIC_ACQUIRE);
+    for (uint32_t i = 0; i < n_queues; i++) {
+        printf("%s\"%s\": {\"depth\": %"PRIu64", \"capacity\": %"PRIu64"}",
+               i > 0 ? ", " : "", live->queues[i].name,
+               __atomic_load_n(&live->queues[i].depth, __ATOMIC_RELAXED),
+               live->queues[i].capacity);
+    }
+    printf("}}\n");
+}
+
+static void
+print_line(const struct hgap_live *live, const uint64_t *cur,
+           const uint64_t *prev, double dt)
+{
+#define RATE(c) ((cur[c] - prev[c]) / dt)
+
+    printf("%7.1fs", (hgap_now_ns() - live->start_ns) / 1e9);
+    if (live->role == HGAP_LIVE_SENDER) {
+        printf("  read %7.1f MB/s  sent %7.1f MB/s %8.0f pps  chunks "
+               "enc %"PRIu64" sent %"PRIu64"  limiter sleeps %"PRIu64
+               "  waits %"PRIu64"  drops %"PRIu64,
+               RATE(HGAP_LIVE_BYTES_READ) / MB,
+               RATE(HGAP_LIVE_BYTES_SENT) / MB, RATE(HGAP_LIVE_PKTS_SENT),
+               cur[HGAP_LIVE_CHUNKS_ENCODED], cur[HGAP_LIVE_CHUNKS_SENT],
+               cur[HGAP_LIVE_LIMITER_SLEEPS],
+               cur[HGAP_LIVE_BACKPRESSURE_WAITS], cur[HGAP_LIVE_LOCAL_DROPS]);
+    } else {
+        printf("  recv %7.1f MB/s %8.0f pps  written %7.1f MB/s  chunks "
+               "dec %"PRIu64" written %"PRIu64"  kernel drops %"PRIu64
+               "  missing %"PRIu64,
+               RATE(HGAP_LIVE_BYTES_RECEIVED) / MB,
+               RATE(HGAP_LIVE_PKTS_RECEIVED),
+               RATE(HGAP_LIVE_BYTES_WRITTEN) / MB,
+               cur[HGAP_LIVE_CHUNKS_DECODED], cur[HGAP_LIVE_CHUNKS_WRITTEN],
+               cur[HGAP_LIVE_KERNEL_DROPS], cur[HGAP_LIVE_PKTS_MISSING]);
+    }
+    printf("  errors %"PRIu64" ", cur[HGAP_LIVE_ERRORS]);
+
+    uint32_t n_queues = __atomic_load_n(&live->n_queues, __ATOMIC_ACQUIRE);
+    for (uint32_t i = 0; i < n_queues; i++) {
+        printf(" %s %"PRIu64"/%"PRIu64, live->queues[i].name,
+               __atomic_load_n(&live->queues[i].depth, __ATOMIC_RELAXED),
+               live->queues[i].capacity);
+    }
+    printf("\n");
+
+#undef RATE
+}
+
+int
+main(int argc, char *argv[])
+{
+    int json = 0;
+    int wait = 0;
+    double interval = 1.0;
+    long count = -1;
+
+    int c = 0;
+    while ((c = getopt(argc, argv, "i:n:jwh")) != -1) {
+        switch (c) {
+        case 'i':
+            interval = atof(optarg);
+            break;
+        case 'n':
+            count = atol(optarg);
+            break;
+        case 'j':
+            json = 1;
+            break;
+        case 'w':
+            wait = 1;
+            break;
+        case 'h':
+            fputs(USAGE, stdout);
+            exit(EXIT_SUCCESS);
+        default:
+            ERROR(USAGE);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (optind != argc - 1 || interval <= 0) {
+        fprintf(stderr, USAGE);
+        exit(EXIT_FAILURE);
+    }
+
+    const struct hgap_live *live;
+    while ((live = hgap_live_attach(argv[optind])) == NULL) {
+        if (!wait || errno != ENOENT) {
+            fprintf(stderr, "Could not attach to " HGAP_LIVE_PREFIX "%s: %s\n",
+                    argv[optind], strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        usleep(100 * 1000);
+    }
+
+    uint64_t prev[HGAP_LIVE_N_COUNTERS];
+    uint64_t cur[HGAP_LIVE_N_COUNTERS];
+    for (int i = 0; i < HGAP_LIVE_N_COUNTERS; i++) {
+        prev[i] = hgap_live_get(live, i);
+    }
+    uint64_t prev_ns = hgap_now_ns();
+
+    int done = 0;
+    while (!done && count != 0) {
+        usleep((useconds_t) (interval * 1e6));
+
+        // Done, or killed before it could say so
+        done = __atomic_load_n(&live->done, __ATOMIC_ACQUIRE) ||
+               (kill(live->pid, 0) == -1 && errno == ESRCH);
+        for (int i = 0; i < HGAP_LIVE_N_COUNTERS; i++) {
+            cur[i] = hgap_live_get(live, i);
+        }
+        uint64_t now = hgap_now_ns();
+        double dt = (now - prev_ns) / 1e9;
+
+        if (json) {
+            print_json(live, cur, prev, dt, done);
+        } else {
+            print_line(live, cur, prev, dt);
+        }
+        fflush(stdout);
+
+        memcpy(prev, cur, sizeof prev);
+        prev_ns = now;
+        if (count > 0) {
+            count--;
+        }
+    }
+
+    hgap_live_detach(live);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,267 @@
+/*
+ * This file is part of hairgap.
+ * Copyright (C) 2017  Florent MONJALET <florent.monjalet@cea.fr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE // O_DIRECT
+
+#include "awriter.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "uring.h"
+
+struct hgap_awriter_buf {
+    void *data;
+    size_t len;
+    // Where it is being written
+    off_t offset;
+    struct iovec iov;
+};
+
+struct hgap_awriter {
+    int fd;
+    int direct;
+    // Offset of the next write
+    off_t offset;
+    int error;
+
+    // NULL when falling back to synchronous writes
+    struct hgap_uring *ring;
+    unsigned in_flight;
+
+    unsigned depth;
+    struct hgap_awriter_buf *bufs;
+    // Stack of the indices of the free staging buffers
+    unsigned *free_bufs;
+    unsigned n_free;
+    // Buffer being filled
+    struct hgap_awriter_buf *cur;
+};
+
+static int
+hgap_awriter_set_direct(int fd, int enable)
+{
+    int flags = fcntl(fd, F_GETFL);
+    if (flags == -1) {
+        return -1;
+    }
+
+    flags = enable ? flags | O_DIRECT : flags & ~O_DIRECT;
+    return fcntl(fd, F_SETFL, flags);
+}
+
+struct hgap_awriter *
+hgap_awriter_new(int fd, unsigned depth, int direct)
+{
+    off_t offset = lseek(fd, 0, SEEK_CUR);
+    if (offset == -1) {
+        return NULL;
+    }
+
+    struct hgap_awriter *aw = xmalloc(sizeof *aw);
+    memset(aw, 0, sizeof *aw);
+    aw->fd = fd;
+    aw->offset = offset;
+    aw->depth = MAX(1, depth);
+
+    if (direct) {
+        if (offset % HGAP_AWRITER_ALIGN != 0) {
+            WARN("Output offset is not aligned, not using O_DIRECT\n");
+        } else if (hgap_awriter_set_direct(fd, 1) == -1) {
+            PWARN("Could not enable O_DIRECT on the output");
+        } else {
+            aw->direct = 1;
+        }
+    }
+
+    if ((aw->ring = hgap_uring_new(aw->depth)) == NULL) {
+        PWARN("io_uring unavailable, using synchronous writes");
+    }
+
+    aw->bufs = xmalloc(aw->depth * sizeof *aw->bufs);
+    aw->free_bufs = xmalloc(aw->depth * sizeof *aw->free_bufs);
+    for (unsigned i = 0; i < aw->depth; i++) {
+        CHK(posix_memalign(&aw->bufs[i].data, HGAP_AWRITER_ALIGN,
+                           HGAP_AWRITER_BUF_SIZE) == 0);
+        aw->bufs[i].len = 0;
+        aw->free_bufs[aw->n_free++] = i;
+    }
+
+    return aw;
+}
+
+void
+hgap_awriter_free(struct hgap_awriter *aw)
+{
+    if (aw->ring != NULL) {
+        hgap_uring_free(aw->ring);
+    }
+    for (unsigned i = 0; i < aw->depth; i++) {
+        free(aw->bufs[i].data);
+    }
+    free(aw->free_bufs);
+    free(aw->bufs);
+    free(aw);
+}
+
+size_t
+hgap_awriter_footprint(unsigned depth)
+{
+    return MAX(1, depth) * (size_t) HGAP_AWRITER_BUF_SIZE;
+}
+
+static void
+hgap_awriter_release(struct hgap_awriter *aw, struct hgap_awriter_buf *buf)
+{
+    buf->len = 0;
+    aw->free_bufs[aw->n_free++] = buf - aw->bufs;
+}
+
+static void
+hgap_awriter_sync_write(struct hgap_awriter *aw, const void *data, size_t len,
+                        off_t offset)
+{
+    if (hgap_pwrite_all(aw->fd, data, len, offset) < (ssize_t) len) {
+        PWARN("Output write failed");
+        aw->error = 1;
+    }
+}
+
+// Waits for the completion of one write in flight
+static void
+hgap_awriter_reap(struct hgap_awriter *aw)
+{
+    uint64_t idx;
+    int res;
+
+    int ret = hgap_uring_wait(aw->ring, &idx, &res);
+    CHK_MSG(ret == 0, "io_uring wait failed: %s\n", strerror(-ret));
+    aw->in_flight--;
+
+    struct hgap_awriter_buf *buf = &aw->bufs[idx];
+    if (res < 0) {
+        WARN("Output write failed: %s\n", strerror(-res));
+        aw->error = 1;
+    } else if ((size_t) res < buf->len) {
+        // Short write, finish it synchronously
+        hgap_awriter_sync_write(aw, (char *) buf->data + res, buf->len - res,
+                                buf->offset + res);
+    }
+
+    hgap_awriter_release(aw, buf);
+}
+
+static void
+hgap_awriter_submit(struct hgap_awriter *aw, struct hgap_awriter_buf *buf)
+{
+    buf->offset = aw->offset;
+    aw->offset += buf->len;
+
+    if (aw->ring == NULL) {
+        hgap_awriter_sync_write(aw, buf->data, buf->len, buf->offset);
+        hgap_awriter_release(aw, buf);
+        return;
+    }
+
+    buf->iov.iov_base = buf->data;
+    buf->iov.iov_len = buf->len;
+    int ret = hgap_uring_writev(aw->ring, aw->fd, &buf->iov, 1, buf->offset,
+                                buf - aw->bufs);
+    if (ret != 0) {
+        WARN("io_uring submission failed: %s\n", strerror(-ret));
+        hgap_awriter_sync_write(aw, buf->data, buf->len, buf->offset);
+        hgap_awriter_release(aw, buf);
+        return;
+    }
+    aw->in_flight++;
+}
+
+int
+hgap_awriter_write(struct hgap_awriter *aw, const void *data, size_t size)
+{
+    const char *src = data;
+
+    while (size > 0 && !aw->error) {
+        if (aw->cur == NULL) {
+            // All staging buffers in flight, wait for one
+            if (aw->n_free == 0) {
+                hgap_awriter_reap(aw);
+            }
+            aw->cur = &aw->bufs[aw->free_bufs[--aw->n_free]];
+        }
+
+        size_t n = MIN(size, HGAP_AWRITER_BUF_SIZE - aw->cur->len);
+        memcpy((char *) aw->cur->data + aw->cur->len, src, n);
+        aw->cur->len += n;
+        src += n;
+        size -= n;
+
+        if (aw->cur->len == HGAP_AWRITER_BUF_SIZE) {
+            hgap_awriter_submit(aw, aw->cur);
+            aw->cur = NULL;
+        }
+    }
+
+    return aw->error ? HGAP_ERR_BAD_OUT_FD : HGAP_SUCCESS;
+}
+
+int
+hgap_awriter_finish(struct hgap_awriter *aw)
+{
+    while (aw->in_flight > 0) {
+        hgap_awriter_reap(aw);
+    }
+
+    struct hgap_awriter_buf *buf = aw->cur;
+    if (buf != NULL && buf->len > 0 && !aw->error) {
+        // Part of the buffer that can still be written with O_DIRECT
+        size_t aligned = 0;
+        if (aw->direct) {
+            aligned = buf->len - buf->len % HGAP_AWRITER_ALIGN;
+            hgap_awriter_sync_write(aw, buf->data, aligned, aw->offset);
+        }
+
+        // The unaligned tail cannot be written with O_DIRECT
+        if (aw->direct && hgap_awriter_set_direct(aw->fd, 0) == -1) {
+            PWARN("Could not disable O_DIRECT on the output");
+            aw->error = 1;
+        } else {
+            aw->direct = 0;
+            hgap_awriter_sync_write(aw, (char *) buf->data + aligned,
+                                    buf->len - aligned, aw->offset + aligned);
+        }
+        aw->offset += buf->len;
+    }
+    aw->cur = NULL;
+
+    if (aw->direct) {
+        hgap_awriter_set_direct(aw->fd, 0);
+        aw->direct = 0;
+    }
+
+    if (lseek(aw->fd, aw->offset, SEEK_SET) == -1) {
+        aw->error = 1;
+    }
+
+    return aw->error ? HGAP_ERR_BAD_OUT_FD : HGAP_SUCCESS;
+}
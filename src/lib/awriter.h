@@ -0,0 +1,72 @@
+/*
+ * This file is part of hairgap.
+ * Copyright (C) 2017  Florent MONJALET <florent.monjalet@cea.fr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HGAP_AWRITER_H
+#define HGAP_AWRITER_H
+
+#include <stddef.h>
+
+/**
+ * Asynchronous, coalescing writer for a regular file.
+ *
+ * Written data is copied into page-aligned staging buffers of
+ * HGAP_AWRITER_BUF_SIZE bytes, so that small chunks are coalesced into big
+ * writes and that the file can be opened in O_DIRECT mode (whose alignment
+ * constraints the chunks do not meet). Full staging buffers are submitted to
+ * io_uring, keeping up to depth writes in flight; if io_uring is not
+ * available, they are written synchronously.
+ *
+ * Single threaded use only.
+ */
+struct hgap_awriter;
+
+#define HGAP_AWRITER_BUF_SIZE (4 * 1024 * 1024)
+#define HGAP_AWRITER_ALIGN 4096
+
+/**
+ * Creates a writer appending to fd from its current offset, with depth
+ * staging buffers. If direct is set, O_DIRECT is enabled on fd when possible.
+ *
+ * @return the writer, or NULL if fd is not seekable.
+ */
+struct hgap_awriter *hgap_awriter_new(int fd, unsigned depth, int direct);
+void hgap_awriter_free(struct hgap_awriter *aw);
+
+/**
+ * Queues size bytes of data for writing. data can be reused as soon as this
+ * returns.
+ *
+ * @return HGAP_SUCCESS, or HGAP_ERR_BAD_OUT_FD if a previous write failed.
+ */
+int hgap_awriter_write(struct hgap_awriter *aw, const void *data, size_t size);
+
+/**
+ * Writes the pending data, waits for all the writes in flight and leaves fd
+ * positioned after the written data (with O_DIRECT disabled). No more writes
+ * are allowed afterwards.
+ *
+ * @return HGAP_SUCCESS, or HGAP_ERR_BAD_OUT_FD if a write failed.
+ */
+int hgap_awriter_finish(struct hgap_awriter *aw);
+
+/**
+ * Memory used by the staging buffers of a writer of the given depth.
+ */
+size_t hgap_awriter_footprint(unsigned depth);
+
+#endif // HGAP_AWRITER_H
@@ -0,0 +1,188 @@
+/*
+ * This file is part of hairgap.
+ * Copyright (C) 2017  Florent MONJALET <florent.monjalet@cea.fr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "bufpool.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "channel.h"
+#include "common.h"
+#include "region.h"
+
+#define BUFPOOL_ALIGN 64
+
+/**
+ * Every buffer is prefixed by this header, padded to keep the user part
+ * aligned.
+ */
+union bufpool_hdr {
+    struct {
+        size_t capacity;
+        // Index in bufpool->bufs
+        size_t idx;
+        // Where the header and the buffer live
+        struct hgap_region region;
+    };
+    char pad[BUFPOOL_ALIGN];
+};
+
+#define bufpool_hdr_of(buf) \
+    ((union bufpool_hdr *) ((char *) (buf) - sizeof (union bufpool_hdr)))
+
+/**
+ * n_bufs, allocated and bufs are only touched by the bufpool_get side (and by
+ * bufpool_free once both sides are done), the bufpool_put side only uses the
+ * return channel.
+ */
+struct bufpool {
+    struct hgap_membudget *budget;
+    size_t max_bufs;
+    unsigned alloc_flags;
+    // -1 for no NUMA placement
+    int node;
+
+    size_t n_bufs;
+    size_t allocated;
+    // All the buffers ever allocated, to free them even if not given back
+    void **bufs;
+
+    // Buffers handed back by the consumer
+    struct channel *ret_chan;
+};
+
+static void *
+bufpool_alloc(size_t capacity, unsigned alloc_flags, int node)
+{
+    struct hgap_region region = { .mem=NULL, .mapped=0 };
+    size_t size = sizeof (union bufpool_hdr) + capacity;
+
+    if (alloc_flags != 0 || node >= 0) {
+        hgap_region_alloc(&region, size, alloc_flags, node);
+    } else if (posix_memalign(&region.mem, BUFPOOL_ALIGN, size) != 0) {
+        return NULL;
+    }
+
+    union bufpool_hdr *hdr = region.mem;
+    hdr->capacity = capacity;
+    hdr->region = region;
+    return (char *) region.mem + sizeof (union bufpool_hdr);
+}
+
+static void
+bufpool_dealloc(void *buf)
+{
+    struct hgap_region region = bufpool_hdr_of(buf)->region;
+    hgap_region_free(&region);
+}
+
+struct bufpool *
+bufpool_new(struct hgap_membudget *budget, size_t max_bufs,
+            unsigned alloc_flags, int node)
+{
+    struct bufpool *pool = xmalloc(sizeof *pool);
+
+    pool->budget = budget;
+    pool->max_bufs = MAX(max_bufs, BUFPOOL_MIN_BUFS);
+    pool->alloc_flags = alloc_flags;
+    pool->node = node;
+    pool->n_bufs = 0;
+    pool->allocated = 0;
+    pool->bufs = xmalloc(pool->max_bufs * sizeof (void *));
+    pool->ret_chan = channel_new(sizeof (void *), pool->max_bufs);
+    CHK(pool->ret_chan);
+
+    return pool;
+}
+
+void
+bufpool_free(struct bufpool *pool)
+{
+    for (size_t i = 0; i < pool->n_bufs; i++) {
+        bufpool_dealloc(pool->bufs[i]);
+    }
+    hgap_membudget_release(pool->budget, pool->allocated);
+    channel_free(pool->ret_chan);
+    free(pool->bufs);
+    free(pool);
+}
+
+void *
+bufpool_get(struct bufpool *pool, size_t size)
+{
+    void *buf = NULL;
+
+    // Grow the pool while it fits
+    int grow = 0;
+    if (pool->n_bufs < BUFPOOL_MIN_BUFS) {
+        hgap_membudget_charge(pool->budget, size);
+        grow = 1;
+    } else if (pool->n_bufs < pool->max_bufs) {
+        grow = hgap_membudget_try_acquire(pool->budget, size);
+    }
+
+    if (grow) {
+        buf = bufpool_alloc(size, pool->alloc_flags, pool->node);
+        CHK_PERROR(buf != NULL);
+        bufpool_hdr_of(buf)->idx = pool->n_bufs;
+        pool->bufs[pool->n_bufs++] = buf;
+        pool->allocated += size;
+        return buf;
+    }
+
+    // Otherwise wait for a buffer to come back
+    if (!channel_recv(pool->ret_chan, &buf)) {
+        return NULL;
+    }
+
+    union bufpool_hdr *hdr = bufpool_hdr_of(buf);
+    if (hdr->capacity < size) {
+        // Only happens when the chunk size grows, not in steady state
+        size_t idx = hdr->idx;
+        pool->allocated -= hdr->capacity;
+        hgap_membudget_release(pool->budget, hdr->capacity);
+        bufpool_dealloc(buf);
+        hgap_membudget_charge(pool->budget, size);
+
+        buf = bufpool_alloc(size, pool->alloc_flags, pool->node);
+        CHK_PERROR(buf != NULL);
+        bufpool_hdr_of(buf)->idx = idx;
+        pool->bufs[idx] = buf;
+        pool->allocated += size;
+    }
+
+    return buf;
+}
+
+int
+bufpool_put(struct bufpool *pool, void *buf)
+{
+    return channel_send(pool->ret_chan, &buf);
+}
+
+size_t
+bufpool_max_bufs(struct bufpool *pool)
+{
+    return pool->max_bufs;
+}
+
+void
+bufpool_poison(struct bufpool *pool)
+{
+    channel_poison(pool->ret_chan);
+}
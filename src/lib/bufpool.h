@@ -0,0 +1,84 @@
+/*
+ * This file is part of hairgap.
+ * Copyright (C) 2017  Florent MONJALET <florent.monjalet@cea.fr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HGAP_BUFPOOL_H
+#define HGAP_BUFPOOL_H
+
+#include <stddef.h>
+
+#include "membudget.h"
+
+/**
+ * A bounded pool of recycled buffers shared between a single producer thread
+ * (that takes buffers with bufpool_get) and a single consumer thread (that
+ * gives them back with bufpool_put).
+ *
+ * Buffers are allocated lazily until either max_bufs buffers exist or the
+ * memory budget the pool draws from is exhausted. After that, bufpool_get
+ * blocks until a buffer is handed back through the pool's return channel, so
+ * that steady-state operation does not allocate (nor page-fault) anymore.
+ *
+ * Returned buffers are aligned on a cache line, and allocated according to
+ * the HGAP_ALLOC_* flags of the pool (see hairgap.h), on its NUMA node if
+ * any.
+ */
+struct bufpool;
+
+/**
+ * Creates a pool that will hold at most max_bufs buffers, accounted in
+ * budget. At least BUFPOOL_MIN_BUFS buffers are always allowed, whatever is
+ * left in the budget, so that the two sides of the pool can work
+ * concurrently.
+ */
+struct bufpool *bufpool_new(struct hgap_membudget *budget, size_t max_bufs,
+                            unsigned alloc_flags, int node);
+
+#define BUFPOOL_MIN_BUFS 2
+
+/**
+ * Frees the pool and all the buffers it allocated, including the ones that
+ * have not been given back, and releases them from the budget.
+ */
+void bufpool_free(struct bufpool *pool);
+
+/**
+ * Gets a buffer of at least size bytes, blocking until one is available.
+ *
+ * @return the buffer or NULL if the pool has been poisoned.
+ */
+void *bufpool_get(struct bufpool *pool, size_t size);
+
+/**
+ * Hands back a buffer obtained with bufpool_get.
+ *
+ * @return 1 on success, 0 on failure (poisoned pool).
+ */
+int bufpool_put(struct bufpool *pool, void *buf);
+
+/**
+ * Maximum number of buffers this pool can hand out at the same time.
+ */
+size_t bufpool_max_bufs(struct bufpool *pool);
+
+/**
+ * Poisons the pool so that any blocked or further bufpool_get/bufpool_put
+ * fails.
+ */
+void bufpool_poison(struct bufpool *pool);
+
+#endif // HGAP_BUFPOOL_H
@@ -18,103 +18,293 @@
 
 #include "channel.h"
 
-#include <pthread.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdalign.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
 
-#include "common.h" // Only uses xmalloc
+#include <linux/futex.h>
+
+#include "common.h"
+#include "probes.h"
+#include "region.h"
+
+#define CHANNEL_CACHE_LINE 64
+// Spin iterations between two clock reads
+#define CHANNEL_SPIN_CHECK 64
+#define CHANNEL_NO_TIMEOUT UINT64_MAX
 
 /**
- * r is the next slot to be read, w the next slot to be written.
- * _ _ r - - - w _ _ (size = 4)
- * - w _ _ _ _ _ r - (size = 3)
- * r w _ _ _ _ _ _ _ (size = 1)
- * _ rw_ _ _ _ _ _ _ (empty)
- * - w r - - - - - - (full)
+ * wr_idx and rd_idx are free-running counters, the slot of an index is
+ * idx % capacity:
+ * - empty when wr_idx == rd_idx,
+ * - full when wr_idx - rd_idx == capacity (all the slots are usable).
+ *
+ * The producer only writes wr_idx and the consumer only writes rd_idx
+ * (release), each of them reading the other side's index (acquire) to know
+ * whether slots are available. Each side lives on its own cache line along
+ * with a cached copy of the other side's index, only refreshed when the cached
+ * value says the channel is full (resp. empty), so that the sides do not keep
+ * stealing each other's cache lines.
  *
- * NOTE/FIXME: the actual implementation loses 1 entry of the channel, i.e when
- * the channel is full there is still 1 unused slot. This seems to allow less
- * lock contention but is a bit sad. Suggestions are welcome.
- * I guess this could be implemented lock-free, but perf is perfectly OK for the
- * current application.
+ * When the channel is full (resp. empty), a side polls it for spin_ns while
+ * pausing the CPU, then for yield_ns while yielding it, then sleeps on a
+ * futex. A side about to sleep advertises it in its *_waiting flag (which is
+ * the futex word), which the other side checks after moving its index.
+ *
+ * When stats are enabled, each side updates its own counters (relaxed atomics,
+ * on its own cache line), that any thread can read.
  */
 struct channel {
     size_t elt_size;
+    // Distance between two slots
+    size_t slot_size;
     size_t capacity;
+    void *elts;
+    struct hgap_region region;
 
-    int poisoned;
+    atomic_int poisoned;
 
-    void *elts;
-    size_t wr_idx;
-    size_t rd_idx;
+    // Wait policy
+    uint64_t spin_ns;
+    uint64_t yield_ns;
 
-    pthread_mutex_t mutex;
-    pthread_cond_t send_cond;
-    pthread_cond_t recv_cond;
+    atomic_int send_waiting;
+    atomic_int recv_waiting;
+
+    int stats;
+    uint64_t stats_start_ns;
+
+    // Producer side
+    alignas(CHANNEL_CACHE_LINE) atomic_size_t wr_idx;
+    size_t rd_cache;
+    atomic_uint_least64_t sent;
+    atomic_uint_least64_t send_blocked_ns;
+    atomic_uint_least64_t occupancy[CHANNEL_STATS_BUCKETS];
+
+    // Consumer side
+    alignas(CHANNEL_CACHE_LINE) atomic_size_t rd_idx;
+    size_t wr_cache;
+    atomic_uint_least64_t received;
+    atomic_uint_least64_t recv_blocked_ns;
 };
 
-#define POISON_CHECK(chan, ret_val) \
-    if ((chan)->poisoned) { return (ret_val); }
+#define stat_add(counter, n) \
+    atomic_fetch_add_explicit(&(counter), (n), memory_order_relaxed)
 
-#define channel_next(chan, idx) \
-    (((idx) + 1) % (chan)->capacity)
+#define stat_load(counter) \
+    atomic_load_explicit(&(counter), memory_order_relaxed)
+
+#define POISON_CHECK(chan, ret_val) \
+    if (atomic_load_explicit(&(chan)->poisoned, memory_order_acquire)) { \
+        return (ret_val); \
+    }
 
 #define channel_get(chan, idx) \
-    ((chan)->elts + (((idx) % (chan)->capacity) * (chan)->elt_size))
+    ((char *) (chan)->elts + (((idx) % (chan)->capacity) * (chan)->slot_size))
 
 static int
 channel_is_full(struct channel *chan)
 {
-    return (chan->rd_idx == channel_next(chan, chan->wr_idx) &&
-            !chan->poisoned);
+    size_t wr = atomic_load_explicit(&chan->wr_idx, memory_order_relaxed);
+
+    if (wr - chan->rd_cache < chan->capacity) {
+        return 0;
+    }
+    chan->rd_cache = atomic_load_explicit(&chan->rd_idx, memory_order_acquire);
+    return wr - chan->rd_cache == chan->capacity;
 }
 
 static int
 channel_is_empty(struct channel *chan)
 {
-    return (chan->rd_idx == chan->wr_idx && !chan->poisoned);
+    size_t rd = atomic_load_explicit(&chan->rd_idx, memory_order_relaxed);
+
+    if (rd != chan->wr_cache) {
+        return 0;
+    }
+    chan->wr_cache = atomic_load_explicit(&chan->wr_idx, memory_order_acquire);
+    return rd == chan->wr_cache;
 }
 
-static void
-_channel_wait_lock(struct channel *chan, int (*test)(struct channel *),
-                   pthread_cond_t *cond)
-{
-    // First test is without lock: there is only one producer, so if the channel
-    // isn't full at the moment of this call, there is no race condition
-    // possible.
-    if (test(chan)) {
-        // Take the mutex, test and wait
-        pthread_mutex_lock(&chan->mutex);
-        // Re-test, as it could no longer be full between previous test and the
-        // lock acquisition
-        while (test(chan)) {
-            pthread_cond_wait(cond, &chan->mutex);
+static int
+channel_futex(atomic_int *addr, int op, int val,
+              const struct timespec *timeout)
+{
+    return (int) syscall(SYS_futex, addr, op, val, timeout, NULL, 0);
+}
+
+/**
+ * Polls the channel according to its wait policy.
+ *
+ * @return 1 if test(chan) no longer holds or if the channel is poisoned, 0
+ *     once the policy says to sleep.
+ */
+static int
+channel_poll(struct channel *chan, int (*test)(struct channel *))
+{
+    uint64_t budget = chan->spin_ns + chan->yield_ns;
+    if (budget == 0) {
+        return 0;
+    }
+
+    uint64_t start = hgap_now_ns();
+    uint64_t elapsed = 0;
+    for (unsigned i = 1; ; i++) {
+        if (elapsed < chan->spin_ns) {
+            hgap_cpu_relax();
+        } else {
+            sched_yield();
+        }
+
+        if (!test(chan) || atomic_load_explicit(&chan->poisoned,
+                                                memory_order_relaxed)) {
+            return 1;
+        }
+
+        if (elapsed >= chan->spin_ns || i % CHANNEL_SPIN_CHECK == 0) {
+            elapsed = hgap_now_ns() - start;
+            if (elapsed >= budget) {
+                return 0;
+            }
+        }
+    }
+}
+
+/**
+ * Waits while test(chan) holds and the channel is not poisoned, for at most
+ * timeout_ns nanoseconds (CHANNEL_NO_TIMEOUT: forever).
+ *
+ * @return 1 if the wait is over, 0 if it timed out.
+ */
+static int
+channel_wait(struct channel *chan, int (*test)(struct channel *),
+             atomic_int *waiting, atomic_uint_least64_t *blocked_ns,
+             uint64_t timeout_ns)
+{
+    int ret = 1;
+
+    if (!test(chan)) {
+        return 1;
+    }
+    if (test == channel_is_full) {
+        HGAP_PROBE1(channel__full, chan);
+    } else {
+        HGAP_PROBE1(channel__empty, chan);
+    }
+
+    uint64_t start = chan->stats || timeout_ns != CHANNEL_NO_TIMEOUT ?
+                     hgap_now_ns() : 0;
+    if (channel_poll(chan, test)) {
+        goto out;
+    }
+
+    for (;;) {
+        // Advertise before re-testing (both seq_cst): either the other side
+        // sees the flag after moving its index, or we see the new index.
+        atomic_store(waiting, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (!test(chan) || atomic_load(&chan->poisoned)) {
+            break;
         }
 
-        pthread_mutex_unlock(&chan->mutex);
+        // Only sleeps if nobody cleared the flag in the meantime
+        if (timeout_ns == CHANNEL_NO_TIMEOUT) {
+            channel_futex(waiting, FUTEX_WAIT_PRIVATE, 1, NULL);
+            continue;
+        }
+
+        uint64_t elapsed = hgap_now_ns() - start;
+        if (elapsed >= timeout_ns) {
+            ret = 0;
+            break;
+        }
+        struct timespec ts = {
+            .tv_sec = (timeout_ns - elapsed) / 1000000000,
+            .tv_nsec = (timeout_ns - elapsed) % 1000000000,
+        };
+        channel_futex(waiting, FUTEX_WAIT_PRIVATE, 1, &ts);
+    }
+    atomic_store_explicit(waiting, 0, memory_order_relaxed);
+
+out:
+    if (chan->stats) {
+        stat_add(*blocked_ns, hgap_now_ns() - start);
+    }
+
+    return ret;
+}
+
+/**
+ * Accounts n elements sent, sampling the occupancy of the channel.
+ */
+static void
+channel_stats_sent(struct channel *chan, size_t wr, size_t n)
+{
+    size_t occupancy = wr - atomic_load_explicit(&chan->rd_idx,
+                                                 memory_order_relaxed);
+    size_t bucket = (MAX(occupancy, 1) - 1) * CHANNEL_STATS_BUCKETS /
+                    chan->capacity;
+
+    stat_add(chan->sent, n);
+    stat_add(chan->occupancy[MIN(bucket, CHANNEL_STATS_BUCKETS - 1)], 1);
+}
+
+/**
+ * Wakes the other side up if it is sleeping, to be called after moving an
+ * index. The flag is cleared so that only the first move signals.
+ */
+static void
+channel_wake(atomic_int *waiting)
+{
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(waiting, memory_order_relaxed) &&
+        atomic_exchange_explicit(waiting, 0, memory_order_relaxed)) {
+        channel_futex(waiting, FUTEX_WAKE_PRIVATE, 1, NULL);
     }
 }
 
 struct channel *
 channel_new(size_t elt_size, size_t capacity)
 {
-    struct channel *chan = xmalloc(sizeof(struct channel));
-    if (chan == NULL) {
+    return channel_new_flags(elt_size, capacity, 0, -1);
+}
+
+struct channel *
+channel_new_flags(size_t elt_size, size_t capacity, unsigned flags,
+                  int node)
+{
+    void *mem = NULL;
+    if (capacity == 0 ||
+        posix_memalign(&mem, CHANNEL_CACHE_LINE, sizeof (struct channel)) != 0) {
         return NULL;
     }
+    struct channel *chan = mem;
+    memset(chan, 0, sizeof *chan);
     chan->elt_size = elt_size;
-    // + 1 to include the empty slot
-    chan->capacity = capacity + 1;
-
-    chan->poisoned = 0;
+    chan->slot_size = elt_size;
+    if (flags != 0 || node >= 0) {
+        chan->slot_size = (elt_size + CHANNEL_CACHE_LINE - 1) /
+                          CHANNEL_CACHE_LINE * CHANNEL_CACHE_LINE;
+    }
+    chan->capacity = capacity;
 
-    chan->elts = xmalloc(elt_size * chan->capacity);
-    chan->rd_idx = 0;
-    chan->wr_idx = 0;
+    atomic_init(&chan->poisoned, 0);
+    atomic_init(&chan->send_waiting, 0);
+    atomic_init(&chan->recv_waiting, 0);
+    atomic_init(&chan->wr_idx, 0);
+    atomic_init(&chan->rd_idx, 0);
+    chan->rd_cache = 0;
+    chan->wr_cache = 0;
 
-    pthread_mutex_init(&chan->mutex, NULL);
-    pthread_cond_init(&chan->send_cond, NULL);
-    pthread_cond_init(&chan->recv_cond, NULL);
+    chan->elts = hgap_region_alloc(&chan->region,
+                                   chan->slot_size * chan->capacity, flags,
+                                   node);
 
     return chan;
 }
@@ -123,10 +313,7 @@ void
 channel_free(struct channel *chan)
 {
     channel_poison(chan);
-    pthread_cond_destroy(&chan->send_cond);
-    pthread_cond_destroy(&chan->recv_cond);
-    pthread_mutex_destroy(&chan->mutex);
-    free(chan->elts);
+    hgap_region_free(&chan->region);
     free(chan);
 }
 
@@ -135,14 +322,15 @@ channel_reserve(struct channel *chan)
 {
     POISON_CHECK(chan, NULL);
 
-    _channel_wait_lock(chan, channel_is_full, &chan->send_cond);
+    channel_wait(chan, channel_is_full, &chan->send_waiting,
+                 &chan->send_blocked_ns,
+                 CHANNEL_NO_TIMEOUT);
 
     // May have been poisoned while waiting
     POISON_CHECK(chan, NULL);
 
-    void *buf = channel_get(chan, chan->wr_idx);
-
-    return buf;
+    size_t wr = atomic_load_explicit(&chan->wr_idx, memory_order_relaxed);
+    return channel_get(chan, wr);
 }
 
 int
@@ -151,18 +339,63 @@ channel_send_reserved(struct channel *chan, void *data)
     POISON_CHECK(chan, 0);
 
     // Check ptr validity (channel_get handles wrapping)
-    if (data == NULL || data != channel_get(chan, chan->wr_idx)) {
+    size_t wr = atomic_load_explicit(&chan->wr_idx, memory_order_relaxed);
+    if (data == NULL || data != channel_get(chan, wr)) {
         return 0;
     }
 
-    pthread_mutex_lock(&chan->mutex);
-    int was_empty = channel_is_empty(chan);
-    chan->wr_idx = channel_next(chan, chan->wr_idx);
-    if (was_empty) {
-        // Notify any waiting receiver
-        pthread_cond_signal(&chan->recv_cond);
+    // Publishes the content of the slot
+    atomic_store_explicit(&chan->wr_idx, wr + 1, memory_order_release);
+    channel_wake(&chan->recv_waiting);
+    if (chan->stats) {
+        channel_stats_sent(chan, wr + 1, 1);
+    }
+
+    return 1;
+}
+
+size_t
+channel_reserve_n(struct channel *chan, size_t n, void **data)
+{
+    POISON_CHECK(chan, 0);
+
+    channel_wait(chan, channel_is_full, &chan->send_waiting,
+                 &chan->send_blocked_ns,
+                 CHANNEL_NO_TIMEOUT);
+
+    // May have been poisoned while waiting
+    POISON_CHECK(chan, 0);
+
+    size_t wr = atomic_load_explicit(&chan->wr_idx, memory_order_relaxed);
+    if (chan->capacity - (wr - chan->rd_cache) < n) {
+        chan->rd_cache = atomic_load_explicit(&chan->rd_idx,
+                                              memory_order_acquire);
+    }
+
+    size_t to_end = chan->capacity - wr % chan->capacity;
+    *data = channel_get(chan, wr);
+    return MIN(n, MIN(chan->capacity - (wr - chan->rd_cache), to_end));
+}
+
+int
+channel_send_reserved_n(struct channel *chan, void *data, size_t n)
+{
+    POISON_CHECK(chan, 0);
+
+    size_t wr = atomic_load_explicit(&chan->wr_idx, memory_order_relaxed);
+    if (data == NULL || data != channel_get(chan, wr) ||
+        n > chan->capacity - wr % chan->capacity ||
+        n > chan->capacity - (wr - chan->rd_cache)) {
+        return 0;
+    }
+
+    if (n > 0) {
+        atomic_store_explicit(&chan->wr_idx, wr + n, memory_order_release);
+        channel_wake(&chan->recv_waiting);
+        if (chan->stats) {
+            channel_stats_sent(chan, wr + n, n);
+        }
     }
-    pthread_mutex_unlock(&chan->mutex);
 
     return 1;
 }
@@ -183,13 +416,15 @@ channel_peek(struct channel *chan)
 {
     POISON_CHECK(chan, NULL);
 
-    _channel_wait_lock(chan, channel_is_empty, &chan->recv_cond);
+    channel_wait(chan, channel_is_empty, &chan->recv_waiting,
+                 &chan->recv_blocked_ns,
+                 CHANNEL_NO_TIMEOUT);
 
     // May have been poisoned while waiting
     POISON_CHECK(chan, NULL);
 
-    void *data = channel_get(chan, chan->rd_idx);
-    return data;
+    size_t rd = atomic_load_explicit(&chan->rd_idx, memory_order_relaxed);
+    return channel_get(chan, rd);
 }
 
 int
@@ -198,19 +433,72 @@ channel_ack(struct channel *chan, void *data)
     POISON_CHECK(chan, 0);
 
     // Invalid data
-    if (data == NULL || data != channel_get(chan, chan->rd_idx)) {
+    size_t rd = atomic_load_explicit(&chan->rd_idx, memory_order_relaxed);
+    if (data == NULL || data != channel_get(chan, rd)) {
         return 0;
     }
 
-    pthread_mutex_lock(&chan->mutex);
-    int was_full = channel_is_full(chan);
-    chan->rd_idx = channel_next(chan, chan->rd_idx);
-    if (was_full) {
-        // Notify waiting thread
-        pthread_cond_signal(&chan->send_cond);
+    // Hands the slot back to the producer once we are done reading it
+    atomic_store_explicit(&chan->rd_idx, rd + 1, memory_order_release);
+    channel_wake(&chan->send_waiting);
+    if (chan->stats) {
+        stat_add(chan->received, 1);
     }
-    pthread_mutex_unlock(&chan->mutex);
 
+    return 1;
+}
+
+int
+channel_poll_recv(struct channel *chan, uint64_t timeout_ns)
+{
+    POISON_CHECK(chan, 1);
+
+    return channel_wait(chan, channel_is_empty, &chan->recv_waiting,
+                        &chan->recv_blocked_ns, timeout_ns);
+}
+
+size_t
+channel_peek_n(struct channel *chan, size_t n, void **data)
+{
+    POISON_CHECK(chan, 0);
+
+    channel_wait(chan, channel_is_empty, &chan->recv_waiting,
+                 &chan->recv_blocked_ns,
+                 CHANNEL_NO_TIMEOUT);
+
+    // May have been poisoned while waiting
+    POISON_CHECK(chan, 0);
+
+    size_t rd = atomic_load_explicit(&chan->rd_idx, memory_order_relaxed);
+    if (chan->wr_cache - rd < n) {
+        chan->wr_cache = atomic_load_explicit(&chan->wr_idx,
+                                              memory_order_acquire);
+    }
+
+    size_t to_end = chan->capacity - rd % chan->capacity;
+    *data = channel_get(chan, rd);
+    return MIN(n, MIN(chan->wr_cache - rd, to_end));
+}
+
+int
+channel_ack_n(struct channel *chan, void *data, size_t n)
+{
+    POISON_CHECK(chan, 0);
+
+    size_t rd = atomic_load_explicit(&chan->rd_idx, memory_order_relaxed);
+    if (data == NULL || data != channel_get(chan, rd) ||
+        n > chan->capacity - rd % chan->capacity ||
+        n > chan->wr_cache - rd) {
+        return 0;
+    }
+
+    if (n > 0) {
+        atomic_store_explicit(&chan->rd_idx, rd + n, memory_order_release);
+        channel_wake(&chan->send_waiting);
+        if (chan->stats) {
+            stat_add(chan->received, n);
+        }
+    }
 
     return 1;
 }
@@ -229,9 +517,48 @@ channel_recv(struct channel *chan, void *data)
 void
 channel_poison(struct channel *chan)
 {
-    chan->poisoned = 1;
-    pthread_cond_signal(&chan->send_cond);
-    pthread_cond_signal(&chan->recv_cond);
+    atomic_store(&chan->poisoned, 1);
+    // A side about to sleep either sees the poison or gets woken up
+    atomic_store(&chan->send_waiting, 0);
+    atomic_store(&chan->recv_waiting, 0);
+    channel_futex(&chan->send_waiting, FUTEX_WAKE_PRIVATE, INT_MAX, NULL);
+    channel_futex(&chan->recv_waiting, FUTEX_WAKE_PRIVATE, INT_MAX, NULL);
+}
+
+void
+channel_set_wait_policy(struct channel *chan, uint64_t spin_ns,
+                        uint64_t yield_ns)
+{
+    // With a single CPU, spinning only delays the other side
+    chan->spin_ns = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? spin_ns : 0;
+    chan->yield_ns = yield_ns;
+}
+
+void
+channel_enable_stats(struct channel *chan)
+{
+    chan->stats = 1;
+    chan->stats_start_ns = hgap_now_ns();
+}
+
+int
+channel_get_stats(struct channel *chan, struct channel_stats *stats)
+{
+    if (!chan->stats) {
+        return 0;
+    }
+
+    stats->capacity = chan->capacity;
+    stats->elapsed_ns = hgap_now_ns() - chan->stats_start_ns;
+    stats->sent = stat_load(chan->sent);
+    stats->received = stat_load(chan->received);
+    stats->send_blocked_ns = stat_load(chan->send_blocked_ns);
+    stats->recv_blocked_ns = stat_load(chan->recv_blocked_ns);
+    for (size_t i = 0; i < CHANNEL_STATS_BUCKETS; i++) {
+        stats->occupancy[i] = stat_load(chan->occupancy[i]);
+    }
+
+    return 1;
 }
 
 size_t
@@ -239,3 +566,25 @@ channel_elt_size(struct channel *chan)
 {
     return chan->elt_size;
 }
+
+size_t
+channel_slot_size(struct channel *chan)
+{
+    return chan->slot_size;
+}
+
+size_t
+channel_len(struct channel *chan)
+{
+    size_t rd = atomic_load_explicit(&chan->rd_idx, memory_order_relaxed);
+    size_t wr = atomic_load_explicit(&chan->wr_idx, memory_order_relaxed);
+
+    // Both indexes are read racily, wr may lag behind rd
+    return wr - rd <= chan->capacity ? wr - rd : 0;
+}
+
+size_t
+channel_capacity(struct channel *chan)
+{
+    return chan->capacity;
+}
@@ -20,12 +20,14 @@
 #define HGAP_CHANNEL_H
 
 #include <stddef.h>
+#include <stdint.h>
 
 /**
  * An abstraction over a single producer single consumer channel of data.
  *
- * Implemented as a fixed size ring buffer. Should be lock-free except when
- * blocking (empty/full queue).
+ * Implemented as a fixed size lock-free ring buffer. When the queue is
+ * empty/full, the blocked side waits according to the wait policy of the
+ * channel (see channel_set_wait_policy), sleeping on a futex in the end.
  *
  * Please note that all the data is allocated once.
  */
@@ -35,10 +37,21 @@ struct channel;
  * Allocates the channel to transfer elements of size elt_size. channel_send
  * will block if capacity elements already are in the queue.
  *
- * Effectivley allocates elt_size * (capacity + 1) bytes.
+ * Effectively allocates elt_size * capacity bytes.
+ *
+ * @return the channel, or NULL if capacity is 0.
  */
 struct channel *channel_new(size_t elt_size, size_t capacity);
 
+/**
+ * Same as channel_new, allocating the storage according to the HGAP_ALLOC_*
+ * flags (see hairgap.h), on NUMA node node if node >= 0. With any flag or a
+ * node, the slots are cache line aligned (and thus padded, see
+ * channel_slot_size).
+ */
+struct channel *channel_new_flags(size_t elt_size, size_t capacity,
+                                  unsigned flags, int node);
+
 /**
  * Frees resources associated with this channel.
  */
@@ -62,6 +75,24 @@ void *channel_reserve(struct channel *chan);
  */
 int channel_send_reserved(struct channel *chan, void *data);
 
+/**
+ * Batch version of channel_reserve: reserves a contiguous run of at most n
+ * slots (channel_slot_size apart, starting at *data). Blocks until at
+ * least one slot is free. The run never wraps around the end of the ring, so
+ * it may be shorter than the free space.
+ *
+ * @return the number of reserved slots, 0 on failure.
+ */
+size_t channel_reserve_n(struct channel *chan, size_t n, void **data);
+
+/**
+ * Sends the first n slots of a run reserved by channel_reserve_n.
+ *
+ * @return 1 on success, 0 on failure or if data and n do not match a reserved
+ *     run.
+ */
+int channel_send_reserved_n(struct channel *chan, void *data, size_t n);
+
 /**
  * Send the data pointed by data of size elt_size (see channel_init).
  *
@@ -85,6 +116,29 @@ void *channel_peek(struct channel *chan);
  */
 int channel_ack(struct channel *chan, void *data);
 
+/**
+ * Batch version of channel_peek: gets a contiguous run of at most n elements
+ * (channel_slot_size apart, starting at *data). Blocks until at least one element is
+ * available. The run never wraps around the end of the ring.
+ *
+ * @return the number of elements in the run, 0 on failure.
+ */
+size_t channel_peek_n(struct channel *chan, size_t n, void **data);
+
+/**
+ * Signal the first n elements of a run gotten by channel_peek_n as read.
+ */
+int channel_ack_n(struct channel *chan, void *data, size_t n);
+
+/**
+ * Waits up to timeout_ns nanoseconds (UINT64_MAX: forever) for an element to
+ * receive.
+ *
+ * @return 1 if receiving will not block (an element is available or the
+ *     channel is poisoned), 0 if the timeout expired.
+ */
+int channel_poll_recv(struct channel *chan, uint64_t timeout_ns);
+
 /**
  * Receive data of size elt_size (see channel_init) in the buffer pointed by
  * data.
@@ -101,9 +155,76 @@ int channel_recv(struct channel *chan, void *data);
  */
 void channel_poison(struct channel *chan);
 
+/**
+ * Sets how a blocked side waits: it polls the channel for spin_ns
+ * nanoseconds while pausing the CPU, then for yield_ns nanoseconds while
+ * yielding it, then sleeps. Spinning saves the wakeup latency on hops where
+ * it matters, at the cost of burning CPU time; it is skipped on single CPU
+ * systems. Both default to 0 (sleep right away).
+ *
+ * Must be called before the channel is used.
+ */
+void channel_set_wait_policy(struct channel *chan, uint64_t spin_ns,
+                             uint64_t yield_ns);
+
+#define CHANNEL_STATS_BUCKETS 8
+
+/**
+ * Counters of a channel, see channel_enable_stats.
+ *
+ * occupancy is a histogram of the number of elements in the channel, sampled
+ * at each send: bucket i counts the sends that left between i and i + 1
+ * eighths of the capacity in the channel.
+ */
+struct channel_stats {
+    size_t capacity;
+    // Time since the stats were enabled
+    uint64_t elapsed_ns;
+    uint64_t sent;
+    uint64_t received;
+    // Time spent blocked by the producer on a full channel
+    uint64_t send_blocked_ns;
+    // Time spent blocked by the consumer on an empty channel
+    uint64_t recv_blocked_ns;
+    uint64_t occupancy[CHANNEL_STATS_BUCKETS];
+};
+
+/**
+ * Enables the counters of the channel. They cost a few relaxed atomic
+ * increments per operation and a clock read per blocking wait.
+ *
+ * Must be called before the channel is used.
+ */
+void channel_enable_stats(struct channel *chan);
+
+/**
+ * Fills stats with a snapshot of the counters of the channel. Can be called
+ * from any thread.
+ *
+ * @return 1 on success, 0 if stats are not enabled on this channel.
+ */
+int channel_get_stats(struct channel *chan, struct channel_stats *stats);
+
 /**
  * Returns the size of the elements transfered on this channel
  */
 size_t channel_elt_size(struct channel *chan);
 
+/**
+ * Returns the distance between two consecutive elements of a run (see
+ * channel_reserve_n and channel_peek_n), at least elt_size.
+ */
+size_t channel_slot_size(struct channel *chan);
+
+/**
+ * Returns the number of elements in the channel (sent and not acknowledged
+ * yet). Can be called from any thread, in which case it is only a snapshot.
+ */
+size_t channel_len(struct channel *chan);
+
+/**
+ * Returns the maximum number of elements in the channel.
+ */
+size_t channel_capacity(struct channel *chan);
+
 #endif // HGAP_CHANNEL_H
@@ -0,0 +1,168 @@
+/*
+ * This file is part of hairgap.
+ * Copyright (C) 2017  Florent MONJALET <florent.monjalet@cea.fr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "chanstats.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "common.h"
+
+#define HGAP_CHANSTATS_NAME_LEN 32
+
+struct hgap_chanstats_entry {
+    char name[HGAP_CHANSTATS_NAME_LEN];
+    struct channel *chan;
+};
+
+struct hgap_chanstats {
+    pthread_t thread;
+    sigset_t old_mask;
+    int stop;
+
+    pthread_mutex_t mutex;
+    struct hgap_chanstats_entry *entries;
+    size_t n_entries;
+};
+
+static void *
+hgap_chanstats_loop(void *arg)
+{
+    struct hgap_chanstats *cs = arg;
+    sigset_t set;
+    int sig;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    for (;;) {
+        if (sigwait(&set, &sig) != 0) {
+            continue;
+        }
+
+        pthread_mutex_lock(&cs->mutex);
+        int stop = cs->stop;
+        pthread_mutex_unlock(&cs->mutex);
+        if (stop) {
+            break;
+        }
+
+        hgap_chanstats_print(cs, stderr);
+    }
+
+    return NULL;
+}
+
+struct hgap_chanstats *
+hgap_chanstats_new(void)
+{
+    struct hgap_chanstats *cs = xmalloc(sizeof *cs);
+    sigset_t set;
+
+    cs->stop = 0;
+    cs->entries = NULL;
+    cs->n_entries = 0;
+    pthread_mutex_init(&cs->mutex, NULL);
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    CHK_PERROR(pthread_sigmask(SIG_BLOCK, &set, &cs->old_mask) == 0);
+    CHK_PERROR(pthread_create(&cs->thread, NULL, hgap_chanstats_loop,
+                              cs) == 0);
+
+    return cs;
+}
+
+void
+hgap_chanstats_add(struct hgap_chanstats *cs, const char *name,
+                   struct channel *chan)
+{
+    channel_enable_stats(chan);
+
+    pthread_mutex_lock(&cs->mutex);
+    cs->entries = realloc(cs->entries,
+                          (cs->n_entries + 1) * sizeof *cs->entries);
+    CHK_PERROR(cs->entries != NULL);
+    struct hgap_chanstats_entry *entry = &cs->entries[cs->n_entries++];
+    snprintf(entry->name, sizeof entry->name, "%s", name);
+    entry->chan = chan;
+    pthread_mutex_unlock(&cs->mutex);
+}
+
+void
+hgap_chanstats_print(struct hgap_chanstats *cs, FILE *out)
+{
+    struct channel_stats st;
+
+    pthread_mutex_lock(&cs->mutex);
+    fprintf(out, "Channel stats (blocked: %% of the time the producer waited "
+                 "on full / the consumer on empty; occupancy: %% of the sends "
+                 "per eighth of the capacity):\n");
+    for (size_t i = 0; i < cs->n_entries; i++) {
+        if (!channel_get_stats(cs->entries[i].chan, &st)) {
+            continue;
+        }
+
+        double elapsed = MAX(st.elapsed_ns, 1) / 1e9;
+        uint64_t samples = 0;
+        for (size_t j = 0; j < CHANNEL_STATS_BUCKETS; j++) {
+            samples += st.occupancy[j];
+        }
+
+        fprintf(out, "    %s (capacity %zu): %"PRIu64" elts, %.1f elt/s, "
+                     "blocked full %.1f%% empty %.1f%%, occupancy",
+                cs->entries[i].name, st.capacity, st.received,
+                st.received / elapsed,
+                100. * st.send_blocked_ns / 1e9 / elapsed,
+                100. * st.recv_blocked_ns / 1e9 / elapsed);
+        for (size_t j = 0; j < CHANNEL_STATS_BUCKETS; j++) {
+            fprintf(out, " %.0f", 100. * st.occupancy[j] / MAX(samples, 1));
+        }
+        fprintf(out, "\n");
+    }
+    pthread_mutex_unlock(&cs->mutex);
+}
+
+void
+hgap_chanstats_free(struct hgap_chanstats *cs)
+{
+    hgap_chanstats_print(cs, stderr);
+
+    pthread_mutex_lock(&cs->mutex);
+    cs->stop = 1;
+    pthread_mutex_unlock(&cs->mutex);
+    pthread_kill(cs->thread, SIGUSR1);
+    pthread_join(cs->thread, NULL);
+
+    // Do not let a pending SIGUSR1 kill the process once unblocked
+    sigset_t set;
+    struct timespec zero = { 0, 0 };
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    while (sigtimedwait(&set, NULL, &zero) == SIGUSR1) {
+        continue;
+    }
+    pthread_sigmask(SIG_SETMASK, &cs->old_mask, NULL);
+
+    pthread_mutex_destroy(&cs->mutex);
+    free(cs->entries);
+    free(cs);
+}
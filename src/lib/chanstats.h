@@ -0,0 +1,58 @@
+/*
+ * This file is part of hairgap.
+ * Copyright (C) 2017  Florent MONJALET <florent.monjalet@cea.fr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HGAP_CHANSTATS_H
+#define HGAP_CHANSTATS_H
+
+#include <stdio.h>
+
+#include "channel.h"
+
+/**
+ * Reports the stats of the channels of a pipeline, to find out which stage is
+ * the bottleneck: a summary is printed on SIGUSR1 while the transfer runs,
+ * and once at the end.
+ *
+ * SIGUSR1 is handled by a dedicated thread with sigwait(2): it is blocked in
+ * the thread creating the reporter (and thus in the threads it creates
+ * afterwards) until the reporter is freed.
+ */
+struct hgap_chanstats;
+
+/**
+ * Creates the reporter, to be called before creating the pipeline threads.
+ */
+struct hgap_chanstats *hgap_chanstats_new(void);
+
+/**
+ * Enables the stats of chan and reports them under name.
+ */
+void hgap_chanstats_add(struct hgap_chanstats *cs, const char *name,
+                        struct channel *chan);
+
+/**
+ * Prints the summary of all the channels.
+ */
+void hgap_chanstats_print(struct hgap_chanstats *cs, FILE *out);
+
+/**
+ * Prints the final summary, stops the reporter and restores the signal mask.
+ */
+void hgap_chanstats_free(struct hgap_chanstats *cs);
+
+#endif // HGAP_CHANSTATS_H
@@ -19,7 +19,39 @@
 
 #include "common.h"
 
+#include <errno.h>
 #include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+uint64_t
+hgap_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+size_t
+hgap_log2_bucket(uint64_t v, size_t n_buckets)
+{
+    size_t bucket = v == 0 ? 0 : 63 - __builtin_clzll(v);
+    return MIN(bucket, n_buckets - 1);
+}
+
+void
+hgap_print_ns(FILE *out, double ns)
+{
+    if (ns < 1e3) {
+        fprintf(out, "%.0fns", ns);
+    } else if (ns < 1e6) {
+        fprintf(out, "%.1fus", ns / 1e3);
+    } else if (ns < 1e9) {
+        fprintf(out, "%.1fms", ns / 1e6);
+    } else {
+        fprintf(out, "%.2fs", ns / 1e9);
+    }
+}
 
 void *
 xmalloc(size_t size)
@@ -29,6 +61,25 @@ xmalloc(size_t size)
     return ret;
 }
 
+ssize_t
+hgap_pwrite_all(int fd, const void *buf, size_t size, off_t offset)
+{
+    size_t done = 0;
+    while (done < size) {
+        ssize_t ret = pwrite(fd, (const char *) buf + done, size - done,
+                             offset + done);
+        if (ret <= 0) {
+            if (ret == -1 && errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        done += ret;
+    }
+
+    return done;
+}
+
 void
 dbg_hexdump(void *x, size_t len) {
     uint8_t *buf = x;
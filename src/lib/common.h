@@ -19,7 +19,9 @@
 #ifndef HGAP_COMMON_H
 #define HGAP_COMMON_H
 
+#include <stdint.h>
 #include <stdio.h>
+#include <sys/types.h>
 
 #include "hairgap.h"
 
@@ -77,6 +79,12 @@ struct sized_buf {
     char content[0];
 };
 
+/**
+ * Padding between a cache line aligned sized_buf and its content, so that the
+ * content is cache line aligned too.
+ */
+#define SBUF_ALIGNED_PAD (64 - sizeof (struct sized_buf) % 64)
+
 #define SBUF_NULL { .data=NULL, .size=0 }
 #define SBUF_RESET(x) do { (x).data = NULL; (x).size = 0; } while (0)
 
@@ -88,11 +96,45 @@ struct sized_buf {
         (e2) : ((e2) == HGAP_SUCCESS ? \
             (e1) : MIN((e1), (e2))))
 
+/**
+ * Spin-wait hint to the CPU.
+ */
+#if defined(__x86_64__) || defined(__i386__)
+#define hgap_cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define hgap_cpu_relax() __asm__ __volatile__("yield" ::: "memory")
+#else
+#define hgap_cpu_relax() __asm__ __volatile__("" ::: "memory")
+#endif
+
+/**
+ * Returns the CLOCK_MONOTONIC time, in nanoseconds.
+ */
+uint64_t hgap_now_ns(void);
+
+/**
+ * Index of v in a log2 histogram of n_buckets buckets: bucket i holds
+ * [2^i, 2^(i + 1)), bucket 0 also holds 0 and the last one everything above.
+ */
+size_t hgap_log2_bucket(uint64_t v, size_t n_buckets);
+
+/**
+ * Prints ns to out with a unit that keeps it short.
+ */
+void hgap_print_ns(FILE *out, double ns);
+
 /**
  * Malloc that exits on failure.
  */
 void *xmalloc(size_t size);
 
+/**
+ * pwrite(2) all of buf, retrying on short writes and EINTR.
+ *
+ * @return size on success, -1 on failure.
+ */
+ssize_t hgap_pwrite_all(int fd, const void *buf, size_t size, off_t offset);
+
 void dbg_hexdump(void *, size_t);
 
 #endif // HGAP_COMMON_H
@@ -16,6 +16,7 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE // cpu_set_t
 
 #include <fcntl.h>
 #include <inttypes.h>
@@ -29,6 +30,7 @@
 
 #include "common.h"
 #include "hairgap.h"
+#include "placement.h"
 #include "proto.h"
 
 int
@@ -52,6 +54,8 @@ hgap_defaults(struct hgap_config *config)
     config->keepalive = HGAP_DEF_KEEPALIVE;
     config->timeout = HGAP_DEF_TIMEOUT;
     config->mem_limit = HGAP_DEF_MEM_LIMIT;
+    config->n_writers = HGAP_DEF_N_WRITERS;
+    config->sync_interval = HGAP_DEF_SYNC_INTERVAL;
 
     return HGAP_SUCCESS;
 }
@@ -73,7 +77,19 @@ hgap_config_dump(const struct hgap_config *config, FILE *out)
             "    byterate: %lf\n"
             "    keepalive: %"PRIu64" ms\n"
             "    timeout: %"PRIu64" us\n"
-            "    memory limit: %.3f MB\n",
+            "    memory limit: %.3f MB\n"
+            "    writers: %u\n"
+            "    async writes depth: %u%s\n"
+            "    sync interval: %.3f MB\n"
+            "    busy poll: %u us\n"
+            "    receiver: %s\n"
+            "    channel stats: %s\n"
+            "    timestamps: %s\n"
+            "    trace: %s\n"
+            "    packet store: %s\n"
+            "    live stats: %s%s\n"
+            "    transport: %s\n"
+            "    allocation:%s%s%s%s\n",
             config->in,
             config->out,
             config->n_pkt,
@@ -84,7 +100,35 @@ hgap_config_dump(const struct hgap_config *config, FILE *out)
             config->byterate,
             config->keepalive,
             config->timeout,
-            config->mem_limit / (1024*1024.));
+            config->mem_limit / (1024*1024.),
+            config->n_writers,
+            config->aio_depth,
+            config->direct_io ? " (O_DIRECT)" : "",
+            config->sync_interval / (1024*1024.),
+            config->busy_poll,
+            config->single_thread ? "single thread" : "pipeline",
+            config->chan_stats ? "yes" : "no",
+            config->timestamps ? "yes" : "no",
+            config->trace_path != NULL ? config->trace_path : "no",
+            config->store_path != NULL ? config->store_path : "no",
+            config->stats_name != NULL ? "/hgap-" : "no",
+            config->stats_name != NULL ? config->stats_name : "",
+            config->memlink != NULL ? "memory link" : "udp",
+            config->alloc_flags == 0 ? " malloc" : "",
+            config->alloc_flags != 0 ? " aligned" : "",
+            config->alloc_flags & HGAP_ALLOC_HUGEPAGES ? " hugepages" : "",
+            config->alloc_flags & HGAP_ALLOC_PREFAULT ? " prefault" : "");
+
+    fprintf(out, "    placement:");
+    for (int i = 0; i < HGAP_N_STAGES; i++) {
+        if (config->stage_cpus[i] != NULL) {
+            fprintf(out, " %s=%s", hgap_stage_name(i), config->stage_cpus[i]);
+        }
+    }
+    if (config->rt_prio > 0) {
+        fprintf(out, " SCHED_FIFO=%d", config->rt_prio);
+    }
+    fprintf(out, "\n");
 }
 
 static int
@@ -118,10 +162,37 @@ check_file(FILE *file)
     return HGAP_SUCCESS;
 }
 
-int
-hgap_check_config_sender(const struct hgap_config *config)
+static int
+check_placement(const struct hgap_config *config)
+{
+    cpu_set_t set;
+
+    for (int i = 0; i < HGAP_N_STAGES; i++) {
+        if (config->stage_cpus[i] != NULL &&
+            hgap_parse_cpu_list(config->stage_cpus[i], &set) == -1) {
+            WARN("Invalid CPU list for the %s stage: %s\n",
+                 hgap_stage_name(i), config->stage_cpus[i]);
+            return HGAP_ERR_BAD_PLACEMENT;
+        }
+    }
+
+    if (config->rt_prio < 0 ||
+        (config->rt_prio > 0 &&
+         (config->rt_prio < sched_get_priority_min(SCHED_FIFO) ||
+          config->rt_prio > sched_get_priority_max(SCHED_FIFO)))) {
+        WARN("Invalid SCHED_FIFO priority: %d\n", config->rt_prio);
+        return HGAP_ERR_BAD_PLACEMENT;
+    }
+
+    return HGAP_SUCCESS;
+}
+
+// Checks the encoding parameters of the sender
+static int
+check_encoding(const struct hgap_config *config)
 {
-    if (config->pkt_size <= HGAP_HEADER_LEN) {
+    if (config->pkt_size <= HGAP_HEADER_LEN +
+                            (config->timestamps ? HGAP_TSTAMP_LEN : 0)) {
         WARN("MTU too small: %zu\n", config->pkt_size);
         return HGAP_ERR_MTU_TOO_SMALL;
     }
@@ -131,11 +202,6 @@ hgap_check_config_sender(const struct hgap_config *config)
         return HGAP_ERR_MTU_TOO_BIG;
     }
 
-    int ret = check_addr(config->addr);
-    if (ret != HGAP_SUCCESS) {
-        return ret;
-    }
-
     if (check_file(config->in) != HGAP_SUCCESS) {
         PWARN("Invalid input file");
         return HGAP_ERR_BAD_IN_FD;
@@ -151,7 +217,31 @@ hgap_check_config_sender(const struct hgap_config *config)
         return HGAP_ERR_BAD_REDUND;
     }
 
-    return HGAP_SUCCESS;
+    return check_placement(config);
+}
+
+int
+hgap_check_config_sender(const struct hgap_config *config)
+{
+    // A store is sent as it was encoded, only the sending side matters
+    int ret = config->store_path != NULL ? check_placement(config) :
+                                           check_encoding(config);
+    if (ret != HGAP_SUCCESS) {
+        return ret;
+    }
+
+    return config->memlink != NULL ? HGAP_SUCCESS : check_addr(config->addr);
+}
+
+int
+hgap_check_config_store(const struct hgap_config *config)
+{
+    if (config->store_path == NULL) {
+        WARN("No packet store\n");
+        return HGAP_ERR_BAD_OUT_FD;
+    }
+
+    return check_encoding(config);
 }
 
 int
@@ -162,5 +252,15 @@ hgap_check_config_receiver(const struct hgap_config *config)
         return HGAP_ERR_BAD_OUT_FD;
     }
 
-    return check_addr(config->addr);
+    if (config->n_writers > HGAP_MAX_N_WRITERS) {
+        WARN("Number of writers must be at most %d\n", HGAP_MAX_N_WRITERS);
+        return HGAP_ERR_BAD_N_WRITERS;
+    }
+
+    int ret = check_placement(config);
+    if (ret != HGAP_SUCCESS) {
+        return ret;
+    }
+
+    return config->memlink != NULL ? HGAP_SUCCESS : check_addr(config->addr);
 }
@@ -18,13 +18,16 @@
 
 #include "encoding.h"
 
+#include <inttypes.h>
 #include <stdlib.h>
 #include <string.h>
 #include <wirehair.h>
 
 #include "common.h"
 #include "hairgap.h"
+#include "probes.h"
 #include "proto.h"
+#include "timing.h"
 
 struct hgap_enc_chunk {
     uint64_t num;
@@ -53,6 +56,16 @@ struct hgap_decoder {
     int chunk_emitted;
 
     enum hgap_decoder_state state;
+
+    // Packets seen for the current chunk, highest and last id among them,
+    // and packets it took to reconstruct it (0 until then)
+    uint64_t chunk_pkts;
+    uint64_t chunk_max_id;
+    uint64_t chunk_last_id;
+    uint64_t chunk_needed;
+
+    // Decoder side counters, see hgap_decoder_stats
+    struct hgap_recv_stats stats;
 };
 
 
@@ -101,6 +114,19 @@ hgap_enc_chunk_free(struct hgap_enc_chunk *chunk)
     free(chunk);
 }
 
+size_t
+hgap_enc_chunk_len(const struct hgap_enc_chunk *chunk)
+{
+    return chunk->len;
+}
+
+size_t
+hgap_enc_chunk_footprint(size_t size)
+{
+    // Data copy + wirehair encoding matrix, which is roughly as big
+    return sizeof (struct hgap_enc_chunk) + 2 * size;
+}
+
 int
 hgap_enc_chunk_init(struct hgap_encoder *enc, struct hgap_enc_chunk *chunk,
                     const void *to_enc, size_t size)
@@ -123,6 +149,7 @@ hgap_enc_chunk_init(struct hgap_encoder *enc, struct hgap_enc_chunk *chunk,
             return HGAP_ERR_WIREHAIR_ERROR;
         }
     }
+    HGAP_PROBE2(chunk__encoded, chunk->num, size);
 
     return HGAP_SUCCESS;
 }
@@ -182,6 +209,12 @@ hgap_enc_chunk_emit(struct hgap_enc_chunk *chunk, void *pkt, size_t *size)
     return redund;
 }
 
+void
+hgap_enc_chunk_seek(struct hgap_enc_chunk *chunk, uint64_t id)
+{
+    chunk->next_pkt_id = id;
+}
+
 
 // Decoding part
 
@@ -309,6 +342,12 @@ hgap_decoder_new()
     dec->chunk_complete = 1;
     dec->chunk_emitted = 1;
     dec->state = T_NEW;
+    dec->chunk_pkts = 0;
+    dec->chunk_max_id = 0;
+    dec->chunk_last_id = 0;
+    dec->chunk_needed = 0;
+    memset(&dec->stats, 0, sizeof dec->stats);
+    dec->stats.min_margin = -1.0;
     return dec;
 }
 
@@ -348,6 +387,7 @@ hgap_decoder_update_state(struct hgap_decoder *dec, void *raw_pkt, size_t size)
 
     case HGAP_PKT_UNKNOWN:
         INFO("Unknown packet\n");
+        dec->stats.decoder_drops++;
         /* FALLTHROUGH */
     case HGAP_PKT_KEEPALIVE:
         /* FALLTHROUGH */
@@ -356,10 +396,59 @@ hgap_decoder_update_state(struct hgap_decoder *dec, void *raw_pkt, size_t size)
     }
 }
 
+// Accounts a packet of the current chunk, and the burst of packets missing
+// before it if any (ids start from 0 and are sent in order)
+static void
+hgap_decoder_account_pkt(struct hgap_decoder *dec, uint64_t id)
+{
+    uint64_t expected = dec->chunk_pkts > 0 ? dec->chunk_last_id + 1 : 0;
+    if (id > expected) {
+        uint64_t burst = id - expected;
+        dec->stats.burst_hist[hgap_log2_bucket(burst, HGAP_BURST_BUCKETS)]++;
+    }
+
+    dec->chunk_pkts++;
+    dec->chunk_max_id = MAX(dec->chunk_max_id, id);
+    dec->chunk_last_id = id;
+}
+
+// Accounts the gaps in the ids of the packets of the current chunk (the ones
+// after the last packet received cannot be seen) and its margin
+static void
+hgap_decoder_close_chunk(struct hgap_decoder *dec)
+{
+    struct hgap_recv_stats *stats = &dec->stats;
+
+    if (dec->chunk_pkts > 0 && dec->chunk_max_id + 1 > dec->chunk_pkts) {
+        stats->link_losses += dec->chunk_max_id + 1 - dec->chunk_pkts;
+    }
+
+    if (dec->chunk_needed > 0) {
+        uint64_t margin = dec->chunk_pkts - dec->chunk_needed;
+        double rel = (double) margin / dec->chunk_needed;
+        size_t bucket = MIN((size_t) (rel * 10), HGAP_MARGIN_BUCKETS - 1);
+
+        DBG("Chunk %"PRIu64": %"PRIu64" packets, %"PRIu64" needed, "
+            "highest id %"PRIu64"\n", dec->chunk->num, dec->chunk_pkts,
+            dec->chunk_needed, dec->chunk_max_id);
+        stats->chunks++;
+        stats->pkts_needed += dec->chunk_needed;
+        stats->pkts_margin += margin;
+        stats->margin_hist[bucket]++;
+        if (stats->min_margin < 0 || rel < stats->min_margin) {
+            stats->min_margin = rel;
+        }
+    }
+
+    dec->chunk_pkts = 0;
+    dec->chunk_max_id = 0;
+    dec->chunk_last_id = 0;
+    dec->chunk_needed = 0;
+}
+
 ssize_t
 hgap_decoder_read(struct hgap_decoder *dec, void *raw_pkt, size_t len)
 {
-    // TODO: track lost packets
     struct hgap_pkt pkt;
     hgap_pkt_parse(&pkt, raw_pkt, len);
 
@@ -370,12 +459,21 @@ hgap_decoder_read(struct hgap_decoder *dec, void *raw_pkt, size_t len)
     }
 
     if (dec->state == T_STOPPED) {
+        hgap_decoder_close_chunk(dec);
         return -HGAP_EOT;
     }
 
     if (!handle_pkt) {
         return 0;
     }
+    HGAP_PROBE3(pkt__received, pkt.hdr.chunk_num, pkt.hdr.data_id, len);
+
+    // Late packet of a chunk already done with
+    if (dec->chunk->num != (uint64_t) -1 &&
+        pkt.hdr.chunk_num < dec->chunk->num) {
+        dec->stats.decoder_drops++;
+        return 0;
+    }
 
 #if 0
     if (1 || pkt.hdr.data_id == 0) {
@@ -387,6 +485,8 @@ hgap_decoder_read(struct hgap_decoder *dec, void *raw_pkt, size_t len)
 
     // New chunk number
     if (pkt.hdr.chunk_num != dec->chunk->num) {
+        hgap_decoder_close_chunk(dec);
+
         // If incoherent chunk, error (new chunk but previous is incomplete)
         if (!dec->chunk_complete) {
             ERROR("Error: missed too many packets "
@@ -402,10 +502,15 @@ hgap_decoder_read(struct hgap_decoder *dec, void *raw_pkt, size_t len)
         // Purge the chunk (enc/dec is the same struct)
         hgap_enc_chunk_purge(dec->chunk);
         // Reinit chunk from first packet of the new chunk
+        HGAP_TIMING_CHUNK_START(HGAP_TIMING_RECV_CHUNK, pkt.hdr.chunk_num);
         hgap_dec_chunk_init(dec->chunk, &pkt);
         dec->chunk_complete = 0;
         dec->chunk_emitted = 0;
-    } else if (dec->chunk_complete) {
+    }
+
+    hgap_decoder_account_pkt(dec, pkt.hdr.data_id);
+
+    if (dec->chunk_complete) {
         // Already ready
         if (dec->chunk_emitted) {
             return 0;
@@ -418,6 +523,8 @@ hgap_decoder_read(struct hgap_decoder *dec, void *raw_pkt, size_t len)
     ssize_t ready = hgap_dec_chunk_read(dec->chunk, &pkt);
     if (ready > 0) {
         dec->chunk_complete = 1;
+        dec->chunk_needed = dec->chunk_pkts;
+        HGAP_PROBE2(chunk__decodable, dec->chunk->num, dec->chunk_pkts);
     }
 
     return ready;
@@ -446,6 +553,22 @@ hgap_decoder_emit(struct hgap_decoder *dec, void *out_buf, size_t len)
     }
 
     dec->chunk_emitted = 1;
+    HGAP_PROBE2(chunk__reconstructed, dec->chunk->num, dec->chunk->len);
 
     return HGAP_SUCCESS;
 }
+
+uint64_t
+hgap_decoder_chunk_num(struct hgap_decoder *dec)
+{
+    return dec->chunk->num;
+}
+
+void
+hgap_decoder_stats(struct hgap_decoder *dec, struct hgap_recv_stats *stats)
+{
+    *stats = dec->stats;
+    if (stats->min_margin < 0) {
+        stats->min_margin = 0;
+    }
+}
@@ -19,6 +19,7 @@
 #ifndef HGAP_ENCODING_H
 #define HGAP_ENCODING_H
 
+#include "hairgap.h"
 #include "proto.h"
 
 /**
@@ -127,6 +128,17 @@ int hgap_enc_chunk_init(struct hgap_encoder *enc, struct hgap_enc_chunk *chunk,
  */
 void hgap_enc_chunk_free(struct hgap_enc_chunk *chunk);
 
+/**
+ * Size of the data this chunk encodes.
+ */
+size_t hgap_enc_chunk_len(const struct hgap_enc_chunk *chunk);
+
+/**
+ * Approximate amount of memory held by a hgap_enc_chunk initialized with size
+ * bytes of data (copy of the data plus the wirehair encoder state).
+ */
+size_t hgap_enc_chunk_footprint(size_t size);
+
 
 /**
  * Write a ready-to-send hairgap raw packet to pkt. The number of calls to
@@ -140,6 +152,12 @@ void hgap_enc_chunk_free(struct hgap_enc_chunk *chunk);
 double hgap_enc_chunk_emit(struct hgap_enc_chunk *chunk, void *pkt,
                            size_t *size);
 
+/**
+ * Makes id the id of the next packet emitted by chunk (packets are emitted
+ * in sequence from 0 otherwise), to regenerate given packets of a chunk.
+ */
+void hgap_enc_chunk_seek(struct hgap_enc_chunk *chunk, uint64_t id);
+
 /**
  * Creates a handwave packet in pkt.
  *
@@ -225,4 +243,22 @@ ssize_t hgap_decoder_read(struct hgap_decoder *dec, void *raw_pkt, size_t len);
  */
 int hgap_decoder_emit(struct hgap_decoder *dec, void *out_buf, size_t len);
 
+/**
+ * Number of the chunk being decoded, i.e. the one emitted by
+ * hgap_decoder_emit once hgap_decoder_read reported it ready. Chunks are
+ * numbered from 0 and all of them but the last one have the same size.
+ */
+uint64_t hgap_decoder_chunk_num(struct hgap_decoder *dec);
+
+/**
+ * Counters of the decoder so far, for the chunks it is done with (the current
+ * one is accounted once the next one starts or the transfer ends).
+ *
+ * Only the decoder side fields of stats are set: link_losses (all the
+ * packets that never reached the decoder, whatever the cause),
+ * decoder_drops, the chunk and margin counters and the histograms. The others
+ * are zeroed.
+ */
+void hgap_decoder_stats(struct hgap_decoder *dec, struct hgap_recv_stats *stats);
+
 #endif // HGAP_ENCODING_H
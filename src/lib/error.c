@@ -68,6 +68,11 @@ hgap_err_str(int err)
             return "Receive socket probably timed out";
         case HGAP_ERR_IPC:
             return "Internal (IPC) error";
+        case HGAP_ERR_BAD_PLACEMENT:
+            return "Bad thread placement (invalid CPU list or priority)";
+        case HGAP_ERR_BAD_N_WRITERS:
+            return "Bad number of writers (should be <= "
+                   STR(HGAP_MAX_N_WRITERS)")";
         default:
             return "Unknown error";
     }
@@ -43,6 +43,114 @@
 #define HGAP_DEF_KEEPALIVE 500
 #define HGAP_DEF_TIMEOUT 1 * 1000 * 1000
 #define HGAP_DEF_MEM_LIMIT 100 * 1024 * 1024
+#define HGAP_DEF_N_WRITERS 1
+// Each writer needs at least 2 of the chunks in flight of the receiver
+#define HGAP_MAX_N_WRITERS 128
+#define HGAP_DEF_AIO_DEPTH 4
+#define HGAP_DEF_SYNC_INTERVAL 100 * 1024 * 1024
+
+/**
+ * Stages of the pipelines, i.e. the threads of the sender (read, encode, send)
+ * and of the receiver (net, decode, write).
+ */
+enum hgap_stage {
+    HGAP_STAGE_READ = 0,
+    HGAP_STAGE_ENCODE,
+    HGAP_STAGE_SEND,
+    HGAP_STAGE_NET,
+    HGAP_STAGE_DECODE,
+    HGAP_STAGE_WRITE,
+    HGAP_N_STAGES
+};
+
+/**
+ * Counters of the packets sent by hgap_send (see send_stats).
+ *
+ * backpressure_waits counts the times sending had to wait because the local
+ * socket buffer or the device queue was full (EAGAIN, ENOBUFS), local_drops
+ * the packets that could not be sent at all despite the retries: they are
+ * lost on the sending host, and eat into the redundancy. limiter_sleeps
+ * counts the pauses of the rate limiter.
+ */
+struct hgap_send_stats {
+    uint64_t pkts_sent;
+    uint64_t bytes_sent;
+    uint64_t backpressure_waits;
+    uint64_t local_drops;
+    uint64_t limiter_sleeps;
+};
+
+/**
+ * Counters of the packets received by hgap_receive (see recv_stats), with the
+ * packet loss split by where it happened:
+ *  - kernel_drops: dropped by the receiving host because the socket buffer
+ *    was full (the receiver is too slow or its buffers too small, tune the
+ *    host);
+ *  - link_losses: the other missing packets, lost on the sending host or on
+ *    the link (tune the redundancy);
+ *  - decoder_drops: received but unusable by the decoder (unknown packets,
+ *    late packets of a previous chunk).
+ * Missing packets are detected from the gaps in the packet ids of a chunk, so
+ * the ones lost after the last packet received for a chunk are not counted.
+ *
+ * The redundancy margin of a chunk is the number of its packets received
+ * after it could be reconstructed, i.e. how many more could have been lost:
+ * min_margin is the smallest one, relative to the packets needed by the
+ * chunk, and margin_hist[i] counts the chunks whose relative margin is
+ * between i and i + 1 tenths (the last bucket holds 100% and above). A
+ * redundancy can safely be lowered as long as the margin of every chunk
+ * stays well above 0. burst_hist[i] counts the bursts of consecutive missing
+ * packets whose length is between 2^i and 2^(i + 1) - 1 (the last bucket
+ * holds the longer ones).
+ *
+ * With timestamps, the one-way delay of the stamped packets (kernel receive
+ * time minus send time) is summarized by delay_min, delay_mean and delay_max
+ * in ns, which include the offset between the clocks of the two hosts unless
+ * they are synchronized (PTP). The histograms do not depend on that offset:
+ * queueing_hist is the delay above the smallest one seen so far (the time
+ * spent in queues along the way), jitter_hist the variation of the delay
+ * between two consecutive packets and spacing_hist the time between their
+ * arrivals (to check the pacing). Bucket 0 counts the values below 1us and
+ * bucket i > 0 the ones between 2^(i - 1) and 2^i us (the last bucket holds
+ * the longer ones). jitter is the smoothed jitter of RFC 3550, in ns.
+ */
+#define HGAP_BURST_BUCKETS 12
+#define HGAP_MARGIN_BUCKETS 11
+#define HGAP_LATENCY_BUCKETS 21
+
+struct hgap_recv_stats {
+    uint64_t pkts_received;
+    uint64_t bytes_received;
+    uint64_t kernel_drops;
+    uint64_t link_losses;
+    uint64_t decoder_drops;
+
+    // Chunks reconstructed, with the packets they needed and their margin
+    uint64_t chunks;
+    uint64_t pkts_needed;
+    uint64_t pkts_margin;
+    double min_margin;
+    uint64_t margin_hist[HGAP_MARGIN_BUCKETS];
+    uint64_t burst_hist[HGAP_BURST_BUCKETS];
+
+    // Latency of the packets that carry a send timestamp
+    uint64_t stamped_pkts;
+    int64_t delay_min;
+    int64_t delay_max;
+    double delay_mean;
+    double jitter;
+    uint64_t queueing_hist[HGAP_LATENCY_BUCKETS];
+    uint64_t jitter_hist[HGAP_LATENCY_BUCKETS];
+    uint64_t spacing_hist[HGAP_LATENCY_BUCKETS];
+};
+
+// In-memory link, see memlink.h
+struct hgap_memlink;
+
+// Allocation flags of the pipeline buffers (see alloc_flags)
+#define HGAP_ALLOC_ALIGNED 0x1
+#define HGAP_ALLOC_HUGEPAGES 0x2
+#define HGAP_ALLOC_PREFAULT 0x4
 
 /**
  * in: a file object to read from when sending.
@@ -58,13 +166,89 @@
  * port: destination port (binding port on the receiver side, destination port
  *     on the sender side).
  * byterate: the max amount for bytes/second to send
- * keepalive: the keepalive period, in ms. Send a keepalive every keepalive ms.
- *     0 disables it. Sender side only.
+ * keepalive: the keepalive period, in ms. Send a keepalive when nothing has
+ *     been sent for keepalive ms. 0 disables it. Sender side only.
  * timeout: the timeout (in us) after which to consider a transfer interrupted
  *     if no packets are received. 0 disables it (not recommended). Receiver
  *     side only.
  *  mem_limit: the approximate maximum amount of memory to use to buffer
- *      incoming packets and chunk (_very_ approximate).
+ *      chunks and packets between the pipeline stages (input and encoded
+ *      chunks on the sender side, incoming packets and decoded chunks on the
+ *      receiver side, including the socket receive buffer). At least one
+ *      chunk in flight per stage is always allowed, whatever the limit.
+ * n_writers: the number of writer threads, at most HGAP_MAX_N_WRITERS (0
+ *     is the same as 1). With more than one, each decoded chunk is written
+ *     at its position in the output as soon as it is decoded (pwrite(2)),
+ *     which requires out to be a regular file (falls back to a single
+ *     sequential writer otherwise). Receiver side only.
+ * aio_depth: when > 0 and out is a regular file written by a single writer,
+ *     decoded chunks are coalesced in big page-aligned buffers and written
+ *     asynchronously (io_uring), with up to aio_depth writes in flight.
+ *     Receiver side only.
+ * direct_io: write the output with O_DIRECT, bypassing the page cache. Uses
+ *     the asynchronous writer (with HGAP_DEF_AIO_DEPTH if aio_depth is 0).
+ *     Receiver side only.
+ * sync_interval: the written output is flushed to disk in the background
+ *     every sync_interval bytes (and dropped from the page cache once
+ *     flushed), so that dirty data does not pile up until the end of the
+ *     transfer. 0 disables it, the output is then only flushed at the end.
+ *     Receiver side only.
+ * chan_stats: collect stats (blocked time, occupancy, throughput) on the
+ *     channels between the pipeline threads and print a summary at the end of
+ *     the transfer, and on SIGUSR1 while it runs (SIGUSR1 is then blocked in
+ *     the calling thread during the transfer).
+ * alloc_flags: how the big pipeline buffers (packet and input chunk
+ *     channels, decoded chunk pools) are allocated, HGAP_ALLOC_* flags. 0 is
+ *     plain malloc. HGAP_ALLOC_ALIGNED maps them and aligns the elements and
+ *     their payloads on cache lines, HGAP_ALLOC_HUGEPAGES backs them with huge
+ *     pages (reserved ones if any, transparent ones otherwise) to reduce TLB
+ *     misses and HGAP_ALLOC_PREFAULT locks them in memory (or at least
+ *     faults them in) at allocation, to avoid first-touch stalls at the
+ *     beginning of the transfer. The last two imply HGAP_ALLOC_ALIGNED.
+ * stage_cpus: per stage (indexed by enum hgap_stage), the CPUs its threads
+ *     are pinned to, as a list in the cpuset format ("0-3,8"). NULL leaves
+ *     the stage unpinned. The buffers filled by a pinned stage (packets for
+ *     net, decoded chunks for decode, input chunks for read) are allocated on
+ *     the NUMA node of its first CPU, see alloc_flags.
+ * rt_prio: when > 0, the network threads (send and net stages)
+ *     run with the SCHED_FIFO policy at this priority, so that they are not
+ *     delayed by the other threads (requires CAP_SYS_NICE).
+ * busy_poll: when > 0, the net thread busy-polls the socket instead of
+ *     sleeping until packets arrive, to save the wakeup latency: the socket
+ *     is set up for kernel busy polling (SO_BUSY_POLL with this budget in us,
+ *     SO_PREFER_BUSY_POLL) and non-blocking receives are retried until data
+ *     arrives or timeout expires. It burns a whole CPU, the net stage should
+ *     be pinned to a dedicated one (see stage_cpus). Receiver side only.
+ * single_thread: receive with a single thread (placed as the net stage)
+ *     running an event loop that receives, decodes and writes each chunk in
+ *     turn, instead of the net/decode/write thread pipeline. Cheaper on
+ *     small machines, where the handoffs between the threads cost more than
+ *     the work itself. Implies a single writer. Receiver side only.
+ * timestamps: the sender appends its send time to every data packet
+ *     (HGAP_TSTAMP_LEN bytes of pkt_size), and the receiver measures the
+ *     one-way delay, the jitter and the arrival spacing of the packets that
+ *     carry one from their kernel receive time (see struct hgap_recv_stats).
+ *     Absolute delays need the clocks of both hosts to be synchronized.
+ * trace_path: if not NULL, the header of every packet received (no
+ *     payload) is logged in this file, to replay the transfer offline with
+ *     hgap-replay (see trace.h). Receiver side only.
+ * store_path: if not NULL, the packet store (see pktstore.h): hgap_store
+ *     encodes in into it once, then hgap_send sends its packets as they are,
+ *     without encoding anything, instead of reading in. The store keeps the
+ *     n_pkt, pkt_size, redund and timestamps it was encoded with, the ones
+ *     of the config are ignored when sending it. Sender side only.
+ * send_stats: if not NULL, filled with the counters of the sender at the end
+ *     of hgap_send. Sender side only.
+ * recv_stats: if not NULL, filled with the counters of the receiver at the
+ *     end of hgap_receive. Receiver side only.
+ * stats_name: if not NULL, live counters (throughput, chunks through each
+ *     stage, channel depths, drops...) are published during the transfer in
+ *     the POSIX shared memory segment /hgap-stats_name, removed at the end.
+ *     See hgap-stat to read them.
+ * memlink: if not NULL, the packets go through this in-memory link instead
+ *     of UDP, from hgap_send to hgap_receive running in the same process
+ *     (see memlink.h), and addr and port are not used. The socket options
+ *     (busy_poll, kernel receive times) do not apply to it.
  **/
 struct hgap_config {
     FILE *in;
@@ -78,6 +262,23 @@ struct hgap_config {
     uint64_t keepalive;
     uint64_t timeout;
     size_t mem_limit;
+    unsigned n_writers;
+    unsigned aio_depth;
+    int direct_io;
+    size_t sync_interval;
+    int chan_stats;
+    unsigned alloc_flags;
+    const char *stage_cpus[HGAP_N_STAGES];
+    int rt_prio;
+    unsigned busy_poll;
+    int single_thread;
+    int timestamps;
+    const char *trace_path;
+    const char *store_path;
+    struct hgap_send_stats *send_stats;
+    struct hgap_recv_stats *recv_stats;
+    const char *stats_name;
+    struct hgap_memlink *memlink;
 
     // FIXME: sockaddr* rather than addr?
 };
@@ -94,13 +295,23 @@ int hgap_defaults(struct hgap_config *config);
 
 /**
  * Send data as specified by config (from in to addr:port). This will start
- * 3 additional pthreads (or 2 if you disabled keepalives). Returns once the
+ * 2 additional pthreads, or none when sending the packet store
+ * config->store_path, which runs in the calling thread. Returns once the
  * transfer is complete.
  *
  * @return HGAP_SUCCESS on success, HGAP_ERR_* on failure
  **/
 int hgap_send(const struct hgap_config *config);
 
+/**
+ * Encodes the data of config->in into the packet store config->store_path,
+ * as hgap_send would before sending it, and reports the encoding
+ * throughput. Nothing is sent, config->addr is not used.
+ *
+ * @return HGAP_SUCCESS on success, HGAP_ERR_* on failure
+ **/
+int hgap_store(const struct hgap_config *config);
+
 /**
  * Similar to hgap_send but receives data from config->addr, config->port and
  * writes it to config->out.
@@ -119,16 +330,38 @@ void hgap_config_dump(const struct hgap_config *config, FILE *out);
 
 /**
  * Returns HGAP_SUCCESS if the config is valid for sending data, HGAP_ERR_*
- * otherwise.
+ * otherwise. When sending a packet store, the encoding parameters and the
+ * input file are not checked.
  */
 int hgap_check_config_sender(const struct hgap_config *config);
 
+/**
+ * Returns HGAP_SUCCESS if the config is valid for hgap_store, HGAP_ERR_*
+ * otherwise.
+ */
+int hgap_check_config_store(const struct hgap_config *config);
+
 /**
  * Returns HGAP_SUCCESS if the config is valid for receiving data, HGAP_ERR_*
  * otherwise.
  */
 int hgap_check_config_receiver(const struct hgap_config *config);
 
+/**
+ * Sets the CPUs of a stage from a "STAGE=CPUS" spec (e.g. "net=2-3", stages
+ * being read, encode, send, net, decode and write). The
+ * config then points into spec. The CPU list is only checked by
+ * hgap_check_config_*.
+ *
+ * @return HGAP_SUCCESS, or HGAP_ERR_BAD_PLACEMENT if the stage is unknown.
+ */
+int hgap_config_place_stage(struct hgap_config *config, const char *spec);
+
+/**
+ * Returns the name of a stage.
+ */
+const char *hgap_stage_name(enum hgap_stage stage);
+
 // ---------------------------- Error functions --------------------------------
 
 enum {
@@ -153,6 +386,8 @@ enum {
     HGAP_ERR_NETWORK,
     HGAP_ERR_IPC,
     HGAP_ERR_INTERNAL,
+    HGAP_ERR_BAD_PLACEMENT,
+    HGAP_ERR_BAD_N_WRITERS,
 };
 
 /**
@@ -16,129 +16,335 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE // recvmmsg, cpu_set_t
+
 #include "hairgap.h"
 
-#include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <netinet/in.h>
+#include <inttypes.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/timerfd.h>
 #include <unistd.h>
 
 #include <wirehair.h>
 
+#include "awriter.h"
+#include "bufpool.h"
 #include "channel.h"
+#include "chanstats.h"
 #include "common.h"
 #include "encoding.h"
+#include "livestats.h"
+#include "membudget.h"
+#include "placement.h"
+#include "probes.h"
+#include "syncer.h"
+#include "timing.h"
+#include "trace.h"
+#include "transport.h"
+
+// Upper bound of the number of decoded chunks in flight
+#define HGAPR_MAX_CHUNKS 256
+// Otherwise the pools of the writers could hold more chunks than the
+// completion ring tracks
+#if HGAPR_MAX_CHUNKS / HGAP_MAX_N_WRITERS < BUFPOOL_MIN_BUFS
+#error "HGAP_MAX_N_WRITERS too big for HGAPR_MAX_CHUNKS"
+#endif
+// Packets moved at once between the net thread and the decoder
+#define HGAPR_PKT_BURST 32
+// Wait policy of chan_net2dec: packets arrive in quick succession, spin a bit
+// before sleeping rather than paying a wakeup per burst
+#define HGAPR_NET2DEC_SPIN_NS (20 * 1000)
+#define HGAPR_NET2DEC_YIELD_NS (100 * 1000)
+
+// Minimum interval between two live reports of kernel drops
+#define HGAPR_DROP_REPORT_NS (1000 * 1000 * 1000)
+
+/**
+ * Ancillary data buffer of a received packet, for the SO_RXQ_OVFL counter
+ * and the SO_TIMESTAMPNS receive time.
+ */
+union hgapr_cmsg_buf {
+    char buf[CMSG_SPACE(sizeof (uint32_t)) +
+             CMSG_SPACE(sizeof (struct timespec))];
+    struct cmsghdr align;
+};
 
-#define HGAPR_WRITE_SYNC_THRESHOLD (100 * 1024 * 1024)
+/**
+ * Latency of the timestamped packets, see struct hgap_recv_stats.
+ */
+struct hgapr_latency {
+    uint64_t n;
+    int64_t min;
+    int64_t max;
+    double sum;
+    double jitter;
+    // Delay and receive time of the previous stamped packet
+    int64_t last_delay;
+    uint64_t last_rx;
+    uint64_t queueing_hist[HGAP_LATENCY_BUCKETS];
+    uint64_t jitter_hist[HGAP_LATENCY_BUCKETS];
+    uint64_t spacing_hist[HGAP_LATENCY_BUCKETS];
+};
 
-static int
-hgapr_open_udp_socket(char *addr, short port)
+/**
+ * Counters of the net thread, see struct hgap_recv_stats.
+ */
+struct hgapr_rx_stats {
+    uint64_t pkts;
+    uint64_t bytes;
+    // Socket drop counter (SO_RXQ_OVFL), and its value at the last report
+    uint32_t kernel_drops;
+    uint32_t reported_drops;
+    uint64_t last_report;
+    // Where they are published, may be NULL
+    struct hgap_live *live;
+    // Only measured with config->timestamps
+    int timestamps;
+    struct hgapr_latency latency;
+    // Where the packets are logged, may be NULL
+    struct hgap_trace *trace;
+};
+
+/**
+ * Points the first n messages to their ancillary data buffers (to be done
+ * before each receive, the kernel shrinks msg_controllen).
+ */
+static void
+hgapr_prepare_cmsgs(struct mmsghdr *msgs, union hgapr_cmsg_buf *cmsgs,
+                    size_t n)
 {
-    struct sockaddr_in servaddr;
-    socklen_t socklen = sizeof(servaddr);
-    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
-    if (sockfd == -1) {
-        perror("socket");
-        goto err;
+    for (size_t i = 0; i < n; i++) {
+        msgs[i].msg_hdr.msg_control = cmsgs[i].buf;
+        msgs[i].msg_hdr.msg_controllen = sizeof cmsgs[i].buf;
     }
+}
 
-    memset(&servaddr, 0, sizeof(servaddr));
-    servaddr.sin_family = AF_INET;
-    if ((servaddr.sin_addr.s_addr = inet_addr(addr)) == INADDR_NONE) {
-        goto err;
-    }
+// Bucket of a duration in a latency histogram (see struct hgap_recv_stats)
+static size_t
+hgapr_latency_bucket(uint64_t ns)
+{
+    uint64_t us = ns / 1000;
+    return us == 0 ? 0 : 1 + hgap_log2_bucket(us, HGAP_LATENCY_BUCKETS - 1);
+}
 
-    servaddr.sin_port = htons(port);
+/**
+ * Accounts the packet pkt of size bytes received at rx (CLOCK_REALTIME ns,
+ * 0 if the kernel did not tell), if it carries a send timestamp.
+ */
+static void
+hgapr_account_latency(struct hgapr_latency *lat, const void *pkt, size_t size,
+                      uint64_t rx)
+{
+    uint64_t tx;
+    if (!hgap_pkt_tstamp(pkt, size, &tx)) {
+        return;
+    }
 
-    if (bind(sockfd, (struct sockaddr *) &servaddr, socklen) == -1) {
-        perror("socket");
-        goto err;
+    if (rx == 0) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        rx = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
     }
 
-    if (0) {
-err:
-        if (sockfd != -1) {
-            close(sockfd);
+    // May be negative if the clocks are not synchronized
+    int64_t delay = (int64_t) (rx - tx);
+    if (lat->n == 0 || delay < lat->min) {
+        lat->min = delay;
+    }
+    if (lat->n == 0 || delay > lat->max) {
+        lat->max = delay;
+    }
+    lat->sum += delay;
+    lat->queueing_hist[hgapr_latency_bucket(delay - lat->min)]++;
+
+    if (lat->n > 0) {
+        uint64_t variation = llabs(delay - lat->last_delay);
+        lat->jitter += (variation - lat->jitter) / 16;
+        lat->jitter_hist[hgapr_latency_bucket(variation)]++;
+        if (rx >= lat->last_rx) {
+            lat->spacing_hist[hgapr_latency_bucket(rx - lat->last_rx)]++;
         }
-        sockfd = -1;
     }
-
-    return sockfd;
+    lat->last_delay = delay;
+    lat->last_rx = rx;
+    lat->n++;
 }
 
+/**
+ * Accounts a burst of n received packets: counts them, picks up the socket
+ * drop counter, reporting new drops at most every HGAPR_DROP_REPORT_NS,
+ * measures the latency of the stamped ones and logs them in the trace.
+ */
 static void
-hgapr_set_socket_timeout(int sockfd, uint64_t timeout) {
-    struct timeval tv;
+hgapr_account_burst(struct hgapr_rx_stats *stats, struct mmsghdr *msgs,
+                    size_t n)
+{
+    uint64_t burst_ns = stats->trace != NULL ? hgap_now_ns() : 0;
+
+    for (size_t i = 0; i < n; i++) {
+        uint64_t rx = 0;
+
+        stats->pkts++;
+        stats->bytes += msgs[i].msg_len;
+
+        // The drop counter is only there once the socket dropped something
+        struct msghdr *hdr = &msgs[i].msg_hdr;
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(hdr); cmsg != NULL;
+             cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+            if (cmsg->cmsg_level != SOL_SOCKET) {
+                continue;
+            }
+            if (cmsg->cmsg_type == SO_RXQ_OVFL) {
+                uint32_t drops;
+                memcpy(&drops, CMSG_DATA(cmsg), sizeof drops);
+                stats->kernel_drops = drops;
+            } else if (cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+                struct timespec ts;
+                memcpy(&ts, CMSG_DATA(cmsg), sizeof ts);
+                rx = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+            }
+        }
 
-    tv.tv_sec = timeout / 1000000;
-    tv.tv_usec = timeout % 1000000;
+        if (stats->timestamps) {
+            hgapr_account_latency(&stats->latency, hdr->msg_iov->iov_base,
+                                  msgs[i].msg_len, rx);
+        }
+        if (stats->trace != NULL) {
+            hgap_trace_pkt(stats->trace, burst_ns, hdr->msg_iov->iov_base,
+                           msgs[i].msg_len);
+        }
+    }
+
+    hgap_live_set(stats->live, HGAP_LIVE_PKTS_RECEIVED, stats->pkts);
+    hgap_live_set(stats->live, HGAP_LIVE_BYTES_RECEIVED, stats->bytes);
+    hgap_live_set(stats->live, HGAP_LIVE_KERNEL_DROPS, stats->kernel_drops);
+
+    if (stats->kernel_drops != stats->reported_drops) {
+        uint64_t now = hgap_now_ns();
+        if (now - stats->last_report >= HGAPR_DROP_REPORT_NS) {
+            WARN("Socket buffer full, %"PRIu32" packets dropped by the kernel "
+                 "(%"PRIu32" total)\n",
+                 stats->kernel_drops - stats->reported_drops,
+                 stats->kernel_drops);
+            stats->reported_drops = stats->kernel_drops;
+            stats->last_report = now;
+        }
+    }
+}
 
-    CHK_PERROR(setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO,
-                &tv, sizeof(tv)) != -1);
+/**
+ * Picks up the final drop counter of the transport before closing it: the
+ * socket drop counter only comes with the packets queued after a drop, so
+ * the drops at the end of the transfer are not seen by hgapr_account_burst.
+ */
+static void
+hgapr_final_drops(struct hgap_transport *tr, struct hgapr_rx_stats *stats)
+{
+    stats->kernel_drops = MAX(stats->kernel_drops, hgap_transport_drops(tr));
 }
 
+/**
+ * Receives packets in bursts straight into the channel slots: the transport
+ * waits for the first packet (honoring the timeout) and takes the ones
+ * already queued without blocking. With config->busy_poll, the socket is
+ * polled instead.
+ *
+ * Packet payloads start pad bytes after their content. The received packets
+ * and the kernel drops are accounted in stats.
+ */
 static int
-hgapr_net_reader(struct channel *chan, char *addr, short port, uint64_t timeout)
+hgapr_net_reader(struct channel *chan, size_t pad,
+                 const struct hgap_config *config,
+                 struct hgapr_rx_stats *stats)
 {
     struct sized_buf *pkt = NULL;
     int retval = HGAP_SUCCESS;
-    size_t mtu = channel_elt_size(chan) - sizeof (struct sized_buf);
-    int sockfd;
+    size_t slot_size = channel_slot_size(chan);
+    size_t mtu = channel_elt_size(chan) - sizeof (struct sized_buf) - pad;
+    struct mmsghdr msgs[HGAPR_PKT_BURST];
+    struct iovec iovs[HGAPR_PKT_BURST];
+    union hgapr_cmsg_buf cmsgs[HGAPR_PKT_BURST];
+    struct hgap_transport *tr;
     int started = 0;
+    int done = 0;
+    // No timeout until the transfer starts
+    uint64_t timeout = 0;
 
-    if ((sockfd = hgapr_open_udp_socket(addr, port)) == -1) {
+    if ((tr = hgap_transport_receiver(config)) == NULL) {
         retval = HGAP_ERR_NETWORK;
         ERROR("Could not open socket\n");
         goto closing;
     }
 
-    for (;;) {
-        pkt = channel_reserve(chan);
-        CHK(pkt);
-        pkt->data = pkt->content;
-        ssize_t pkt_size = recvfrom(sockfd, pkt->data, mtu, 0, NULL, NULL);
+    memset(msgs, 0, sizeof msgs);
+    while (!done) {
+        void *run = NULL;
+        size_t n = channel_reserve_n(chan, HGAPR_PKT_BURST, &run);
+        if (n == 0) {
+            // Poisoned by the decoder, which gave up
+            DBG("chan_net2dec reserve error\n");
+            retval = HGAP_ERR_IPC;
+            break;
+        }
+        for (size_t i = 0; i < n; i++) {
+            pkt = (struct sized_buf *) ((char *) run + i * slot_size);
+            pkt->data = pkt->content + pad;
+            iovs[i].iov_base = pkt->data;
+            iovs[i].iov_len = mtu;
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        hgapr_prepare_cmsgs(msgs, cmsgs, n);
 
-        if (pkt_size == -1) {
-            if (errno == ETIMEDOUT || errno == EAGAIN) {
+        int n_recv = hgap_transport_recv(tr, msgs, n, 0, timeout);
+        if (n_recv == -1) {
+            if (errno == ETIMEDOUT) {
                 ERROR("End of reception, socket timed out\n");
                 retval = HGAP_ERR_TIMEOUT;
             } else {
-                perror("recvfrom");
+                perror("recvmmsg");
                 retval = HGAP_ERR_NETWORK;
             }
             break;
         }
-
-        pkt->size = pkt_size;
-        enum hgap_pkt_t pkt_type = hgap_pkt_type(pkt->data, pkt->size);
-
-        if (pkt_type == HGAP_PKT_BEGIN && !started) {
-            started = 1;
-            hgapr_set_socket_timeout(sockfd, timeout);
+        hgapr_account_burst(stats, msgs, n_recv);
+
+        size_t n_pkts = 0;
+        while (n_pkts < (size_t) n_recv && !done) {
+            pkt = (struct sized_buf *) ((char *) run + n_pkts * slot_size);
+            pkt->size = msgs[n_pkts].msg_len;
+            n_pkts++;
+
+            enum hgap_pkt_t pkt_type = hgap_pkt_type(pkt->data, pkt->size);
+            if (pkt_type == HGAP_PKT_BEGIN && !started) {
+                started = 1;
+                timeout = config->timeout;
+            } else if (pkt_type == HGAP_PKT_END) {
+                done = 1;
+            }
         }
 
         // Always send to next thread that really handles the hairgap protocol
-        if (!channel_send_reserved(chan, pkt)) {
+        if (!channel_send_reserved_n(chan, run, n_pkts)) {
             DBG("chan_net2dec send error\n");
             retval = HGAP_ERR_IPC;
             break;
         }
-
-        if (pkt_type == HGAP_PKT_END) {
-            break;
-        }
     }
 
 closing:
-    if (sockfd != -1) {
-        close(sockfd);
+    if (tr != NULL) {
+        hgapr_final_drops(tr, stats);
+        hgap_transport_free(tr);
     }
 
     // Poison pill
@@ -155,43 +361,264 @@ closing:
     return retval;
 }
 
+/**
+ * A decoded chunk, as sent by the decoder to a writer. A NULL data is the
+ * poison pill.
+ */
+struct hgapr_chunk {
+    uint64_t num;
+    // Position in the output, relative to the beginning of the transfer
+    off_t offset;
+    size_t size;
+    void *data;
+};
+
+/**
+ * Completion map of the chunks being written, shared by the writers. Tracks
+ * the contiguous part of the output that has been written whatever the order
+ * of the writes.
+ *
+ * At most HGAPR_MAX_CHUNKS chunks are in flight (each of them holds a pool
+ * buffer), so a ring of that size is enough.
+ */
+struct hgapr_completion {
+    pthread_mutex_t mutex;
+    // First chunk not written yet
+    uint64_t next;
+    // Bytes written contiguously from the beginning of the transfer
+    size_t head;
+    int done[HGAPR_MAX_CHUNKS];
+    size_t size[HGAPR_MAX_CHUNKS];
+};
+
+static void
+hgapr_completion_init(struct hgapr_completion *comp)
+{
+    memset(comp, 0, sizeof *comp);
+    pthread_mutex_init(&comp->mutex, NULL);
+}
+
+static void
+hgapr_completion_destroy(struct hgapr_completion *comp)
+{
+    pthread_mutex_destroy(&comp->mutex);
+}
+
+// Called by the decoder before the first chunk is dispatched
+static void
+hgapr_completion_start(struct hgapr_completion *comp, uint64_t first)
+{
+    pthread_mutex_lock(&comp->mutex);
+    comp->next = first;
+    pthread_mutex_unlock(&comp->mutex);
+}
+
+/**
+ * Marks a chunk as written.
+ *
+ * @return the updated write head.
+ */
+static size_t
+hgapr_completion_mark(struct hgapr_completion *comp, uint64_t num,
+                      size_t size)
+{
+    pthread_mutex_lock(&comp->mutex);
+    comp->done[num % HGAPR_MAX_CHUNKS] = 1;
+    comp->size[num % HGAPR_MAX_CHUNKS] = size;
+
+    while (comp->done[comp->next % HGAPR_MAX_CHUNKS]) {
+        comp->done[comp->next % HGAPR_MAX_CHUNKS] = 0;
+        comp->head += comp->size[comp->next % HGAPR_MAX_CHUNKS];
+        comp->next++;
+    }
+    size_t head = comp->head;
+    pthread_mutex_unlock(&comp->mutex);
+
+    return head;
+}
+
+static size_t
+hgapr_completion_head(struct hgapr_completion *comp)
+{
+    pthread_mutex_lock(&comp->mutex);
+    size_t head = comp->head;
+    pthread_mutex_unlock(&comp->mutex);
+
+    return head;
+}
+
+struct writer_arg {
+    const struct hgap_config *config;
+    // Each writer has its own channel and pool, decoder side is shared
+    struct channel *chan_dec2out;
+    struct bufpool *pool;
+    struct hgapr_completion *completion;
+
+    FILE *out;
+    // Positional mode: chunks are written at base + chunk offset
+    int positional;
+    off_t base;
+    // Asynchronous writer (sequential mode only), may be NULL
+    struct hgap_awriter *aw;
+    // Background flushing of the written data, may be NULL
+    struct hgap_syncer *syncer;
+    // May be NULL, with the index of chan_dec2out in it
+    struct hgap_live *live;
+    int live_dec2out;
+};
+
+/**
+ * Fills chunk with the position of the chunk of size bytes the decoder just
+ * reconstructed (data is left untouched). All chunks but the last one have
+ * the size of the first one, stride.
+ *
+ * @return HGAP_SUCCESS, or HGAP_ERR_BAD_CHUNK if the chunk is too big.
+ */
+static int
+hgapr_chunk_locate(struct hgap_decoder *dec, size_t size, size_t *stride,
+                   struct hgapr_completion *completion,
+                   struct hgapr_chunk *chunk)
+{
+    chunk->num = hgap_decoder_chunk_num(dec);
+    chunk->size = size;
+    if (*stride == 0) {
+        *stride = chunk->size;
+        hgapr_completion_start(completion, chunk->num);
+    } else if (chunk->size > *stride) {
+        ERROR("Chunk %"PRIu64" bigger than the previous ones\n", chunk->num);
+        return HGAP_ERR_BAD_CHUNK;
+    }
+    chunk->offset = (off_t) (chunk->num * *stride);
+
+    return HGAP_SUCCESS;
+}
+
+/**
+ * Writes a decoded chunk to the output as configured in args (fd being the
+ * descriptor of args->out, if any) and records its completion.
+ *
+ * @return HGAP_SUCCESS, or HGAP_ERR_BAD_OUT_FD if the write failed.
+ */
+static int
+hgapr_write_chunk(const struct writer_arg *args, int fd,
+                  const struct hgapr_chunk *chunk)
+{
+    ssize_t wr_ret;
+
+#if 0
+    DBG("Writing %02hhx %02hhx %02hhx %02hhx\n",
+            chunk->data[0], chunk->data[1], chunk->data[2], chunk->data[3]);
+#endif
+
+    HGAP_TIMING_START(t_write);
+    if (args->positional) {
+        wr_ret = hgap_pwrite_all(fd, chunk->data, chunk->size,
+                                 args->base + chunk->offset);
+    } else if (args->aw != NULL) {
+        wr_ret = hgap_awriter_write(args->aw, chunk->data, chunk->size) ==
+                 HGAP_SUCCESS ? (ssize_t) chunk->size : -1;
+    } else if (fd != -1) {
+        wr_ret = write(fd, chunk->data, chunk->size);
+    } else {
+        wr_ret = fwrite(chunk->data, 1, chunk->size, args->out);
+    }
+    HGAP_TIMING_END(HGAP_TIMING_WRITE, t_write);
+    HGAP_TIMING_CHUNK_END(HGAP_TIMING_RECV_CHUNK, chunk->num);
+
+    if (wr_ret < (ssize_t) chunk->size) {
+        DBG("Write error (potentially badly handled :)");
+        return HGAP_ERR_BAD_OUT_FD;
+    }
+
+    hgap_live_add(args->live, HGAP_LIVE_CHUNKS_WRITTEN, 1);
+    hgap_live_add(args->live, HGAP_LIVE_BYTES_WRITTEN, chunk->size);
+    HGAP_PROBE2(chunk__written, chunk->num, chunk->size);
+
+    size_t head = hgapr_completion_mark(args->completion, chunk->num,
+                                        chunk->size);
+    if (args->syncer != NULL) {
+        hgap_syncer_advance(args->syncer, head);
+    }
+
+    return HGAP_SUCCESS;
+}
+
 struct decloop_arg {
+    const struct hgap_config *config;
     struct hgap_decoder *dec;
     struct channel *chan_net2dec;
-    struct channel *chan_dec2out;
+    struct writer_arg *writers;
+    size_t n_writers;
+    // May be NULL, with the index of chan_net2dec in it
+    struct hgap_live *live;
+    int live_net2dec;
 };
 
+// Publishes the counters of the decoder in the live stats, once a chunk is
+// decoded
+static void
+hgapr_publish_decoded(struct hgap_live *live, struct hgap_decoder *dec)
+{
+    struct hgap_recv_stats stats;
+
+    if (live == NULL) {
+        return;
+    }
+
+    hgap_decoder_stats(dec, &stats);
+    hgap_live_add(live, HGAP_LIVE_CHUNKS_DECODED, 1);
+    hgap_live_set(live, HGAP_LIVE_PKTS_MISSING, stats.link_losses);
+}
+
 static void *
 decloop(struct decloop_arg *args)
 {
     struct hgap_decoder *dec = args->dec;
     struct channel *chan_net2dec = args->chan_net2dec;
-    struct channel *chan_dec2out = args->chan_dec2out;
+    struct writer_arg *writers = args->writers;
+    size_t n_writers = args->n_writers;
+    size_t pkt_slot_size = channel_slot_size(chan_net2dec);
 
-    // Received from net thread
+    // Received from net thread, by runs acked once fully decoded
     struct sized_buf *pkt = NULL;
-    // Sent to write thread
-    struct sized_buf chunk = SBUF_NULL;
+    void *run = NULL;
+    size_t run_len = 0;
+    size_t run_pos = 0;
+    // Sent to a writer thread
+    struct hgapr_chunk chunk = { .data=NULL };
+    // Writer handling the current chunk
+    struct writer_arg *wr = &writers[0];
+    size_t stride = 0;
     int retval = HGAP_SUCCESS;
 
+    hgap_stage_enter(args->config, HGAP_STAGE_DECODE);
+
     for (;;) {
-        if ((pkt = channel_peek(chan_net2dec)) == NULL) {
-            DBG("chan_net2dec receive error\n");
-            retval = HGAP_ERR_IPC;
-            break;
+        if (run_pos == run_len) {
+            if (run_len > 0 && !channel_ack_n(chan_net2dec, run, run_len)) {
+                DBG("chan_net2dec receive error\n");
+                retval = HGAP_ERR_IPC;
+                break;
+            }
+            run_pos = 0;
+            run_len = channel_peek_n(chan_net2dec, HGAPR_PKT_BURST, &run);
+            if (run_len == 0) {
+                DBG("chan_net2dec receive error\n");
+                retval = HGAP_ERR_IPC;
+                break;
+            }
+            hgap_live_sample(args->live, args->live_net2dec, chan_net2dec);
         }
+        pkt = (struct sized_buf *) ((char *) run + run_pos++ * pkt_slot_size);
 
         // Poison pill
         if (pkt->data == NULL) {
             break;
         }
 
+        HGAP_TIMING_START(t_read);
         ssize_t dec_ret = hgap_decoder_read(dec, pkt->data, pkt->size);
-        if (!channel_ack(chan_net2dec, pkt)) {
-            DBG("chan_net2dec receive error\n");
-            retval = HGAP_ERR_IPC;
-            break;
-        }
+        HGAP_TIMING_END(HGAP_TIMING_DEC_READ, t_read);
 
         // More to read
         if (dec_ret == 0) {
@@ -207,20 +634,37 @@ decloop(struct decloop_arg *args)
 
         // Chunk ready to be emitted
         CHK(dec_ret > 0);
-        chunk.size = dec_ret;
-        chunk.data = xmalloc(chunk.size);
+        retval = hgapr_chunk_locate(dec, dec_ret, &stride, wr->completion,
+                                    &chunk);
+        if (retval != HGAP_SUCCESS) {
+            channel_poison(chan_net2dec);
+            break;
+        }
+
+        // Recycled by the writer thread
+        wr = &writers[chunk.num % n_writers];
+        if ((chunk.data = bufpool_get(wr->pool, chunk.size)) == NULL) {
+            // Poisoned by a failing writer, stop the net reader too
+            DBG("Output buffer pool receive error\n");
+            retval = HGAP_ERR_IPC;
+            channel_poison(chan_net2dec);
+            break;
+        }
 
+        HGAP_TIMING_START(t_emit);
         int emit_ret = hgap_decoder_emit(dec, chunk.data, chunk.size);
+        HGAP_TIMING_END(HGAP_TIMING_DEC_EMIT, t_emit);
 
         if (emit_ret == HGAP_SUCCESS) {
-            if (!channel_send(chan_dec2out, &chunk)) {
+            hgapr_publish_decoded(args->live, dec);
+            if (!channel_send(wr->chan_dec2out, &chunk)) {
                 DBG("chan_dec2out send error\n");
                 retval = HGAP_ERR_IPC;
+                channel_poison(chan_net2dec);
                 break;
             }
         } else {
-            free(chunk.data);
-            SBUF_RESET(chunk);
+            bufpool_put(wr->pool, chunk.data);
             HGAP_PERROR(emit_ret, "Fatal error when decoding");
             channel_poison(chan_net2dec);
             retval = emit_ret;
@@ -231,11 +675,13 @@ decloop(struct decloop_arg *args)
     INFO("No more data.\n");
     DBG("Decoder poison pill\n");
     chunk.data = NULL;
-    if (!channel_send(chan_dec2out, &chunk)) {
-        DBG("chan_dec2out send poison error\n");
+    for (size_t i = 0; i < n_writers; i++) {
+        if (!channel_send(writers[i].chan_dec2out, &chunk)) {
+            DBG("chan_dec2out send poison error\n");
 
-        if (retval == HGAP_SUCCESS) {
-            retval = HGAP_ERR_IPC;
+            if (retval == HGAP_SUCCESS) {
+                retval = HGAP_ERR_IPC;
+            }
         }
     }
     DBG("Poison pill sent\n");
@@ -243,78 +689,502 @@ decloop(struct decloop_arg *args)
     return (void *) (intptr_t) retval;
 }
 
-struct writer_arg {
-    struct channel *chan_dec2out;
-    FILE *out;
-};
-
 static void *
 writer(struct writer_arg* args)
 {
     struct channel *chan = args->chan_dec2out;
+    struct bufpool *pool = args->pool;
     FILE *out = args->out;
 
-    struct sized_buf chunk;
-    ssize_t wr_ret = 0;
+    struct hgapr_chunk chunk;
     int retval = HGAP_SUCCESS;
 
+    hgap_stage_enter(args->config, HGAP_STAGE_WRITE);
+
     int fd = fileno(out);
-    if (fd != -1) {
-        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL | POSIX_FADV_NOREUSE);
+    if (fd != -1 && !args->positional) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
     }
 
-    size_t data_written = 0;
-    size_t data_written_total = 0;
-
     while (channel_recv(chan, &chunk)) {
+        hgap_live_sample(args->live, args->live_dec2out, chan);
         if (chunk.data == NULL) {
             break;
         }
 
-        data_written += chunk.size;
-        data_written_total += chunk.size;
+        if ((retval = hgapr_write_chunk(args, fd, &chunk)) != HGAP_SUCCESS) {
+            bufpool_put(pool, chunk.data);
+            // Do not let the decoder wait for buffers that will never come
+            bufpool_poison(pool);
+            break;
+        }
 
-#if 0
-        DBG("Writing %02hhx %02hhx %02hhx %02hhx\n",
-                chunk.data[0], chunk.data[1], chunk.data[2], chunk.data[3]);
-#endif
+        if (!bufpool_put(pool, chunk.data)) {
+            DBG("Output buffer pool send error\n");
+            retval = HGAP_ERR_IPC;
+            break;
+        }
+    }
 
-        if (fd != -1) {
-            wr_ret = write(fd, chunk.data, chunk.size);
-        } else {
-            wr_ret = fwrite(chunk.data, 1, chunk.size, out);
+    return (void *) (intptr_t) retval;
+}
+
+static int
+hgapr_is_regular_file(FILE *out)
+{
+    struct stat st;
+    int fd = fileno(out);
+
+    return fd != -1 && fstat(fd, &st) != -1 && S_ISREG(st.st_mode);
+}
+
+/**
+ * Returns the current offset of out if its chunks can be written at their
+ * position, -1 otherwise.
+ */
+static off_t
+hgapr_positional_base(FILE *out)
+{
+    if (!hgapr_is_regular_file(out)) {
+        return -1;
+    }
+
+    fflush(out);
+    return lseek(fileno(out), 0, SEEK_CUR);
+}
+
+/**
+ * Threaded pipeline: the calling thread receives the packets, a decoder
+ * thread reconstructs the chunks and n_writers writer threads (set up from
+ * wr_tmpl) write them.
+ */
+static int
+hgapr_receive_pipeline(const struct hgap_config *config,
+                       struct hgap_decoder *dec, struct hgap_membudget *budget,
+                       const struct writer_arg *wr_tmpl, size_t n_writers,
+                       size_t pkt_pad, size_t pkt_size, size_t pkt_chan_size,
+                       struct hgapr_rx_stats *rx_stats)
+{
+    // Filled by the net thread
+    struct channel *chan_net2dec = channel_new_flags(
+            pkt_size, pkt_chan_size, config->alloc_flags,
+            hgap_stage_node(config, HGAP_STAGE_NET));
+    CHK(chan_net2dec);
+    channel_set_wait_policy(chan_net2dec, HGAPR_NET2DEC_SPIN_NS,
+                            HGAPR_NET2DEC_YIELD_NS);
+    int live_net2dec = hgap_live_add_queue(wr_tmpl->live, "chan_net2dec",
+                                           chan_net2dec);
+
+    // Before the threads are created, so that they inherit the signal mask
+    struct hgap_chanstats *chanstats = NULL;
+    if (config->chan_stats) {
+        chanstats = hgap_chanstats_new();
+        hgap_chanstats_add(chanstats, "chan_net2dec", chan_net2dec);
+    }
+
+    // Writer threads, each with its own pool and channel. Every chunk in a
+    // chan_dec2out holds a pool buffer, so the pools bound both the number
+    // of chunks and the memory in flight. Their buffers are filled by the
+    // decoder thread.
+    int dec_node = hgap_stage_node(config, HGAP_STAGE_DECODE);
+    struct writer_arg *wr_args = xmalloc(n_writers * sizeof *wr_args);
+    pthread_t *wr_threads = xmalloc(n_writers * sizeof *wr_threads);
+    for (size_t i = 0; i < n_writers; i++) {
+        wr_args[i] = *wr_tmpl;
+        wr_args[i].pool = bufpool_new(budget, HGAPR_MAX_CHUNKS / n_writers,
+                                      config->alloc_flags, dec_node);
+        wr_args[i].chan_dec2out = channel_new(sizeof (struct hgapr_chunk),
+                                              bufpool_max_bufs(
+                                                  wr_args[i].pool));
+        CHK(wr_args[i].chan_dec2out);
+        char name[48];
+        snprintf(name, sizeof name, "chan_dec2out[%zu]", i);
+        if (chanstats != NULL) {
+            hgap_chanstats_add(chanstats, name, wr_args[i].chan_dec2out);
         }
+        wr_args[i].live_dec2out = hgap_live_add_queue(
+                wr_tmpl->live, name, wr_args[i].chan_dec2out);
+
+        CHK_PERROR(pthread_create(&wr_threads[i], NULL,
+                           (void*(*)(void*))writer, &wr_args[i]) == 0);
+    }
+
+    // Decoder thread
+    pthread_t dec_thread;
+    struct decloop_arg dec_args = {
+        .config=config,
+        .dec=dec,
+        .chan_net2dec=chan_net2dec,
+        .writers=wr_args,
+        .n_writers=n_writers,
+        .live=wr_tmpl->live,
+        .live_net2dec=live_net2dec,
+    };
+    CHK_PERROR(pthread_create(&dec_thread, NULL,
+                       (void*(*)(void*)) decloop, &dec_args) == 0);
+
+    // The net reader runs in the calling thread, placed as the net stage
+    // once the other threads are created so that they do not inherit it
+    struct hgap_thread_placement placement;
+    hgap_placement_save(&placement);
+    hgap_stage_enter(config, HGAP_STAGE_NET);
 
-        if (wr_ret < (ssize_t) chunk.size) {
-            DBG("Write error (potentially badly handled :)");
-            retval = HGAP_ERR_BAD_OUT_FD;
-            free(chunk.data);
+    int retval = hgapr_net_reader(chan_net2dec, pkt_pad, config, rx_stats);
+    hgap_placement_restore(&placement);
+
+    void *tmp_ret = (void *) HGAP_SUCCESS;
+    DBG("net reader ended\n");
+
+    pthread_join(dec_thread, &tmp_ret);
+    DBG("decode thread joined\n");
+    if (tmp_ret != (void *) HGAP_SUCCESS) {
+        retval = HGAP_SELECT_ERROR((int) (uintptr_t) tmp_ret, retval);
+    }
+
+    for (size_t i = 0; i < n_writers; i++) {
+        pthread_join(wr_threads[i], &tmp_ret);
+        if (tmp_ret != (void *) HGAP_SUCCESS) {
+            retval = HGAP_SELECT_ERROR((int) (uintptr_t) tmp_ret, retval);
+        }
+    }
+    DBG("Writers joined\n");
+
+    if (chanstats != NULL) {
+        hgap_chanstats_free(chanstats);
+    }
+    for (size_t i = 0; i < n_writers; i++) {
+        channel_free(wr_args[i].chan_dec2out);
+        bufpool_free(wr_args[i].pool);
+    }
+    free(wr_threads);
+    free(wr_args);
+    channel_free(chan_net2dec);
+
+    return retval;
+}
+
+static void
+hgapr_arm_timer(int tfd, uint64_t us)
+{
+    struct itimerspec its;
+    memset(&its, 0, sizeof its);
+    // 0 would disarm it
+    us = MAX(1, us);
+    its.it_value.tv_sec = us / 1000000;
+    its.it_value.tv_nsec = (us % 1000000) * 1000;
+
+    CHK_PERROR(timerfd_settime(tfd, 0, &its, NULL) != -1);
+}
+
+/**
+ * Run-to-completion receiver: a single thread (placed as the net stage)
+ * waits for packets and timeouts in an epoll loop, and decodes and writes
+ * each chunk as soon as its packets are in, with no channel in between.
+ *
+ * The timeout is a timerfd armed on the BEGIN packet. On expiration, it is
+ * rearmed for the rest of the period if packets came in meanwhile, which
+ * saves rearming it for each packet.
+ */
+static int
+hgapr_receive_rtc(const struct hgap_config *config, struct hgap_decoder *dec,
+                  const struct writer_arg *wr, struct hgapr_rx_stats *rx_stats)
+{
+    size_t mtu = config->pkt_size;
+    char *pkts = xmalloc(HGAPR_PKT_BURST * mtu);
+    struct mmsghdr msgs[HGAPR_PKT_BURST];
+    struct iovec iovs[HGAPR_PKT_BURST];
+    union hgapr_cmsg_buf cmsgs[HGAPR_PKT_BURST];
+    // Reconstructed chunk, the buffer is reused
+    struct hgapr_chunk chunk = { .data=NULL };
+    size_t chunk_capacity = 0;
+    size_t stride = 0;
+    uint64_t last_rx = 0;
+    int started = 0;
+    int done = 0;
+    int retval = HGAP_SUCCESS;
+    int epfd = -1;
+    int tfd = -1;
+
+    struct hgap_thread_placement placement;
+    hgap_placement_save(&placement);
+    hgap_stage_enter(config, HGAP_STAGE_NET);
+
+    int fd = fileno(wr->out);
+    if (fd != -1 && !wr->positional) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+
+    memset(msgs, 0, sizeof msgs);
+    for (size_t i = 0; i < HGAPR_PKT_BURST; i++) {
+        iovs[i].iov_base = pkts + i * mtu;
+        iovs[i].iov_len = mtu;
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    struct hgap_transport *tr = hgap_transport_receiver(config);
+    if (tr == NULL) {
+        ERROR("Could not open socket\n");
+        retval = HGAP_ERR_NETWORK;
+        goto closing;
+    }
+
+    CHK_PERROR((epfd = epoll_create1(EPOLL_CLOEXEC)) != -1);
+    CHK_PERROR((tfd = timerfd_create(CLOCK_MONOTONIC,
+                                     TFD_NONBLOCK | TFD_CLOEXEC)) != -1);
+    struct epoll_event ev = { .events=EPOLLIN };
+    ev.data.fd = hgap_transport_fd(tr);
+    CHK_PERROR(epoll_ctl(epfd, EPOLL_CTL_ADD, ev.data.fd, &ev) != -1);
+    ev.data.fd = tfd;
+    CHK_PERROR(epoll_ctl(epfd, EPOLL_CTL_ADD, tfd, &ev) != -1);
+
+    while (!done) {
+        struct epoll_event evs[2];
+        int n_ev = epoll_wait(epfd, evs, 2, -1);
+        if (n_ev == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            retval = HGAP_ERR_NETWORK;
             break;
         }
 
-        if (data_written >= HGAPR_WRITE_SYNC_THRESHOLD) {
-            data_written = 0;
-            if (fd != -1) {
-                fsync(fd);
-            } else {
-                fflush(out);
+        for (int e = 0; e < n_ev && !done; e++) {
+            if (evs[e].data.fd == tfd) {
+                // Only drains it, the elapsed time is what matters
+                uint64_t expirations;
+                ssize_t ret = read(tfd, &expirations, sizeof expirations);
+                FAKE_USE(ret);
+
+                uint64_t idle = hgap_now_ns() / 1000 - last_rx;
+                if (idle >= config->timeout) {
+                    ERROR("End of reception, socket timed out\n");
+                    retval = HGAP_ERR_TIMEOUT;
+                    done = 1;
+                } else {
+                    hgapr_arm_timer(tfd, config->timeout - idle);
+                }
+                continue;
+            }
+
+            // Drain the transport
+            for (;;) {
+                hgapr_prepare_cmsgs(msgs, cmsgs, HGAPR_PKT_BURST);
+                int n_recv = hgap_transport_recv(tr, msgs, HGAPR_PKT_BURST,
+                                                 HGAP_TRANSPORT_DONTWAIT, 0);
+                if (n_recv == -1) {
+                    if (errno == EINTR) {
+                        continue;
+                    } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                        perror("recvmmsg");
+                        retval = HGAP_ERR_NETWORK;
+                        done = 1;
+                    }
+                    break;
+                }
+                hgapr_account_burst(rx_stats, msgs, n_recv);
+                if (started && config->timeout != 0) {
+                    last_rx = hgap_now_ns() / 1000;
+                }
+
+                for (int i = 0; i < n_recv && !done; i++) {
+                    void *pkt = iovs[i].iov_base;
+                    size_t pkt_size = msgs[i].msg_len;
+
+                    if (!started &&
+                        hgap_pkt_type(pkt, pkt_size) == HGAP_PKT_BEGIN) {
+                        started = 1;
+                        if (config->timeout != 0) {
+                            last_rx = hgap_now_ns() / 1000;
+                            hgapr_arm_timer(tfd, config->timeout);
+                        }
+                    }
+
+                    HGAP_TIMING_START(t_read);
+                    ssize_t dec_ret = hgap_decoder_read(dec, pkt, pkt_size);
+                    HGAP_TIMING_END(HGAP_TIMING_DEC_READ, t_read);
+                    if (dec_ret == 0) {
+                        continue;
+                    } else if (dec_ret == -HGAP_EOT) {
+                        done = 1;
+                        break;
+                    } else if (dec_ret < 0) {
+                        HGAP_PERROR(-dec_ret, "Error when decoding");
+                        retval = -dec_ret;
+                        done = 1;
+                        break;
+                    }
+
+                    retval = hgapr_chunk_locate(dec, dec_ret, &stride,
+                                                wr->completion, &chunk);
+                    if (retval != HGAP_SUCCESS) {
+                        done = 1;
+                        break;
+                    }
+                    if (chunk.size > chunk_capacity) {
+                        free(chunk.data);
+                        chunk.data = xmalloc(chunk.size);
+                        chunk_capacity = chunk.size;
+                    }
+
+                    HGAP_TIMING_START(t_emit);
+                    retval = hgap_decoder_emit(dec, chunk.data, chunk.size);
+                    HGAP_TIMING_END(HGAP_TIMING_DEC_EMIT, t_emit);
+                    if (retval != HGAP_SUCCESS) {
+                        HGAP_PERROR(retval, "Fatal error when decoding");
+                        done = 1;
+                        break;
+                    }
+                    hgapr_publish_decoded(wr->live, dec);
+
+                    if ((retval = hgapr_write_chunk(wr, fd, &chunk)) !=
+                        HGAP_SUCCESS) {
+                        done = 1;
+                        break;
+                    }
+                }
+
+                if (done || n_recv < HGAPR_PKT_BURST) {
+                    break;
+                }
             }
         }
+    }
 
-        free(chunk.data);
-        SBUF_RESET(chunk);
+closing:
+    INFO("No more data.\n");
+    if (tfd != -1) {
+        close(tfd);
+    }
+    if (epfd != -1) {
+        close(epfd);
+    }
+    if (tr != NULL) {
+        hgapr_final_drops(tr, rx_stats);
+        hgap_transport_free(tr);
     }
+    free(chunk.data);
+    free(pkts);
+    hgap_placement_restore(&placement);
 
-    if (fd != -1) {
-        fsync(fd);
-    } else {
-        fflush(out);
+    return retval;
+}
+
+// Prints a latency histogram (see struct hgap_recv_stats) on an INFO line
+static void
+hgapr_print_latency_hist(const char *what, const uint64_t *hist)
+{
+    INFO("%s (us):", what);
+    for (size_t i = 0; i < HGAP_LATENCY_BUCKETS; i++) {
+        if (hist[i] == 0) {
+            continue;
+        } else if (i + 1 < HGAP_LATENCY_BUCKETS) {
+            fprintf(stderr, " <%zu: %"PRIu64, (size_t) 1 << i, hist[i]);
+        } else {
+            fprintf(stderr, " %zu+: %"PRIu64, (size_t) 1 << (i - 1), hist[i]);
+        }
     }
+    fprintf(stderr, "\n");
+}
 
-    INFO("Wrote %ld bytes.\n", data_written_total);
-    DBG("Output flushed\n");
+static void
+hgapr_report_latency(struct hgap_recv_stats *stats,
+                     const struct hgapr_latency *lat)
+{
+    if (lat->n == 0) {
+        return;
+    }
 
-    return (void *) (intptr_t) retval;
+    stats->stamped_pkts = lat->n;
+    stats->delay_min = lat->min;
+    stats->delay_max = lat->max;
+    stats->delay_mean = lat->sum / lat->n;
+    stats->jitter = lat->jitter;
+    memcpy(stats->queueing_hist, lat->queueing_hist,
+           sizeof stats->queueing_hist);
+    memcpy(stats->jitter_hist, lat->jitter_hist, sizeof stats->jitter_hist);
+    memcpy(stats->spacing_hist, lat->spacing_hist,
+           sizeof stats->spacing_hist);
+
+    INFO("%"PRIu64" timestamped packets, one-way delay (with the clock "
+         "offset): min %.1fus, mean %.1fus, max %.1fus, jitter %.1fus\n",
+         stats->stamped_pkts, stats->delay_min / 1e3, stats->delay_mean / 1e3,
+         stats->delay_max / 1e3, stats->jitter / 1e3);
+    hgapr_print_latency_hist("Queueing delay", stats->queueing_hist);
+    hgapr_print_latency_hist("Jitter", stats->jitter_hist);
+    hgapr_print_latency_hist("Arrival spacing", stats->spacing_hist);
+}
+
+/**
+ * Reports the packet loss of the transfer, split between the receiving host
+ * (kernel drops), the link (the other missing packets) and the decoder, and
+ * the redundancy margin of the chunks.
+ */
+static void
+hgapr_report_stats(const struct hgap_config *config, struct hgap_decoder *dec,
+                   const struct hgapr_rx_stats *rx_stats)
+{
+    struct hgap_recv_stats stats;
+    hgap_decoder_stats(dec, &stats);
+    stats.pkts_received = rx_stats->pkts;
+    stats.bytes_received = rx_stats->bytes;
+    stats.kernel_drops = rx_stats->kernel_drops;
+    // Kernel drops show up as missing packets too
+    stats.link_losses = stats.link_losses > stats.kernel_drops ?
+                        stats.link_losses - stats.kernel_drops : 0;
+
+    INFO("%"PRIu64" packets received, lost: %"PRIu64" by the kernel "
+         "(socket buffer), %"PRIu64" on the link, %"PRIu64" by the decoder\n",
+         stats.pkts_received, stats.kernel_drops, stats.link_losses,
+         stats.decoder_drops);
+
+    if (stats.chunks > 0) {
+        INFO("%"PRIu64" chunks, %"PRIu64" packets needed, margin: "
+             "%.1f%% on average, %.1f%% at worst\n", stats.chunks,
+             stats.pkts_needed, 100. * stats.pkts_margin / stats.pkts_needed,
+             100. * stats.min_margin);
+
+        INFO("Chunks by margin:");
+        for (size_t i = 0; i < HGAP_MARGIN_BUCKETS; i++) {
+            if (stats.margin_hist[i] == 0) {
+                continue;
+            } else if (i + 1 < HGAP_MARGIN_BUCKETS) {
+                fprintf(stderr, " %zu-%zu%%: %"PRIu64, i * 10, i * 10 + 9,
+                        stats.margin_hist[i]);
+            } else {
+                fprintf(stderr, " %zu%%+: %"PRIu64, i * 10,
+                        stats.margin_hist[i]);
+            }
+        }
+        fprintf(stderr, "\n");
+    }
+
+    uint64_t bursts = 0;
+    for (size_t i = 0; i < HGAP_BURST_BUCKETS; i++) {
+        bursts += stats.burst_hist[i];
+    }
+    if (bursts > 0) {
+        INFO("Loss bursts by length (packets):");
+        for (size_t i = 0; i < HGAP_BURST_BUCKETS; i++) {
+            if (stats.burst_hist[i] == 0) {
+                continue;
+            } else if (i + 1 < HGAP_BURST_BUCKETS) {
+                fprintf(stderr, " %zu-%zu: %"PRIu64, (size_t) 1 << i,
+                        ((size_t) 2 << i) - 1, stats.burst_hist[i]);
+            } else {
+                fprintf(stderr, " %zu+: %"PRIu64, (size_t) 1 << i,
+                        stats.burst_hist[i]);
+            }
+        }
+        fprintf(stderr, "\n");
+    }
+
+    hgapr_report_latency(&stats, &rx_stats->latency);
+
+    if (config->recv_stats != NULL) {
+        *config->recv_stats = stats;
+    }
 }
 
 int
@@ -333,57 +1203,146 @@ hgap_receive(const struct hgap_config *config)
     struct hgap_decoder *dec = hgap_decoder_new();
     CHK(dec);
 
-    size_t pkt_size = sizeof (struct sized_buf) + config->pkt_size;
-    size_t pkt_chan_size = (config->mem_limit / 2) / pkt_size;
-    size_t chunk_chan_size = MAX(256,
-                                 (config->mem_limit / 2) / HGAP_MAX_CHUNK_SIZE);
+    // Positional writes need a seekable output, and writer threads
+    size_t n_writers = MAX(1, config->n_writers);
+    off_t base = 0;
+    if (n_writers > 1 && config->single_thread) {
+        WARN("Single-threaded receiver, using a single sequential writer\n");
+        n_writers = 1;
+    }
+    if (n_writers > 1 && (base = hgapr_positional_base(config->out)) == -1) {
+        WARN("Output is not seekable, using a single sequential writer\n");
+        n_writers = 1;
+    }
+
+    // Memory budget: packets get half of mem_limit, shared between the socket
+    // buffer and chan_net2dec which preallocates them, decoded chunks are
+    // admitted against the rest by the pools.
+    size_t pkt_pad = config->alloc_flags != 0 ? SBUF_ALIGNED_PAD : 0;
+    size_t pkt_size = sizeof (struct sized_buf) + pkt_pad + config->pkt_size;
+    size_t rcvbuf_mem = hgap_transport_rcvbuf_mem(config);
+    size_t pkt_chan_size = hgap_membudget_depth(
+            config->mem_limit / 2 - rcvbuf_mem, pkt_size, 1, SIZE_MAX);
+    size_t pkt_mem = rcvbuf_mem + pkt_chan_size * pkt_size;
+    struct hgap_membudget *budget = hgap_membudget_new(
+            config->mem_limit > pkt_mem ? config->mem_limit - pkt_mem : 0);
+
+    struct hgapr_completion completion;
+    hgapr_completion_init(&completion);
+
+    // Asynchronous writer, for a single writer on a regular file
+    struct hgap_awriter *aw = NULL;
+    unsigned aio_depth = config->aio_depth;
+    if (config->direct_io && aio_depth == 0) {
+        aio_depth = HGAP_DEF_AIO_DEPTH;
+    }
+    if (aio_depth > 0 && n_writers > 1) {
+        WARN("Several writers, not using async writes%s\n",
+             config->direct_io ? " nor O_DIRECT" : "");
+    } else if (aio_depth > 0) {
+        if (!hgapr_is_regular_file(config->out)) {
+            WARN("Output is not a regular file, not using async writes\n");
+        } else {
+            fflush(config->out);
+            aw = hgap_awriter_new(fileno(config->out), aio_depth,
+                                  config->direct_io);
+        }
+    }
+    if (aw != NULL) {
+        hgap_membudget_charge(budget, hgap_awriter_footprint(aio_depth));
+    }
 
-    struct channel *chan_net2dec = channel_new(pkt_size, pkt_chan_size);
-    struct channel *chan_dec2out = channel_new(sizeof(struct sized_buf),
-                                               chunk_chan_size);
-    CHK(chan_net2dec);
-    CHK(chan_dec2out);
+    // Background durability, pointless if the page cache is bypassed. With
+    // the async writer, the head may be a few staging buffers ahead of the
+    // file, the final flush takes care of them.
+    struct hgap_syncer *syncer = NULL;
+    if (config->sync_interval > 0 && !(aw != NULL && config->direct_io) &&
+        (n_writers > 1 || hgapr_is_regular_file(config->out))) {
+        off_t sync_base = n_writers > 1 ? base :
+                          hgapr_positional_base(config->out);
+        if (sync_base != -1) {
+            syncer = hgap_syncer_new(fileno(config->out), sync_base,
+                                     config->sync_interval);
+        }
+    }
 
-    // Writer thread
-    pthread_t wr_thread;
-    struct writer_arg wr_args = {
-        .chan_dec2out=chan_dec2out,
-        .out=config->out
-    };
-    CHK_PERROR(pthread_create(&wr_thread, NULL,
-                       (void*(*)(void*))writer, &wr_args) == 0);
+    struct hgap_live *live = NULL;
+    if (config->stats_name != NULL &&
+        (live = hgap_live_new(config->stats_name,
+                              HGAP_LIVE_RECEIVER)) == NULL) {
+        PWARN("Could not create the live stats segment");
+    }
 
-    // Decoder thread
-    pthread_t dec_thread;
-    struct decloop_arg dec_args = {
-        .dec=dec,
-        .chan_net2dec=chan_net2dec,
-        .chan_dec2out=chan_dec2out
+    const struct writer_arg wr_tmpl = {
+        .config=config,
+        .completion=&completion,
+        .out=config->out,
+        .positional=n_writers > 1,
+        .base=base,
+        .aw=aw,
+        .syncer=syncer,
+        .live=live,
+        .live_dec2out=-1,
     };
-    CHK_PERROR(pthread_create(&dec_thread, NULL,
-                       (void*(*)(void*)) decloop, &dec_args) == 0);
 
-    int retval = hgapr_net_reader(chan_net2dec, config->addr, config->port,
-                                  config->timeout);
+    struct hgapr_rx_stats rx_stats;
+    memset(&rx_stats, 0, sizeof rx_stats);
+    rx_stats.live = live;
+    rx_stats.timestamps = config->timestamps;
+    if (config->trace_path != NULL &&
+        (rx_stats.trace = hgap_trace_new(config->trace_path)) == NULL) {
+        PWARN("Could not create the packet trace");
+    }
 
-    void *tmp_ret = (void *) HGAP_SUCCESS;
-    DBG("net reader ended\n");
+    int retval;
+    if (config->single_thread) {
+        retval = hgapr_receive_rtc(config, dec, &wr_tmpl, &rx_stats);
+    } else {
+        retval = hgapr_receive_pipeline(config, dec, budget, &wr_tmpl,
+                                        n_writers, pkt_pad, pkt_size,
+                                        pkt_chan_size, &rx_stats);
+    }
+    hgapr_report_stats(config, dec, &rx_stats);
+    hgap_live_set(live, HGAP_LIVE_KERNEL_DROPS, rx_stats.kernel_drops);
+    if (rx_stats.trace != NULL && hgap_trace_free(rx_stats.trace) != 0) {
+        PWARN("Packet trace incomplete");
+    }
 
-    pthread_join(dec_thread, &tmp_ret);
-    DBG("decode thread joined\n");
-    if (tmp_ret != (void *) HGAP_SUCCESS) {
-        retval = HGAP_SELECT_ERROR((int) (uintptr_t) tmp_ret, retval);
+    if (aw != NULL) {
+        int aw_ret = hgap_awriter_finish(aw);
+        retval = HGAP_SELECT_ERROR(retval, aw_ret);
+        hgap_awriter_free(aw);
+        hgap_membudget_release(budget, hgap_awriter_footprint(aio_depth));
     }
 
-    pthread_join(wr_thread, &tmp_ret);
-    DBG("Writer joined\n");
-    if (tmp_ret != (void *) HGAP_SUCCESS) {
-        retval = HGAP_SELECT_ERROR((int) (uintptr_t) tmp_ret, retval);
+    // Flush and leave the output positioned after the transfer
+    size_t written = hgapr_completion_head(&completion);
+    int fd = fileno(config->out);
+    if (fd != -1) {
+        if (n_writers > 1) {
+            lseek(fd, base + written, SEEK_SET);
+        }
+        if (syncer != NULL) {
+            retval = HGAP_SELECT_ERROR(retval, hgap_syncer_finish(syncer));
+        } else {
+            fsync(fd);
+        }
+    } else {
+        fflush(config->out);
     }
 
-    channel_free(chan_dec2out);
-    channel_free(chan_net2dec);
+    INFO("Wrote %zu bytes.\n", written);
+    DBG("Output flushed\n");
+
+    hgapr_completion_destroy(&completion);
+    hgap_membudget_free(budget);
     hgap_decoder_free(dec);
+    if (retval != HGAP_SUCCESS) {
+        hgap_live_add(live, HGAP_LIVE_ERRORS, 1);
+    }
+    hgap_live_free(live);
+    HGAP_TIMING_REPORT(stderr, HGAP_TIMING_RECEIVER_FIRST,
+                       HGAP_TIMING_N_PROBES - 1);
 
     return retval;
 }
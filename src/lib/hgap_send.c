@@ -16,8 +16,11 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE // cpu_set_t
+
 #include "hairgap.h"
 
+#include <inttypes.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -25,13 +28,28 @@
 #include <unistd.h>
 
 #include "channel.h"
+#include "chanstats.h"
 #include "common.h"
+#include "livestats.h"
+#include "membudget.h"
+#include "pktstore.h"
+#include "placement.h"
+#include "probes.h"
 #include "sender.h"
 #include "encoding.h"
+#include "timing.h"
+#include "transport.h"
+
+// Upper bound of the depth of the sender channels
+#define HGAPS_MAX_CHAN_DEPTH 16
 
 struct read_loop_arg {
     const struct hgap_config *config;
     struct channel *chan;
+    // Between the content of a sized_buf and its data
+    size_t pad;
+    // May be NULL
+    struct hgap_live *live;
 };
 
 static void
@@ -56,11 +74,15 @@ read_loop(const struct read_loop_arg *args)
     FILE *in_file = config->in;
 
     int more_data = 1;
+    uint64_t chunk_num = 0;
     struct sized_buf *buf = NULL;
-    size_t buf_size = channel_elt_size(chan) - sizeof(struct sized_buf);
+    size_t buf_size = channel_elt_size(chan) - sizeof(struct sized_buf) -
+                      args->pad;
 
     int retval = HGAP_SUCCESS;
 
+    hgap_stage_enter(config, HGAP_STAGE_READ);
+
     if (in_file == NULL) {
         ERROR("Bad input file descriptor\n");
         retval = HGAP_ERR_BAD_IN_FD;
@@ -71,9 +93,15 @@ read_loop(const struct read_loop_arg *args)
         buf = channel_reserve(chan);
         CHK(buf);
         buf->size = buf_size;
-        buf->data = buf->content;
+        buf->data = buf->content + args->pad;
 
+        HGAP_TIMING_CHUNK_START(HGAP_TIMING_SEND_CHUNK, chunk_num);
+        HGAP_TIMING_START(t_read);
         read_chunk(in_file, buf);
+        HGAP_TIMING_END(HGAP_TIMING_READ, t_read);
+        HGAP_PROBE2(chunk__read, chunk_num, buf->size);
+        chunk_num++;
+        hgap_live_add(args->live, HGAP_LIVE_BYTES_READ, buf->size);
         if (ferror(in_file)) {
             PWARN("Error while reading input file");
             retval = HGAP_ERR_FILE_READ;
@@ -106,9 +134,14 @@ read_loop(const struct read_loop_arg *args)
 }
 
 struct encode_loop_arg {
+    const struct hgap_config *config;
     struct hgap_encoder *enc;
     struct channel *chan_in2enc;
     struct channel *chan_enc2net;
+    struct hgap_membudget *budget;
+    // May be NULL, with the index of chan_in2enc in it
+    struct hgap_live *live;
+    int live_in2enc;
 };
 
 static void *
@@ -117,23 +150,39 @@ encode_loop(const struct encode_loop_arg* args)
     struct hgap_encoder *enc = args->enc;
     struct channel *chan_in2enc = args->chan_in2enc;
     struct channel *chan_enc2net = args->chan_enc2net;
+    struct hgap_membudget *budget = args->budget;
 
     struct hgap_enc_chunk *chunk = NULL;
     struct sized_buf *to_enc = NULL;
+    size_t footprint = 0;
     int retval = HGAP_SUCCESS;
     int ret;
 
+    hgap_stage_enter(args->config, HGAP_STAGE_ENCODE);
+
     // Continue while reading from the channel is possible
     while ((to_enc = channel_peek(chan_in2enc)) != NULL) {
+        hgap_live_sample(args->live, args->live_in2enc, chan_in2enc);
+
         // Poison
         if (to_enc->data == NULL) {
             break;
         }
 
+        // Admission: wait for the send thread to free enough memory. Released
+        // by the send thread along with the chunk.
+        footprint = hgap_enc_chunk_footprint(to_enc->size);
+        if (!hgap_membudget_acquire(budget, footprint)) {
+            DBG("Memory budget acquisition error\n");
+            retval = HGAP_ERR_IPC;
+            break;
+        }
+
         // New chunk, will be freed by next thread
         chunk = hgap_enc_chunk_new();
         if (chunk == NULL) {
             DBG("Error while allocating a chunk.\n");
+            hgap_membudget_release(budget, footprint);
             retval = HGAP_ERR_INTERNAL;
             break;
         }
@@ -143,7 +192,9 @@ encode_loop(const struct encode_loop_arg* args)
 #endif
 
         // Pre-encoding
+        HGAP_TIMING_START(t_init);
         ret = hgap_enc_chunk_init(enc, chunk, to_enc->data, to_enc->size);
+        HGAP_TIMING_END(HGAP_TIMING_ENC_INIT, t_init);
         if (ret != HGAP_SUCCESS) {
             HGAP_PERROR(ret, "Error while encoding chunk");
             retval = ret;
@@ -155,6 +206,7 @@ encode_loop(const struct encode_loop_arg* args)
             retval = HGAP_ERR_IPC;
             break;
         }
+        hgap_live_add(args->live, HGAP_LIVE_CHUNKS_ENCODED, 1);
 
         chunk = NULL;
 
@@ -164,6 +216,7 @@ encode_loop(const struct encode_loop_arg* args)
 
     if (chunk != NULL) {
         hgap_enc_chunk_free(chunk);
+        hgap_membudget_release(budget, footprint);
     }
 
     // Propagate poison
@@ -176,9 +229,45 @@ encode_loop(const struct encode_loop_arg* args)
     return (void *) (intptr_t) retval;
 }
 
+// Publishes the counters of the sender in the live stats
+static void
+publish_send_stats(struct hgap_live *live, struct hgap_sender *hs)
+{
+    struct hgap_send_stats stats;
+
+    if (live == NULL) {
+        return;
+    }
+
+    hgap_sender_get_stats(hs, &stats);
+    hgap_live_set(live, HGAP_LIVE_PKTS_SENT, stats.pkts_sent);
+    hgap_live_set(live, HGAP_LIVE_BYTES_SENT, stats.bytes_sent);
+    hgap_live_set(live, HGAP_LIVE_BACKPRESSURE_WAITS,
+                  stats.backpressure_waits);
+    hgap_live_set(live, HGAP_LIVE_LOCAL_DROPS, stats.local_drops);
+    hgap_live_set(live, HGAP_LIVE_LIMITER_SLEEPS, stats.limiter_sleeps);
+}
+
+// Prints the counters of the sender and hands them to the caller
+static void
+report_send_stats(const struct hgap_config *config, struct hgap_live *live,
+                  struct hgap_sender *hs)
+{
+    struct hgap_send_stats stats;
+    hgap_sender_get_stats(hs, &stats);
+    INFO("%"PRIu64" packets sent, %"PRIu64" dropped locally, "
+         "%"PRIu64" backpressure waits\n", stats.pkts_sent,
+         stats.local_drops, stats.backpressure_waits);
+    if (config->send_stats != NULL) {
+        *config->send_stats = stats;
+    }
+    publish_send_stats(live, hs);
+}
+
 static int
 send_loop(const struct hgap_config *config, struct hgap_encoder *enc,
-          struct channel *chan_enc2net)
+          struct channel *chan_enc2net, struct hgap_membudget *budget,
+          struct hgap_live *live, int live_enc2net)
 {
     size_t data_sent = 0;
     double cur_redund = 0;
@@ -191,15 +280,19 @@ send_loop(const struct hgap_config *config, struct hgap_encoder *enc,
 
     int more_data = 1;
     int retval = HGAP_SUCCESS;
+    uint64_t chunk_num = 0;
+    uint64_t chunk_pkts = 0;
 
-    struct hgap_sender *hs = hgap_sender_new(config->addr, config->port,
-                                             config->byterate,
-                                             config->keepalive);
+    struct hgap_sender *hs = hgap_sender_new_transport(
+            hgap_transport_sender(config), config->byterate,
+            config->keepalive);
     if (hs == NULL) {
         retval = HGAP_ERR_INTERNAL;
         goto send_loop_fail;
     }
 
+    hgap_stage_enter(config, HGAP_STAGE_SEND);
+
     struct hgap_enc_chunk *chunk = NULL;
 
     // Handwave (send control salve to announce the transfer)
@@ -218,7 +311,11 @@ send_loop(const struct hgap_config *config, struct hgap_encoder *enc,
     send_size = pkt_size;
 
     while (more_data) {
-        // Get input chunk
+        // Get input chunk, keeping the link alive while waiting for it
+        while (!channel_poll_recv(chan_enc2net, hgap_sender_idle_ns(hs))) {
+            hgap_sender_keepalive(hs);
+        }
+        hgap_live_sample(live, live_enc2net, chan_enc2net);
         if (!channel_recv(chan_enc2net, (void *)&chunk)) {
             DBG("chan_enc2net receive error\n");
             retval = HGAP_ERR_IPC;
@@ -233,23 +330,44 @@ send_loop(const struct hgap_config *config, struct hgap_encoder *enc,
 
         // Generate and send all packets for this encoding chunk
         do { 
+            HGAP_TIMING_START(t_emit);
             cur_redund = hgap_enc_chunk_emit(chunk, pkt, &send_size);
+            HGAP_TIMING_END(HGAP_TIMING_ENC_EMIT, t_emit);
             if (cur_redund < 0) {
                 retval = HGAP_ERR_WIREHAIR_ERROR;
                 more_data = 0;
             } else {
-                size_t sent = hgap_sender_send(hs, pkt, send_size);
-                data_sent += sent;
+                if (config->timestamps) {
+                    hgap_pkt_stamp(pkt, &send_size);
+                }
+                // Dropped packets are accounted by the sender
+                HGAP_TIMING_START(t_send);
+                ssize_t sent = hgap_sender_send(hs, pkt, send_size);
+                HGAP_TIMING_END(HGAP_TIMING_SEND, t_send);
+                if (sent > 0) {
+                    data_sent += sent;
+                }
+                if (chunk_pkts++ == 0) {
+                    HGAP_PROBE1(chunk__first__pkt, chunk_num);
+                }
+                publish_send_stats(live, hs);
             }
             send_size = pkt_size;
         } while (cur_redund < redund);
+        HGAP_PROBE2(chunk__last__pkt, chunk_num, chunk_pkts);
+        chunk_pkts = 0;
 
+        size_t footprint = hgap_enc_chunk_footprint(hgap_enc_chunk_len(chunk));
         hgap_enc_chunk_free(chunk);
+        hgap_membudget_release(budget, footprint);
         chunk = NULL;
+        hgap_live_add(live, HGAP_LIVE_CHUNKS_SENT, 1);
+        HGAP_TIMING_CHUNK_END(HGAP_TIMING_SEND_CHUNK, chunk_num);
+        chunk_num++;
     }
 
     INFO("Sent all chunks.\n");
-    INFO("%ld  bytes sent.\n", data_sent);
+    INFO("%zu  bytes sent.\n", data_sent);
     send_size = pkt_size;
 
     // Proper teardown only on proper exit
@@ -261,19 +379,213 @@ send_loop(const struct hgap_config *config, struct hgap_encoder *enc,
 
 send_loop_fail:
     free(pkt);
-    hgap_sender_free(hs);
+    if (hs != NULL) {
+        report_send_stats(config, live, hs);
+        hgap_sender_free(hs);
+    }
 
     return retval;
 }
 
-int
-hgap_send(const struct hgap_config *config)
+/**
+ * Consumer of chan_enc2net when encoding into a packet store: the packets
+ * are written to config->store_path instead of being sent.
+ */
+static int
+store_loop(const struct hgap_config *config, struct channel *chan_enc2net,
+           struct hgap_membudget *budget, struct hgap_live *live,
+           int live_enc2net)
 {
-    int err;
-    if ((err = hgap_check_config_sender(config)) != HGAP_SUCCESS) {
-        return err;
+    // Same packets as send_loop, which stamps them after encoding
+    size_t pkt_size = config->pkt_size -
+                      (config->timestamps ? HGAP_TSTAMP_LEN : 0);
+    size_t send_size = pkt_size;
+    void *pkt = xmalloc(pkt_size);
+    struct hgap_enc_chunk *chunk = NULL;
+    uint64_t start = hgap_now_ns();
+    uint64_t n_pkts = 0;
+    uint64_t data_size = 0;
+    int retval = HGAP_SUCCESS;
+
+    struct hgap_store_writer *writer = hgap_store_writer_new(
+            config->store_path, pkt_size, config->n_pkt, config->redund,
+            config->timestamps);
+    if (writer == NULL) {
+        PWARN("Could not create the packet store");
+        free(pkt);
+        return HGAP_ERR_BAD_OUT_FD;
+    }
+
+    hgap_stage_enter(config, HGAP_STAGE_SEND);
+
+    while (retval == HGAP_SUCCESS) {
+        hgap_live_sample(live, live_enc2net, chan_enc2net);
+        if (!channel_recv(chan_enc2net, (void *)&chunk)) {
+            DBG("chan_enc2net receive error\n");
+            retval = HGAP_ERR_IPC;
+            break;
+        }
+
+        // Poison (NULL) chunk => end of input
+        if (chunk == NULL) {
+            break;
+        }
+
+        double cur_redund = 0;
+        while (cur_redund < config->redund) {
+            HGAP_TIMING_START(t_emit);
+            cur_redund = hgap_enc_chunk_emit(chunk, pkt, &send_size);
+            HGAP_TIMING_END(HGAP_TIMING_ENC_EMIT, t_emit);
+            if (cur_redund < 0) {
+                retval = HGAP_ERR_WIREHAIR_ERROR;
+                break;
+            }
+            if (hgap_store_write_pkt(writer, pkt, send_size) == -1) {
+                PWARN("Could not write to the packet store");
+                retval = HGAP_ERR_BAD_OUT_FD;
+                break;
+            }
+            n_pkts++;
+            send_size = pkt_size;
+        }
+
+        size_t len = hgap_enc_chunk_len(chunk);
+        hgap_store_end_chunk(writer, len);
+        data_size += len;
+        hgap_enc_chunk_free(chunk);
+        hgap_membudget_release(budget, hgap_enc_chunk_footprint(len));
+        chunk = NULL;
+    }
+
+    if (hgap_store_writer_free(writer, retval == HGAP_SUCCESS) == -1 &&
+        retval == HGAP_SUCCESS) {
+        PWARN("Could not write the packet store");
+        retval = HGAP_ERR_BAD_OUT_FD;
+    }
+    free(pkt);
+
+    double secs = (hgap_now_ns() - start) / 1e9;
+    INFO("Encoded %"PRIu64" bytes into %"PRIu64" packets in %.3fs: "
+         "%.1f MB/s\n", data_size, n_pkts, secs,
+         secs > 0 ? data_size / (1024*1024.) / secs : 0);
+
+    return retval;
+}
+
+/**
+ * Sends the packets of the store config->store_path as they are: no
+ * encoding, only the rate limiter and the timestamps touch them.
+ */
+static int
+send_store(const struct hgap_config *config)
+{
+    struct hgap_store *store = hgap_store_open(config->store_path);
+    if (store == NULL) {
+        PWARN("Could not open the packet store");
+        return HGAP_ERR_BAD_IN_FD;
+    }
+    const struct hgap_store_header *hdr = store->hdr;
+    INFO("Sending the packet store: %"PRIu64" bytes in %"PRIu64" chunks, "
+         "%"PRIu64" packets (N: %"PRIu32", MTU: %zu, redundancy: "
+         "x%.2lf)\n", hdr->data_size, hdr->n_chunks, hdr->n_pkts, hdr->n_pkt,
+         hdr->pkt_size + (hdr->timestamps ? HGAP_TSTAMP_LEN : 0),
+         hdr->redund);
+
+    // Control packets, and the stamped copies of the data packets
+    size_t pkt_size = MAX(hdr->pkt_size + HGAP_TSTAMP_LEN, HGAP_MIN_BUF);
+    void *pkt = xmalloc(pkt_size);
+    size_t send_size = pkt_size;
+    struct hgap_encoder *enc = hgap_encoder_new(hdr->pkt_size);
+    int retval = HGAP_SUCCESS;
+
+    struct hgap_live *live = NULL;
+    if (config->stats_name != NULL &&
+        (live = hgap_live_new(config->stats_name, HGAP_LIVE_SENDER)) == NULL) {
+        PWARN("Could not create the live stats segment");
+    }
+
+    // Placed as the send stage, like send_loop
+    struct hgap_thread_placement placement;
+    hgap_placement_save(&placement);
+
+    struct hgap_sender *hs = hgap_sender_new_transport(
+            hgap_transport_sender(config), config->byterate,
+            config->keepalive);
+    if (hs == NULL) {
+        retval = HGAP_ERR_INTERNAL;
+        goto send_store_fail;
+    }
+    hgap_stage_enter(config, HGAP_STAGE_SEND);
+
+    // Handwave (send control salve to announce the transfer)
+    int ret;
+    if ((ret = hgap_encoder_handwave(enc, pkt, &send_size)) != HGAP_SUCCESS) {
+        HGAP_PERROR(ret, "Handwave");
+        retval = ret;
+        goto send_store_fail;
+    }
+    if (hgap_sender_control(hs, pkt, send_size) != 0) {
+        perror("Panic: unexpected network error");
+        retval = HGAP_ERR_NETWORK;
+        goto send_store_fail;
     }
 
+    for (uint64_t i = 0; i < hdr->n_chunks; i++) {
+        const struct hgap_store_chunk *chunk = &store->chunks[i];
+
+        HGAP_PROBE1(chunk__first__pkt, i);
+        for (uint64_t id = 0; id < chunk->n_pkts; id++) {
+            const void *to_send = hgap_store_pkt(store, chunk->first + id);
+            send_size = chunk->pkt_len;
+            if (hdr->timestamps) {
+                memcpy(pkt, to_send, send_size);
+                hgap_pkt_stamp(pkt, &send_size);
+                to_send = pkt;
+            }
+            HGAP_TIMING_START(t_send);
+            hgap_sender_send(hs, to_send, send_size);
+            HGAP_TIMING_END(HGAP_TIMING_SEND, t_send);
+            publish_send_stats(live, hs);
+        }
+        HGAP_PROBE2(chunk__last__pkt, i, chunk->n_pkts);
+        hgap_live_add(live, HGAP_LIVE_CHUNKS_SENT, 1);
+    }
+
+    INFO("Sent all chunks.\n");
+    send_size = pkt_size;
+
+    // Proper teardown only on proper exit
+    if (retval == HGAP_SUCCESS) {
+        hgap_encoder_teardown(enc, pkt, &send_size);
+        hgap_sender_control(hs, pkt, send_size);
+    }
+
+send_store_fail:
+    hgap_placement_restore(&placement);
+    if (hs != NULL) {
+        report_send_stats(config, live, hs);
+        hgap_sender_free(hs);
+    }
+    if (retval != HGAP_SUCCESS) {
+        hgap_live_add(live, HGAP_LIVE_ERRORS, 1);
+    }
+    hgap_live_free(live);
+    HGAP_TIMING_REPORT(stderr, HGAP_TIMING_SENDER_FIRST,
+                       HGAP_TIMING_RECEIVER_FIRST - 1);
+    hgap_encoder_free(enc);
+    free(pkt);
+    hgap_store_close(store);
+
+    return retval;
+}
+
+/**
+ * Runs the read and encode threads, their output being consumed by
+ * send_loop, or store_loop if to_store.
+ */
+static int
+encode_pipeline(const struct hgap_config *config, int to_store)
+{
     if (wirehair_init() == 0) {
         return HGAP_ERR_WIREHAIR_ERROR;
     }
@@ -281,24 +593,69 @@ hgap_send(const struct hgap_config *config)
 
     // Alternatively, read only multiple of pages
     // size_t buf_size = PAGE_ROUND_DOWN(config->n_pkt * config->pkt_size);
-    size_t buf_size = config->n_pkt * (config->pkt_size - HGAP_HEADER_LEN);
+    // The send timestamp takes room from the encoded packets
+    size_t enc_pkt_size = config->pkt_size -
+                          (config->timestamps ? HGAP_TSTAMP_LEN : 0);
+    size_t buf_size = config->n_pkt * (enc_pkt_size - HGAP_HEADER_LEN);
 
     // Shared structure allocation
-    struct hgap_encoder *enc = hgap_encoder_new(config->pkt_size);
+    struct hgap_encoder *enc = hgap_encoder_new(enc_pkt_size);
     CHK(enc != NULL);
 
-    // FIXME: hardcoded channel size, should depend on config (mem_limit)
-    struct channel *chan_in2enc = channel_new(
-            sizeof (struct sized_buf) + buf_size, 16);
+    // Memory budget: input buffers are preallocated by chan_in2enc and get a
+    // quarter of mem_limit, encoded chunks are admitted against the rest.
+    size_t in_pad = config->alloc_flags != 0 ? SBUF_ALIGNED_PAD : 0;
+    size_t in_elt_size = sizeof (struct sized_buf) + in_pad + buf_size;
+    size_t in_depth = hgap_membudget_depth(config->mem_limit / 4, in_elt_size,
+                                           1, HGAPS_MAX_CHAN_DEPTH);
+    size_t in_mem = in_depth * in_elt_size;
+    size_t chunk_footprint = hgap_enc_chunk_footprint(buf_size);
+
+    if (in_mem + chunk_footprint > config->mem_limit) {
+        WARN("Memory limit too low for %zu bytes chunks, using %.3f MB\n",
+             buf_size, (in_mem + chunk_footprint) / (1024*1024.));
+    }
+
+    struct hgap_membudget *budget = hgap_membudget_new(
+            config->mem_limit > in_mem ? config->mem_limit - in_mem : 0);
+    size_t enc_depth = hgap_membudget_depth(hgap_membudget_limit(budget),
+                                            chunk_footprint, 1,
+                                            HGAPS_MAX_CHAN_DEPTH);
+    DBG("Sender channels depth: in2enc %zu, enc2net %zu\n",
+        in_depth, enc_depth);
+
+    // Filled by the read thread
+    struct channel *chan_in2enc = channel_new_flags(
+            in_elt_size, in_depth, config->alloc_flags,
+            hgap_stage_node(config, HGAP_STAGE_READ));
     struct channel *chan_enc2net = channel_new(
-            sizeof (struct hgap_enc_chunk *), 16);
+            sizeof (struct hgap_enc_chunk *), enc_depth);
     CHK(chan_in2enc);
     CHK(chan_enc2net);
 
+    // Before the threads are created, so that they inherit the signal mask
+    struct hgap_chanstats *chanstats = NULL;
+    if (config->chan_stats) {
+        chanstats = hgap_chanstats_new();
+        hgap_chanstats_add(chanstats, "chan_in2enc", chan_in2enc);
+        hgap_chanstats_add(chanstats, "chan_enc2net", chan_enc2net);
+    }
+
+    // Live stats, sampled by the consumers of the channels
+    struct hgap_live *live = NULL;
+    if (config->stats_name != NULL &&
+        (live = hgap_live_new(config->stats_name, HGAP_LIVE_SENDER)) == NULL) {
+        PWARN("Could not create the live stats segment");
+    }
+    int live_in2enc = hgap_live_add_queue(live, "chan_in2enc", chan_in2enc);
+    int live_enc2net = hgap_live_add_queue(live, "chan_enc2net", chan_enc2net);
+
     pthread_t read_thread;
     const struct read_loop_arg rdargs = {
         .chan=chan_in2enc,
         .config=config,
+        .pad=in_pad,
+        .live=live,
     };
     DBG("Create read_thread\n");
     CHK_PERROR(pthread_create(&read_thread, NULL,
@@ -306,18 +663,41 @@ hgap_send(const struct hgap_config *config)
 
     pthread_t encode_thread;
     const struct encode_loop_arg encargs = {
+        .config=config,
         .enc=enc,
         .chan_in2enc=chan_in2enc,
         .chan_enc2net=chan_enc2net,
+        .budget=budget,
+        .live=live,
+        .live_in2enc=live_in2enc,
     };
     DBG("Create encode_thread\n");
     CHK_PERROR(pthread_create(&encode_thread, NULL,
                        (void*(*)(void*)) encode_loop, (void *)&encargs) == 0);
 
-    DBG("Start send_loop\n");
-    int retval = send_loop(config, enc, chan_enc2net);
+    // send_loop runs in the calling thread, which is placed as the send stage
+    struct hgap_thread_placement placement;
+    hgap_placement_save(&placement);
+
+    int retval;
+    if (to_store) {
+        DBG("Start store_loop\n");
+        retval = store_loop(config, chan_enc2net, budget, live, live_enc2net);
+    } else {
+        DBG("Start send_loop\n");
+        retval = send_loop(config, enc, chan_enc2net, budget, live,
+                           live_enc2net);
+    }
+    hgap_placement_restore(&placement);
     void *tmp_ret = (void *) HGAP_SUCCESS;
 
+    if (retval != HGAP_SUCCESS) {
+        // Unblock the other threads
+        hgap_membudget_poison(budget);
+        channel_poison(chan_enc2net);
+        channel_poison(chan_in2enc);
+    }
+
     pthread_join(read_thread, &tmp_ret);
     if (tmp_ret != (void *) HGAP_SUCCESS) {
         retval = HGAP_SELECT_ERROR((int) (uintptr_t) tmp_ret, retval);
@@ -328,9 +708,44 @@ hgap_send(const struct hgap_config *config)
         retval = HGAP_SELECT_ERROR((int) (uintptr_t) tmp_ret, retval);
     }
 
+    if (retval != HGAP_SUCCESS) {
+        hgap_live_add(live, HGAP_LIVE_ERRORS, 1);
+    }
+    hgap_live_free(live);
+    HGAP_TIMING_REPORT(stderr, HGAP_TIMING_SENDER_FIRST,
+                       HGAP_TIMING_RECEIVER_FIRST - 1);
+    if (chanstats != NULL) {
+        hgap_chanstats_free(chanstats);
+    }
     channel_free(chan_enc2net);
     channel_free(chan_in2enc);
+    hgap_membudget_free(budget);
     hgap_encoder_free(enc);
 
     return retval;
 }
+
+int
+hgap_send(const struct hgap_config *config)
+{
+    int err;
+    if ((err = hgap_check_config_sender(config)) != HGAP_SUCCESS) {
+        return err;
+    }
+
+    if (config->store_path != NULL) {
+        return send_store(config);
+    }
+    return encode_pipeline(config, 0);
+}
+
+int
+hgap_store(const struct hgap_config *config)
+{
+    int err;
+    if ((err = hgap_check_config_store(config)) != HGAP_SUCCESS) {
+        return err;
+    }
+
+    return encode_pipeline(config, 1);
+}
@@ -19,79 +19,57 @@
 #include "limiter.h"
 
 #include <string.h>
-#include <sys/time.h>
 
 #include "common.h"
 #include "proto.h"
 
 #define HLIM_CHK_PERIOD 1000
-#define HLIM_SLEEP_PERIOD 100                // in microseconds
 
 struct hgap_limiter {
     double byterate;
     size_t n_pkt_sent;
     size_t n_bytes_sent;
-    struct timeval since;
+    // Beginning of the current period, CLOCK_MONOTONIC ns
+    uint64_t since;
 
     size_t total_data_sent;
 };
 
-static double
-time_diff(struct timeval *before , struct timeval *after)
-{
-    double before_us = before->tv_sec + before->tv_usec / 1000000.;
-    double after_us = after->tv_sec + after->tv_usec / 1000000.;
-
-    return after_us - before_us;
-}
-
 static void
-hgap_limiter_reset_rate(struct hgap_limiter *hlim)
+hgap_limiter_reset_rate(struct hgap_limiter *hlim, uint64_t since)
 {
-    gettimeofday(&hlim->since , NULL);
+    hlim->since = since;
     hlim->n_pkt_sent = 0;
     hlim->n_bytes_sent = 0;
 }
 
-static double
-hgap_limiter_get_current_rate(struct hgap_limiter *hlim)
-{
-    struct timeval now;
-    gettimeofday(&now , NULL);
-    double diff = time_diff(&hlim->since, &now);
-    double rate;
-    if (diff == 0) {
-        rate = 0;
-    } else {
-        rate = hlim->n_bytes_sent / diff;
-    }
-    return rate;
-}
-
 struct hgap_limiter *
 hgap_limiter_new(double byterate)
 {
     struct hgap_limiter *hlim = xmalloc(sizeof(struct hgap_limiter));
     hlim->byterate = byterate;
-    hgap_limiter_reset_rate(hlim);
+    hgap_limiter_reset_rate(hlim, hgap_now_ns());
     hlim->total_data_sent = 0;
     return hlim;
 }
 
-int
+uint64_t
 hgap_limiter_limit(struct hgap_limiter *hlim, size_t len)
 {
     hlim->total_data_sent += len;
     hlim->n_pkt_sent++;
     hlim->n_bytes_sent += len;
-    if (hlim->byterate && hlim->n_pkt_sent > HLIM_CHK_PERIOD) {
-        while (hgap_limiter_get_current_rate(hlim) > hlim->byterate) {
-            usleep(HLIM_SLEEP_PERIOD);
-        }
-        hgap_limiter_reset_rate(hlim);
+    if (!hlim->byterate || hlim->n_pkt_sent <= HLIM_CHK_PERIOD) {
+        return 0;
     }
 
-    return HGAP_SUCCESS;
+    // When the bytes sent this period bring the rate down to byterate
+    uint64_t due = hlim->since +
+                   (uint64_t) (hlim->n_bytes_sent * 1e9 / hlim->byterate);
+    uint64_t now = hgap_now_ns();
+    hgap_limiter_reset_rate(hlim, MAX(now, due));
+
+    return due > now ? due : 0;
 }
 
 void
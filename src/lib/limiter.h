@@ -20,11 +20,19 @@
 #define HGAP_LIMITER_H
 
 #include <stddef.h>
+#include <stdint.h>
 
 struct hgap_limiter;
 
 struct hgap_limiter *hgap_limiter_new(double byterate);
-int hgap_limiter_limit(struct hgap_limiter* hlim, size_t len);
+
+/**
+ * Accounts len bytes sent.
+ *
+ * @return the time (CLOCK_MONOTONIC, in ns) until which sending must pause
+ *     to stay under the byterate, 0 if it need not.
+ */
+uint64_t hgap_limiter_limit(struct hgap_limiter* hlim, size_t len);
 void hgap_limiter_free(struct hgap_limiter* hlim);
 
 #endif // HGAP_LIMITER_H
@@ -0,0 +1,198 @@
+/*
+ * This file is part of hairgap.
+ * Copyright (C) 2017  Florent MONJALET <florent.monjalet@cea.fr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "livestats.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "common.h"
+
+static const char *hgap_live_names[HGAP_LIVE_N_COUNTERS] = {
+    [HGAP_LIVE_BYTES_READ] = "bytes_read",
+    [HGAP_LIVE_CHUNKS_ENCODED] = "chunks_encoded",
+    [HGAP_LIVE_CHUNKS_SENT] = "chunks_sent",
+    [HGAP_LIVE_PKTS_SENT] = "pkts_sent",
+    [HGAP_LIVE_BYTES_SENT] = "bytes_sent",
+    [HGAP_LIVE_LIMITER_SLEEPS] = "limiter_sleeps",
+    [HGAP_LIVE_BACKPRESSURE_WAITS] = "backpressure_waits",
+    [HGAP_LIVE_LOCAL_DROPS] = "local_drops",
+    [HGAP_LIVE_PKTS_RECEIVED] = "pkts_received",
+    [HGAP_LIVE_BYTES_RECEIVED] = "bytes_received",
+    [HGAP_LIVE_KERNEL_DROPS] = "kernel_drops",
+    [HGAP_LIVE_PKTS_MISSING] = "pkts_missing",
+    [HGAP_LIVE_CHUNKS_DECODED] = "chunks_decoded",
+    [HGAP_LIVE_CHUNKS_WRITTEN] = "chunks_written",
+    [HGAP_LIVE_BYTES_WRITTEN] = "bytes_written",
+    [HGAP_LIVE_ERRORS] = "errors",
+};
+
+static int
+hgap_live_path(char *path, size_t size, const char *name)
+{
+    if (strchr(name, '/') != NULL ||
+        snprintf(path, size, HGAP_LIVE_PREFIX "%s", name) >= (int) size) {
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+// Whether the existing segment name was left by a transfer that is over
+// (or was killed before removing it), as opposed to a running one
+static int
+hgap_live_stale(const char *name)
+{
+    const struct hgap_live *live = hgap_live_attach(name);
+    if (live == NULL) {
+        // Possibly being initialized by its creator
+        return 0;
+    }
+
+    int stale = __atomic_load_n(&live->done, __ATOMIC_ACQUIRE) ||
+                (kill(live->pid, 0) == -1 && errno == ESRCH);
+    hgap_live_detach(live);
+    return stale;
+}
+
+struct hgap_live *
+hgap_live_new(const char *name, enum hgap_live_role role)
+{
+    char path[HGAP_LIVE_NAME_LEN];
+    if (hgap_live_path(path, sizeof path, name) == -1) {
+        return NULL;
+    }
+
+    int fd = shm_open(path, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd == -1 && errno == EEXIST) {
+        // Never take over the segment of a running transfer
+        if (!hgap_live_stale(name)) {
+            errno = EEXIST;
+            return NULL;
+        }
+        shm_unlink(path);
+        fd = shm_open(path, O_RDWR | O_CREAT | O_EXCL, 0644);
+    }
+    if (fd == -1) {
+        return NULL;
+    }
+
+    struct hgap_live *live = MAP_FAILED;
+    if (ftruncate(fd, sizeof *live) == 0) {
+        live = mmap(NULL, sizeof *live, PROT_READ | PROT_WRITE, MAP_SHARED,
+                    fd, 0);
+    }
+    close(fd);
+    if (live == MAP_FAILED) {
+        shm_unlink(path);
+        return NULL;
+    }
+
+    // Fresh from ftruncate, so zeroed
+    live->version = HGAP_LIVE_VERSION;
+    live->role = role;
+    live->pid = getpid();
+    live->start_ns = hgap_now_ns();
+    strcpy(live->name, path);
+    // Last, readers check it
+    __atomic_store_n(&live->magic, HGAP_LIVE_MAGIC, __ATOMIC_RELEASE);
+
+    return live;
+}
+
+void
+hgap_live_free(struct hgap_live *live)
+{
+    if (live == NULL) {
+        return;
+    }
+
+    __atomic_store_n(&live->done, 1, __ATOMIC_RELEASE);
+    shm_unlink(live->name);
+    munmap(live, sizeof *live);
+}
+
+const struct hgap_live *
+hgap_live_attach(const char *name)
+{
+    char path[HGAP_LIVE_NAME_LEN];
+    if (hgap_live_path(path, sizeof path, name) == -1) {
+        return NULL;
+    }
+
+    int fd = shm_open(path, O_RDONLY, 0);
+    if (fd == -1) {
+        return NULL;
+    }
+
+    struct stat st;
+    const struct hgap_live *live = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t) st.st_size >= sizeof *live) {
+        live = mmap(NULL, sizeof *live, PROT_READ, MAP_SHARED, fd, 0);
+    } else {
+        errno = EPROTO;
+    }
+    close(fd);
+    if (live == MAP_FAILED) {
+        return NULL;
+    }
+
+    if (__atomic_load_n(&live->magic, __ATOMIC_ACQUIRE) != HGAP_LIVE_MAGIC ||
+        live->version != HGAP_LIVE_VERSION) {
+        munmap((void *) live, sizeof *live);
+        errno = EPROTO;
+        return NULL;
+    }
+
+    return live;
+}
+
+void
+hgap_live_detach(const struct hgap_live *live)
+{
+    munmap((void *) live, sizeof *live);
+}
+
+int
+hgap_live_add_queue(struct hgap_live *live, const char *name,
+                    struct channel *chan)
+{
+    if (live == NULL || live->n_queues == HGAP_LIVE_QUEUES) {
+        return -1;
+    }
+
+    int idx = live->n_queues;
+    struct hgap_live_queue *queue = &live->queues[idx];
+    snprintf(queue->name, sizeof queue->name, "%s", name);
+    queue->capacity = channel_capacity(chan);
+    __atomic_store_n(&live->n_queues, idx + 1, __ATOMIC_RELEASE);
+
+    return idx;
+}
+
+const char *
+hgap_live_counter_name(enum hgap_live_counter counter)
+{
+    return hgap_live_names[counter];
+}
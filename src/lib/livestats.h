@@ -0,0 +1,189 @@
+/*
+ * This file is part of hairgap.
+ * Copyright (C) 2017  Florent MONJALET <florent.monjalet@cea.fr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HGAP_LIVESTATS_H
+#define HGAP_LIVESTATS_H
+
+#include <stdalign.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "channel.h"
+
+/**
+ * Live counters of a running transfer, published in a POSIX shared memory
+ * segment (/hgap-NAME, see config->stats_name) so that hgap-stat, or any
+ * monitoring tool, can read them while the transfer runs.
+ *
+ * The pipeline threads update them with relaxed atomics, each counter on its
+ * own cache line so that the threads do not contend. Readers only get a
+ * snapshot of each counter, not a consistent view of all of them.
+ *
+ * All the functions accept a NULL segment and do nothing then, so that the
+ * pipeline does not need to check whether live stats are enabled.
+ */
+
+#define HGAP_LIVE_MAGIC 0x68676170 // "hgap"
+#define HGAP_LIVE_VERSION 1
+#define HGAP_LIVE_PREFIX "/hgap-"
+#define HGAP_LIVE_NAME_LEN 64
+#define HGAP_LIVE_QUEUES 8
+#define HGAP_LIVE_QUEUE_NAME_LEN 24
+#define HGAP_LIVE_CACHE_LINE 64
+
+enum hgap_live_role {
+    HGAP_LIVE_SENDER,
+    HGAP_LIVE_RECEIVER,
+};
+
+/**
+ * Counters, see hgap_live_counter_name for their meaning.
+ */
+enum hgap_live_counter {
+    HGAP_LIVE_BYTES_READ,
+    HGAP_LIVE_CHUNKS_ENCODED,
+    HGAP_LIVE_CHUNKS_SENT,
+    HGAP_LIVE_PKTS_SENT,
+    HGAP_LIVE_BYTES_SENT,
+    HGAP_LIVE_LIMITER_SLEEPS,
+    HGAP_LIVE_BACKPRESSURE_WAITS,
+    HGAP_LIVE_LOCAL_DROPS,
+    HGAP_LIVE_PKTS_RECEIVED,
+    HGAP_LIVE_BYTES_RECEIVED,
+    HGAP_LIVE_KERNEL_DROPS,
+    HGAP_LIVE_PKTS_MISSING,
+    HGAP_LIVE_CHUNKS_DECODED,
+    HGAP_LIVE_CHUNKS_WRITTEN,
+    HGAP_LIVE_BYTES_WRITTEN,
+    HGAP_LIVE_ERRORS,
+    HGAP_LIVE_N_COUNTERS
+};
+
+struct hgap_live_counter_slot {
+    alignas(HGAP_LIVE_CACHE_LINE) uint64_t value;
+};
+
+/**
+ * Occupancy of a pipeline channel, sampled by its consumer.
+ */
+struct hgap_live_queue {
+    alignas(HGAP_LIVE_CACHE_LINE) char name[HGAP_LIVE_QUEUE_NAME_LEN];
+    uint64_t capacity;
+    uint64_t depth;
+};
+
+/**
+ * Layout of the segment. The header is written once at creation, but for
+ * done, set when the transfer ends.
+ */
+struct hgap_live {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t role;
+    uint32_t pid;
+    // CLOCK_MONOTONIC
+    uint64_t start_ns;
+    uint32_t done;
+    uint32_t n_queues;
+    char name[HGAP_LIVE_NAME_LEN];
+
+    struct hgap_live_counter_slot counters[HGAP_LIVE_N_COUNTERS];
+    struct hgap_live_queue queues[HGAP_LIVE_QUEUES];
+};
+
+/**
+ * Creates the segment /hgap-name with all counters at 0. A segment left by a
+ * transfer whose process is gone is replaced, the one of a running transfer
+ * is not (errno is EEXIST).
+ *
+ * @return the mapped segment, or NULL on failure (errno is set).
+ */
+struct hgap_live *hgap_live_new(const char *name, enum hgap_live_role role);
+
+/**
+ * Marks the transfer as done, unmaps and removes the segment. Readers that
+ * already mapped it can still read the final values.
+ */
+void hgap_live_free(struct hgap_live *live);
+
+/**
+ * Maps the segment /hgap-name read-only, for the readers.
+ *
+ * @return the mapped segment, or NULL on failure (errno is set, EPROTO if it
+ *     is not a segment of this version).
+ */
+const struct hgap_live *hgap_live_attach(const char *name);
+void hgap_live_detach(const struct hgap_live *live);
+
+/**
+ * Registers chan, whose occupancy will be published by hgap_live_sample
+ * under name.
+ *
+ * @return the index of the queue, -1 if there is no room left (sampling it
+ *     is then a no-op).
+ */
+int hgap_live_add_queue(struct hgap_live *live, const char *name,
+                        struct channel *chan);
+
+/**
+ * Short name of counter, for the readers.
+ */
+const char *hgap_live_counter_name(enum hgap_live_counter counter);
+
+static inline void
+hgap_live_add(struct hgap_live *live, enum hgap_live_counter counter,
+              uint64_t n)
+{
+    if (live != NULL) {
+        __atomic_fetch_add(&live->counters[counter].value, n,
+                           __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Sets a counter maintained elsewhere (to be called by a single thread).
+ */
+static inline void
+hgap_live_set(struct hgap_live *live, enum hgap_live_counter counter,
+              uint64_t value)
+{
+    if (live != NULL) {
+        __atomic_store_n(&live->counters[counter].value, value,
+                         __ATOMIC_RELAXED);
+    }
+}
+
+static inline uint64_t
+hgap_live_get(const struct hgap_live *live, enum hgap_live_counter counter)
+{
+    return __atomic_load_n(&live->counters[counter].value, __ATOMIC_RELAXED);
+}
+
+/**
+ * Publishes the occupancy of the channel of queue idx.
+ */
+static inline void
+hgap_live_sample(struct hgap_live *live, int idx, struct channel *chan)
+{
+    if (live != NULL && idx >= 0) {
+        __atomic_store_n(&live->queues[idx].depth, channel_len(chan),
+                         __ATOMIC_RELAXED);
+    }
+}
+
+#endif // HGAP_LIVESTATS_H
@@ -0,0 +1,135 @@
+/*
+ * This file is part of hairgap.
+ * Copyright (C) 2017  Florent MONJALET <florent.monjalet@cea.fr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "membudget.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "common.h"
+
+struct hgap_membudget {
+    size_t limit;
+    size_t used;
+    int poisoned;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
+
+// Must be called with the mutex held
+static int
+hgap_membudget_fits(struct hgap_membudget *budget, size_t bytes)
+{
+    return budget->used == 0 || budget->used + bytes <= budget->limit;
+}
+
+struct hgap_membudget *
+hgap_membudget_new(size_t limit)
+{
+    struct hgap_membudget *budget = xmalloc(sizeof *budget);
+
+    budget->limit = limit;
+    budget->used = 0;
+    budget->poisoned = 0;
+    pthread_mutex_init(&budget->mutex, NULL);
+    pthread_cond_init(&budget->cond, NULL);
+
+    return budget;
+}
+
+void
+hgap_membudget_free(struct hgap_membudget *budget)
+{
+    if (budget->used != 0) {
+        DBG("Memory budget freed with %zu bytes accounted\n", budget->used);
+    }
+    pthread_cond_destroy(&budget->cond);
+    pthread_mutex_destroy(&budget->mutex);
+    free(budget);
+}
+
+int
+hgap_membudget_acquire(struct hgap_membudget *budget, size_t bytes)
+{
+    pthread_mutex_lock(&budget->mutex);
+    while (!budget->poisoned && !hgap_membudget_fits(budget, bytes)) {
+        pthread_cond_wait(&budget->cond, &budget->mutex);
+    }
+
+    int ok = !budget->poisoned;
+    if (ok) {
+        budget->used += bytes;
+    }
+    pthread_mutex_unlock(&budget->mutex);
+
+    return ok;
+}
+
+int
+hgap_membudget_try_acquire(struct hgap_membudget *budget, size_t bytes)
+{
+    pthread_mutex_lock(&budget->mutex);
+    int ok = !budget->poisoned && hgap_membudget_fits(budget, bytes);
+    if (ok) {
+        budget->used += bytes;
+    }
+    pthread_mutex_unlock(&budget->mutex);
+
+    return ok;
+}
+
+void
+hgap_membudget_charge(struct hgap_membudget *budget, size_t bytes)
+{
+    pthread_mutex_lock(&budget->mutex);
+    budget->used += bytes;
+    pthread_mutex_unlock(&budget->mutex);
+}
+
+void
+hgap_membudget_release(struct hgap_membudget *budget, size_t bytes)
+{
+    pthread_mutex_lock(&budget->mutex);
+    budget->used -= MIN(bytes, budget->used);
+    pthread_cond_broadcast(&budget->cond);
+    pthread_mutex_unlock(&budget->mutex);
+}
+
+void
+hgap_membudget_poison(struct hgap_membudget *budget)
+{
+    pthread_mutex_lock(&budget->mutex);
+    budget->poisoned = 1;
+    pthread_cond_broadcast(&budget->cond);
+    pthread_mutex_unlock(&budget->mutex);
+}
+
+size_t
+hgap_membudget_limit(struct hgap_membudget *budget)
+{
+    return budget->limit;
+}
+
+size_t
+hgap_membudget_depth(size_t share, size_t elt_size, size_t min_depth,
+                     size_t max_depth)
+{
+    size_t depth = elt_size ? share / elt_size : max_depth;
+    return MAX(min_depth, MIN(depth, max_depth));
+}
@@ -0,0 +1,79 @@
+/*
+ * This file is part of hairgap.
+ * Copyright (C) 2017  Florent MONJALET <florent.monjalet@cea.fr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HGAP_MEMBUDGET_H
+#define HGAP_MEMBUDGET_H
+
+#include <stddef.h>
+
+/**
+ * A byte-accounted memory budget shared by the stages of a pipeline.
+ *
+ * A stage that is about to hold some memory acquires it first (and blocks
+ * while the budget is exhausted), the stage that frees it releases it. This
+ * applies backpressure on the producing side based on the actual amount of
+ * memory in flight rather than on a number of queued elements.
+ *
+ * To guarantee progress, an acquisition is always granted when nothing is
+ * currently accounted, even if it exceeds the limit.
+ */
+struct hgap_membudget;
+
+struct hgap_membudget *hgap_membudget_new(size_t limit);
+void hgap_membudget_free(struct hgap_membudget *budget);
+
+/**
+ * Blocks until bytes can be accounted in the budget.
+ *
+ * @return 1 on success, 0 if the budget has been poisoned.
+ */
+int hgap_membudget_acquire(struct hgap_membudget *budget, size_t bytes);
+
+/**
+ * Non-blocking version of hgap_membudget_acquire.
+ *
+ * @return 1 if bytes were accounted, 0 otherwise.
+ */
+int hgap_membudget_try_acquire(struct hgap_membudget *budget, size_t bytes);
+
+/**
+ * Accounts bytes unconditionally (may exceed the limit), for memory the
+ * caller has to hold anyway.
+ */
+void hgap_membudget_charge(struct hgap_membudget *budget, size_t bytes);
+
+/**
+ * Gives back bytes previously acquired or charged, waking up any waiter.
+ */
+void hgap_membudget_release(struct hgap_membudget *budget, size_t bytes);
+
+/**
+ * Poisons the budget so that any blocked or further acquisition fails.
+ */
+void hgap_membudget_poison(struct hgap_membudget *budget);
+
+size_t hgap_membudget_limit(struct hgap_membudget *budget);
+
+/**
+ * Number of elements of elt_size bytes that fit in share bytes, clamped to
+ * [min_depth, max_depth]. Meant to size channels from a memory budget.
+ */
+size_t hgap_membudget_depth(size_t share, size_t elt_size, size_t min_depth,
+                            size_t max_depth);
+
+#endif // HGAP_MEMBUDGET_H
@@ -0,0 +1,490 @@
+/*
+ * This file is part of hairgap.
+ * Copyright (C) 2017  Florent MONJALET <florent.monjalet@cea.fr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE // struct mmsghdr
+
+#include "memlink.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "proto.h"
+#include "transport.h"
+
+#define HGAP_MEMLINK_CACHE_LINE 64
+// An empty receiver spins that long before sleeping
+#define HGAP_MEMLINK_SPIN_NS (20 * 1000)
+// Pause of a sender waiting for room
+#define HGAP_MEMLINK_SEND_PAUSE_NS (10 * 1000)
+
+struct hgap_memlink_slot {
+    // CLOCK_MONOTONIC ns before which it cannot be received, 0 if none
+    uint64_t due;
+    uint32_t len;
+    char data[HGAP_MAX_PKT_SIZE];
+};
+
+struct hgap_memlink {
+    struct hgap_memlink_params params;
+    size_t capacity;
+    struct hgap_memlink_slot *slots;
+    // Wakes up the receiver, see hgap_memlink_arm
+    int efd;
+    atomic_int waiting;
+    // The receiving endpoint is closed
+    atomic_int closed;
+
+    // Producer side
+    alignas(HGAP_MEMLINK_CACHE_LINE) atomic_uint_least64_t head;
+    uint64_t tail_cache;
+    uint64_t rng;
+    // Gilbert-Elliott state
+    int bad;
+    // When the rate-capped link is done with the packets pushed so far
+    uint64_t busy_until;
+    // Packet held back to be reordered, for held_for more packets
+    struct hgap_memlink_slot held;
+    int holding;
+    unsigned held_for;
+    struct hgap_memlink_stats stats;
+
+    // Consumer side
+    alignas(HGAP_MEMLINK_CACHE_LINE) atomic_uint_least64_t tail;
+    uint64_t delivered;
+};
+
+struct hgap_memlink_end {
+    struct hgap_transport tr;
+    struct hgap_memlink *link;
+};
+
+#define LINK(tr) (((struct hgap_memlink_end *) (tr))->link)
+
+// splitmix64, good enough for loss draws and cheap to seed
+static uint64_t
+hgap_memlink_rand(struct hgap_memlink *link)
+{
+    uint64_t z = (link->rng += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+// True with probability p
+static int
+hgap_memlink_draw(struct hgap_memlink *link, double p)
+{
+    return (hgap_memlink_rand(link) >> 11) * 0x1.0p-53 < p;
+}
+
+static int
+hgap_memlink_lose(struct hgap_memlink *link)
+{
+    const struct hgap_memlink_params *p = &link->params;
+
+    switch (p->loss_model) {
+    case HGAP_LOSS_BERNOULLI:
+        return hgap_memlink_draw(link, p->loss);
+    case HGAP_LOSS_GILBERT_ELLIOTT:
+        if (hgap_memlink_draw(link, link->bad ? p->ge_r : p->ge_p)) {
+            link->bad = !link->bad;
+        }
+        return hgap_memlink_draw(link, link->bad ? p->ge_loss_bad :
+                                                   p->ge_loss_good);
+    default:
+        return 0;
+    }
+}
+
+static size_t
+hgap_memlink_room(struct hgap_memlink *link)
+{
+    uint64_t head = atomic_load_explicit(&link->head, memory_order_relaxed);
+    if (link->capacity - (head - link->tail_cache) < 2) {
+        link->tail_cache = atomic_load_explicit(&link->tail,
+                                                memory_order_acquire);
+    }
+    return link->capacity - (head - link->tail_cache);
+}
+
+static void
+hgap_memlink_wake(struct hgap_memlink *link)
+{
+    uint64_t one = 1;
+    ssize_t ret = write(link->efd, &one, sizeof one);
+    FAKE_USE(ret);
+}
+
+/**
+ * Puts a packet on the ring (there must be room), due when the rate-capped
+ * link would be done sending it, and wakes up the receiver if it sleeps.
+ */
+static void
+hgap_memlink_push(struct hgap_memlink *link, const void *pkt, size_t size)
+{
+    uint64_t due = 0;
+    if (link->params.rate > 0) {
+        uint64_t now = hgap_now_ns();
+        uint64_t start = MAX(now, link->busy_until);
+        if (link->params.queue_bytes > 0 &&
+            (start - now) * link->params.rate / 1e9 >
+            link->params.queue_bytes) {
+            link->stats.queue_drops++;
+            return;
+        }
+        due = start + size * 1e9 / link->params.rate;
+        link->busy_until = due;
+    }
+
+    uint64_t head = atomic_load_explicit(&link->head, memory_order_relaxed);
+    struct hgap_memlink_slot *slot = &link->slots[head & (link->capacity - 1)];
+    slot->due = due;
+    slot->len = size;
+    memcpy(slot->data, pkt, size);
+    atomic_store_explicit(&link->head, head + 1, memory_order_release);
+
+    // Pairs with the one of hgap_memlink_arm: either it sees the packet or
+    // we see it waiting
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&link->waiting, memory_order_relaxed) &&
+        atomic_exchange_explicit(&link->waiting, 0, memory_order_relaxed)) {
+        hgap_memlink_wake(link);
+    }
+}
+
+/**
+ * The packets lost by the loss model are "sent" as far as the sender knows,
+ * as on a real link. Room is kept for the held packet, so that it can always
+ * be pushed after the current one.
+ */
+static ssize_t
+hgap_memlink_send(struct hgap_transport *tr, const void *pkt, size_t size)
+{
+    struct hgap_memlink *link = LINK(tr);
+
+    if (size > HGAP_MAX_PKT_SIZE) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    if (atomic_load_explicit(&link->closed, memory_order_acquire)) {
+        return size;
+    }
+    if (hgap_memlink_room(link) < 2) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    link->stats.sent++;
+    if (hgap_memlink_lose(link)) {
+        link->stats.lost++;
+        return size;
+    }
+
+    if (!link->holding && link->params.reorder > 0 &&
+        hgap_memlink_draw(link, link->params.reorder)) {
+        link->stats.reordered++;
+        memcpy(link->held.data, pkt, size);
+        link->held.len = size;
+        link->held_for = link->params.reorder_distance;
+        link->holding = 1;
+        return size;
+    }
+
+    hgap_memlink_push(link, pkt, size);
+    if (link->holding && --link->held_for == 0) {
+        hgap_memlink_push(link, link->held.data, link->held.len);
+        link->holding = 0;
+    }
+
+    return size;
+}
+
+static void
+hgap_memlink_wait_send(struct hgap_transport *tr, int timeout_ms)
+{
+    struct hgap_memlink *link = LINK(tr);
+    const struct timespec pause = { .tv_nsec=HGAP_MEMLINK_SEND_PAUSE_NS };
+    uint64_t deadline = hgap_now_ns() + timeout_ms * 1000000ULL;
+
+    while (hgap_memlink_room(link) < 2 &&
+           !atomic_load_explicit(&link->closed, memory_order_acquire) &&
+           hgap_now_ns() < deadline) {
+        nanosleep(&pause, NULL);
+    }
+}
+
+static void
+hgap_memlink_free_sender(struct hgap_transport *tr)
+{
+    struct hgap_memlink *link = LINK(tr);
+
+    // Delivered late rather than never (there is room left for it)
+    if (link->holding &&
+        !atomic_load_explicit(&link->closed, memory_order_acquire)) {
+        hgap_memlink_push(link, link->held.data, link->held.len);
+    }
+    link->holding = 0;
+    free(tr);
+}
+
+/**
+ * Takes up to n packets from the ring, waiting for the first one to be due
+ * if the link is rate-capped.
+ */
+static size_t
+hgap_memlink_take(struct hgap_memlink *link, struct mmsghdr *msgs, size_t n)
+{
+    uint64_t tail = atomic_load_explicit(&link->tail, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&link->head, memory_order_acquire);
+    uint64_t now = 0;
+    size_t k = 0;
+
+    for (; k < n && tail != head; k++, tail++) {
+        struct hgap_memlink_slot *slot =
+                &link->slots[tail & (link->capacity - 1)];
+        if (slot->due > now && (now = hgap_now_ns()) < slot->due) {
+            if (k > 0) {
+                break;
+            }
+            struct timespec ts = {
+                .tv_sec=slot->due / 1000000000,
+                .tv_nsec=slot->due % 1000000000,
+            };
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts,
+                                   NULL) == EINTR) {
+                continue;
+            }
+            now = slot->due;
+        }
+
+        struct iovec *iov = msgs[k].msg_hdr.msg_iov;
+        size_t len = MIN(slot->len, iov->iov_len);
+        memcpy(iov->iov_base, slot->data, len);
+        msgs[k].msg_len = len;
+        msgs[k].msg_hdr.msg_controllen = 0;
+    }
+
+    atomic_store_explicit(&link->tail, tail, memory_order_release);
+    link->delivered += k;
+    return k;
+}
+
+/**
+ * Announces that the receiver is about to wait on the eventfd, which the
+ * sender then signals on its next packet. The eventfd is drained first, so
+ * that it only polls readable for the packets that come after.
+ *
+ * @return 1 if packets came in meanwhile (and the receiver should not wait),
+ *     0 otherwise.
+ */
+static int
+hgap_memlink_arm(struct hgap_memlink *link)
+{
+    uint64_t count;
+    ssize_t ret = read(link->efd, &count, sizeof count);
+    FAKE_USE(ret);
+
+    atomic_store_explicit(&link->waiting, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&link->head, memory_order_acquire) !=
+        atomic_load_explicit(&link->tail, memory_order_relaxed)) {
+        atomic_store_explicit(&link->waiting, 0, memory_order_relaxed);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Spins a bit on an empty ring before sleeping on the eventfd. Without
+ * waiting (in an event loop), the eventfd is armed as soon as the ring is
+ * drained, so that it polls readable when the next packets come in.
+ */
+static int
+hgap_memlink_recv(struct hgap_transport *tr, struct mmsghdr *msgs, size_t n,
+                  int flags, uint64_t timeout)
+{
+    struct hgap_memlink *link = LINK(tr);
+    uint64_t start = 0;
+
+    for (;;) {
+        size_t k = hgap_memlink_take(link, msgs, n);
+        if (flags & HGAP_TRANSPORT_DONTWAIT) {
+            if (k == n) {
+                return k;
+            } else if (hgap_memlink_arm(link)) {
+                if (k > 0) {
+                    // The caller will not try again before polling
+                    hgap_memlink_wake(link);
+                    return k;
+                }
+                continue;
+            } else if (k > 0) {
+                return k;
+            }
+            errno = EAGAIN;
+            return -1;
+        } else if (k > 0) {
+            return k;
+        }
+
+        uint64_t now = hgap_now_ns();
+        if (start == 0) {
+            start = now;
+        }
+        uint64_t elapsed = (now - start) / 1000;
+        if (timeout != 0 && elapsed >= timeout) {
+            errno = ETIMEDOUT;
+            return -1;
+        } else if (now - start < HGAP_MEMLINK_SPIN_NS) {
+            hgap_cpu_relax();
+            continue;
+        } else if (hgap_memlink_arm(link)) {
+            continue;
+        }
+
+        struct pollfd pfd = { .fd=link->efd, .events=POLLIN };
+        int poll_ms = timeout != 0 ? (int) ((timeout - elapsed + 999) / 1000) :
+                                     -1;
+        if (poll(&pfd, 1, poll_ms) == -1 && errno != EINTR) {
+            return -1;
+        }
+    }
+}
+
+static int
+hgap_memlink_fd(struct hgap_transport *tr)
+{
+    return LINK(tr)->efd;
+}
+
+// The ring never drops, it makes the sender wait
+static uint32_t
+hgap_memlink_drops(struct hgap_transport *tr)
+{
+    FAKE_USE(tr);
+    return 0;
+}
+
+static void
+hgap_memlink_free_receiver(struct hgap_transport *tr)
+{
+    atomic_store_explicit(&LINK(tr)->closed, 1, memory_order_release);
+    free(tr);
+}
+
+static const struct hgap_transport_ops hgap_memlink_sender_ops = {
+    .send=hgap_memlink_send,
+    .wait_send=hgap_memlink_wait_send,
+    .free=hgap_memlink_free_sender,
+};
+
+static const struct hgap_transport_ops hgap_memlink_receiver_ops = {
+    .recv=hgap_memlink_recv,
+    .fd=hgap_memlink_fd,
+    .drops=hgap_memlink_drops,
+    .free=hgap_memlink_free_receiver,
+};
+
+struct hgap_memlink *
+hgap_memlink_new(const struct hgap_memlink_params *params)
+{
+    void *mem = NULL;
+    if ((errno = posix_memalign(&mem, HGAP_MEMLINK_CACHE_LINE,
+                                sizeof (struct hgap_memlink))) != 0) {
+        return NULL;
+    }
+    struct hgap_memlink *link = mem;
+    memset(link, 0, sizeof *link);
+    link->params = *params;
+    if (link->params.capacity == 0) {
+        link->params.capacity = HGAP_MEMLINK_DEF_CAPACITY;
+    }
+    if (link->params.reorder_distance == 0) {
+        link->params.reorder_distance = HGAP_MEMLINK_DEF_REORDER_DISTANCE;
+    }
+    link->rng = params->seed;
+
+    // A power of 2, with room for a packet and a held one
+    link->capacity = 2;
+    while (link->capacity < link->params.capacity) {
+        link->capacity *= 2;
+    }
+
+    link->slots = malloc(link->capacity * sizeof *link->slots);
+    if (link->slots == NULL) {
+        free(link);
+        return NULL;
+    }
+
+    link->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (link->efd == -1) {
+        free(link->slots);
+        free(link);
+        return NULL;
+    }
+    // Until the first packet, for the receivers that poll the eventfd first
+    atomic_init(&link->waiting, 1);
+
+    return link;
+}
+
+void
+hgap_memlink_free(struct hgap_memlink *link)
+{
+    if (link == NULL) {
+        return;
+    }
+
+    close(link->efd);
+    free(link->slots);
+    free(link);
+}
+
+void
+hgap_memlink_get_stats(struct hgap_memlink *link,
+                       struct hgap_memlink_stats *stats)
+{
+    *stats = link->stats;
+    stats->delivered = link->delivered;
+}
+
+struct hgap_transport *
+hgap_memlink_sender(struct hgap_memlink *link)
+{
+    struct hgap_memlink_end *end = xmalloc(sizeof *end);
+    end->tr.ops = &hgap_memlink_sender_ops;
+    end->link = link;
+    return &end->tr;
+}
+
+struct hgap_transport *
+hgap_memlink_receiver(struct hgap_memlink *link)
+{
+    struct hgap_memlink_end *end = xmalloc(sizeof *end);
+    end->tr.ops = &hgap_memlink_receiver_ops;
+    end->link = link;
+    return &end->tr;
+}
@@ -0,0 +1,135 @@
+/*
+ * This file is part of hairgap.
+ * Copyright (C) 2017  Florent MONJALET <florent.monjalet@cea.fr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HGAP_MEMLINK_H
+#define HGAP_MEMLINK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * In-memory link between a sender and a receiver of the same process (see
+ * config->memlink), to benchmark whole transfers without the network stack
+ * and with losses that do not depend on the host: the same seed gives the
+ * same losses and reordering, for any combination of n_pkt, pkt_size and
+ * redund.
+ *
+ * The packets go through a lock-free single producer, single consumer ring
+ * of capacity slots. When it is full, sends fail with EAGAIN and the sender
+ * waits for the receiver, as on a full socket buffer: the link itself never
+ * drops packets for lack of room, only the loss models and the queue of the
+ * rate cap do. The receiver only sleeps (on an eventfd) when the ring is
+ * empty, the sender then wakes it up.
+ *
+ * A link carries a single transfer: once the receiving endpoint is closed,
+ * the packets still sent are discarded.
+ */
+
+// Default capacity of the ring, in packets
+#define HGAP_MEMLINK_DEF_CAPACITY 4096
+// Default distance of the reordered packets
+#define HGAP_MEMLINK_DEF_REORDER_DISTANCE 1
+
+enum hgap_loss_model {
+    HGAP_LOSS_NONE = 0,
+    // Each packet lost with probability loss
+    HGAP_LOSS_BERNOULLI,
+    // Bursts of losses, see struct hgap_memlink_params
+    HGAP_LOSS_GILBERT_ELLIOTT,
+};
+
+/**
+ * capacity: packets in flight on the link, rounded up to a power of 2 (0
+ *     for HGAP_MEMLINK_DEF_CAPACITY).
+ * seed: of the pseudo-random draws of the loss models and the reordering.
+ * loss_model, loss: see enum hgap_loss_model.
+ * ge_p, ge_r, ge_loss_good, ge_loss_bad: the Gilbert-Elliott model is a
+ *     two-state Markov chain, the link goes from the good state to the bad
+ *     one with probability ge_p before each packet, and back with
+ *     probability ge_r. A packet is lost with probability ge_loss_good in the
+ *     good state and ge_loss_bad in the bad one. The mean burst length is
+ *     1 / ge_r for ge_loss_bad = 1, and the average loss ge_p / (ge_p + ge_r)
+ *     with ge_loss_good = 0.
+ * reorder: probability that a packet is held back and delivered after the
+ *     reorder_distance next ones (0 for HGAP_MEMLINK_DEF_REORDER_DISTANCE).
+ *     A single packet is held at a time.
+ * rate: capacity of the link in bytes/s, 0 for no limit. Packets are
+ *     delivered as they would come out of a link of that rate, in order.
+ * queue_bytes: with a rate, the packets that would wait behind more than
+ *     queue_bytes bytes are dropped, as by the queue of a router. 0 leaves
+ *     the queue bounded by the capacity of the ring only, the sender then
+ *     waits for the link instead.
+ */
+struct hgap_memlink_params {
+    size_t capacity;
+    uint64_t seed;
+    enum hgap_loss_model loss_model;
+    double loss;
+    double ge_p;
+    double ge_r;
+    double ge_loss_good;
+    double ge_loss_bad;
+    double reorder;
+    unsigned reorder_distance;
+    double rate;
+    size_t queue_bytes;
+};
+
+/**
+ * What happened to the packets sent on the link: sent counts all of them,
+ * lost the ones dropped by the loss model, queue_drops the ones dropped by
+ * the queue of the rate cap and reordered the ones held back. delivered
+ * counts the packets taken by the receiver.
+ */
+struct hgap_memlink_stats {
+    uint64_t sent;
+    uint64_t lost;
+    uint64_t queue_drops;
+    uint64_t reordered;
+    uint64_t delivered;
+};
+
+struct hgap_memlink;
+struct hgap_transport;
+
+/**
+ * Creates a link with these parameters.
+ *
+ * @return the link, or NULL on failure (errno is set).
+ */
+struct hgap_memlink *hgap_memlink_new(const struct hgap_memlink_params *params);
+
+/**
+ * Frees the link, once both endpoints are closed.
+ */
+void hgap_memlink_free(struct hgap_memlink *link);
+
+/**
+ * Fills stats with the counters of the link, once both endpoints are closed.
+ */
+void hgap_memlink_get_stats(struct hgap_memlink *link,
+                            struct hgap_memlink_stats *stats);
+
+/**
+ * Sending and receiving endpoints of the link (see transport.h), a single one
+ * of each at a time.
+ */
+struct hgap_transport *hgap_memlink_sender(struct hgap_memlink *link);
+struct hgap_transport *hgap_memlink_receiver(struct hgap_memlink *link);
+
+#endif // HGAP_MEMLINK_H
@@ -0,0 +1,505 @@
+/*
+ * This file is part of hairgap.
+ * Copyright (C) 2017  Florent MONJALET <florent.monjalet@cea.fr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "pcap.h"
+
+#include <byteswap.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+
+#define PCAP_MAGIC_US 0xa1b2c3d4
+#define PCAP_MAGIC_NS 0xa1b23c4d
+#define PCAP_HEADER_LEN 24
+#define PCAP_REC_LEN 16
+
+#define PCAPNG_SHB 0x0a0d0d0a
+#define PCAPNG_IDB 1
+#define PCAPNG_SPB 3
+#define PCAPNG_EPB 6
+#define PCAPNG_BYTE_ORDER 0x1a2b3c4d
+
+#define LINK_NULL 0
+#define LINK_ETHERNET 1
+#define LINK_RAW 101
+#define LINK_LINUX_SLL 113
+#define LINK_IPV4 228
+#define LINK_IPV6 229
+#define LINK_LINUX_SLL2 276
+
+#define ETHERTYPE_IPV4 0x0800
+#define ETHERTYPE_IPV6 0x86dd
+#define ETHERTYPE_VLAN 0x8100
+#define ETHERTYPE_QINQ 0x88a8
+
+#define IPPROTO_UDP_ 17
+#define UDP_HEADER_LEN 8
+
+// Biggest frame or block accepted, and interfaces per pcapng section
+#define HGAP_PCAP_MAX_BLOCK (256 * 1024)
+#define HGAP_PCAP_MAX_IFACES 64
+
+struct hgap_pcap {
+    FILE *file;
+    int ng;
+    // The file (or pcapng section) is in the other byte order
+    int swapped;
+    // Link type of the pcap file, of each interface of the pcapng section
+    uint16_t link;
+    uint16_t links[HGAP_PCAP_MAX_IFACES];
+    size_t n_links;
+    uint8_t *buf;
+    uint64_t truncated;
+};
+
+struct hgap_pcap_writer {
+    FILE *file;
+};
+
+static uint16_t
+rd16(const struct hgap_pcap *pcap, const uint8_t *p)
+{
+    uint16_t v;
+    memcpy(&v, p, sizeof v);
+    return pcap->swapped ? bswap_16(v) : v;
+}
+
+static uint32_t
+rd32(const struct hgap_pcap *pcap, const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof v);
+    return pcap->swapped ? bswap_32(v) : v;
+}
+
+// Network byte order
+static uint16_t
+be16(const uint8_t *p)
+{
+    return (uint16_t) (p[0] << 8 | p[1]);
+}
+
+/**
+ * Reads exactly size bytes.
+ *
+ * @return 1 on success, 0 at the end of the file (nothing read), -1 if
+ *     the file is truncated or cannot be read.
+ */
+static int
+read_exact(FILE *file, void *buf, size_t size)
+{
+    size_t n = fread(buf, 1, size, file);
+    if (n == size) {
+        return 1;
+    }
+    if (n == 0 && !ferror(file)) {
+        return 0;
+    }
+    errno = ferror(file) ? errno : EPROTO;
+    return -1;
+}
+
+struct hgap_pcap *
+hgap_pcap_open(const char *path)
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return NULL;
+    }
+
+    struct hgap_pcap *pcap = xmalloc(sizeof *pcap);
+    memset(pcap, 0, sizeof *pcap);
+    pcap->file = file;
+    pcap->buf = xmalloc(HGAP_PCAP_MAX_BLOCK);
+
+    uint8_t hdr[PCAP_HEADER_LEN];
+    if (read_exact(file, hdr, sizeof (uint32_t)) != 1) {
+        goto bad_format;
+    }
+
+    uint32_t magic;
+    memcpy(&magic, hdr, sizeof magic);
+    if (magic == PCAPNG_SHB) {
+        // Sections are handled along with the blocks
+        pcap->ng = 1;
+        rewind(file);
+    } else if (magic == PCAP_MAGIC_US || magic == PCAP_MAGIC_NS ||
+               magic == bswap_32(PCAP_MAGIC_US) ||
+               magic == bswap_32(PCAP_MAGIC_NS)) {
+        pcap->swapped = magic == bswap_32(PCAP_MAGIC_US) ||
+                        magic == bswap_32(PCAP_MAGIC_NS);
+        if (read_exact(file, hdr + sizeof magic,
+                       sizeof hdr - sizeof magic) != 1) {
+            goto bad_format;
+        }
+        // The upper bits of the link type field hold other information
+        pcap->link = rd32(pcap, hdr + 20) & 0xffff;
+    } else {
+        goto bad_format;
+    }
+
+    return pcap;
+
+bad_format:
+    hgap_pcap_close(pcap);
+    errno = EPROTO;
+    return NULL;
+}
+
+/**
+ * Reads the next frame of a pcap file in pcap->buf.
+ *
+ * @return 1 on success, 0 at the end, -1 on error.
+ */
+static int
+pcap_next_frame(struct hgap_pcap *pcap, size_t *caplen, uint16_t *link)
+{
+    uint8_t rec[PCAP_REC_LEN];
+    int ret = read_exact(pcap->file, rec, sizeof rec);
+    if (ret != 1) {
+        return ret;
+    }
+
+    uint32_t incl_len = rd32(pcap, rec + 8);
+    uint32_t orig_len = rd32(pcap, rec + 12);
+    if (incl_len > HGAP_PCAP_MAX_BLOCK ||
+        read_exact(pcap->file, pcap->buf, incl_len) != 1) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    pcap->truncated += incl_len < orig_len;
+    *caplen = incl_len;
+    *link = pcap->link;
+    return 1;
+}
+
+/**
+ * Reads blocks of a pcapng file until the next frame, and moves it at the
+ * start of pcap->buf.
+ *
+ * @return 1 on success, 0 at the end, -1 on error.
+ */
+static int
+pcapng_next_frame(struct hgap_pcap *pcap, size_t *caplen, uint16_t *link)
+{
+    for (;;) {
+        uint8_t hdr[2 * sizeof (uint32_t)];
+        int ret = read_exact(pcap->file, hdr, sizeof hdr);
+        if (ret != 1) {
+            return ret;
+        }
+
+        uint32_t type;
+        memcpy(&type, hdr, sizeof type);
+        uint8_t *body = pcap->buf;
+        if (type == PCAPNG_SHB) {
+            // New section, maybe in another byte order: its first field
+            // tells which
+            uint32_t order;
+            if (read_exact(pcap->file, &order, sizeof order) != 1) {
+                errno = EPROTO;
+                return -1;
+            }
+            if (order != PCAPNG_BYTE_ORDER &&
+                order != bswap_32(PCAPNG_BYTE_ORDER)) {
+                errno = EPROTO;
+                return -1;
+            }
+            pcap->swapped = order != PCAPNG_BYTE_ORDER;
+            pcap->n_links = 0;
+            uint32_t len = rd32(pcap, hdr + 4);
+            if (len < 16 || len > HGAP_PCAP_MAX_BLOCK ||
+                read_exact(pcap->file, body, len - 12) != 1) {
+                errno = EPROTO;
+                return -1;
+            }
+            continue;
+        }
+
+        type = rd32(pcap, hdr);
+        uint32_t len = rd32(pcap, hdr + 4);
+        if (len < 12 || len % 4 != 0 || len > HGAP_PCAP_MAX_BLOCK ||
+            read_exact(pcap->file, body, len - sizeof hdr) != 1) {
+            errno = EPROTO;
+            return -1;
+        }
+        // Without the trailing length
+        size_t body_len = len - 12;
+
+        uint32_t orig_len;
+        uint8_t *data;
+        if (type == PCAPNG_IDB) {
+            if (body_len < 8 || pcap->n_links == HGAP_PCAP_MAX_IFACES) {
+                errno = EPROTO;
+                return -1;
+            }
+            pcap->links[pcap->n_links++] = rd16(pcap, body);
+            continue;
+        } else if (type == PCAPNG_EPB) {
+            uint32_t iface = rd32(pcap, body);
+            if (body_len < 20 || iface >= pcap->n_links) {
+                errno = EPROTO;
+                return -1;
+            }
+            *caplen = rd32(pcap, body + 12);
+            orig_len = rd32(pcap, body + 16);
+            *link = pcap->links[iface];
+            data = body + 20;
+            if (*caplen > body_len - 20) {
+                errno = EPROTO;
+                return -1;
+            }
+        } else if (type == PCAPNG_SPB) {
+            if (body_len < 4 || pcap->n_links == 0) {
+                errno = EPROTO;
+                return -1;
+            }
+            orig_len = rd32(pcap, body);
+            *caplen = MIN(orig_len, body_len - 4);
+            *link = pcap->links[0];
+            data = body + 4;
+        } else {
+            continue;
+        }
+
+        pcap->truncated += *caplen < orig_len;
+        memmove(pcap->buf, data, *caplen);
+        return 1;
+    }
+}
+
+/**
+ * Finds the payload of the UDP datagram to port (any if 0) in the frame f
+ * of caplen bytes.
+ *
+ * @return 1 if there is one, 0 otherwise.
+ */
+static int
+frame_udp(const uint8_t *f, size_t caplen, uint16_t link, uint16_t port,
+          const void **payload, size_t *len)
+{
+    size_t off;
+    uint16_t ethertype = 0;
+
+    switch (link) {
+    case LINK_NULL:
+        off = 4;
+        break;
+    case LINK_ETHERNET:
+        off = 14;
+        if (caplen < off) {
+            return 0;
+        }
+        ethertype = be16(f + 12);
+        while (ethertype == ETHERTYPE_VLAN || ethertype == ETHERTYPE_QINQ) {
+            if (caplen < off + 4) {
+                return 0;
+            }
+            ethertype = be16(f + off + 2);
+            off += 4;
+        }
+        if (ethertype != ETHERTYPE_IPV4 && ethertype != ETHERTYPE_IPV6) {
+            return 0;
+        }
+        break;
+    case LINK_LINUX_SLL:
+        off = 16;
+        break;
+    case LINK_LINUX_SLL2:
+        off = 20;
+        break;
+    case LINK_RAW:
+    case LINK_IPV4:
+    case LINK_IPV6:
+        off = 0;
+        break;
+    default:
+        return 0;
+    }
+
+    if (caplen <= off) {
+        return 0;
+    }
+    const uint8_t *ip = f + off;
+    size_t rem = caplen - off;
+    const uint8_t *udp;
+    size_t ip_payload_len;
+
+    if (ip[0] >> 4 == 4) {
+        size_t ihl = (ip[0] & 0xf) * 4;
+        // Not UDP, or a fragment (more fragments or offset set)
+        if (rem < 20 || ihl < 20 || rem < ihl || ip[9] != IPPROTO_UDP_ ||
+            (be16(ip + 6) & 0x3fff) != 0) {
+            return 0;
+        }
+        udp = ip + ihl;
+        rem -= ihl;
+        ip_payload_len = be16(ip + 2) > ihl ? be16(ip + 2) - ihl : 0;
+    } else if (ip[0] >> 4 == 6) {
+        if (rem < 40 || ip[6] != IPPROTO_UDP_) {
+            return 0;
+        }
+        udp = ip + 40;
+        rem -= 40;
+        ip_payload_len = be16(ip + 4);
+    } else {
+        return 0;
+    }
+
+    if (rem < UDP_HEADER_LEN || (port != 0 && be16(udp + 2) != port)) {
+        return 0;
+    }
+    uint16_t udp_len = be16(udp + 4);
+    if (udp_len < UDP_HEADER_LEN || udp_len > ip_payload_len) {
+        return 0;
+    }
+
+    *payload = udp + UDP_HEADER_LEN;
+    *len = MIN((size_t) udp_len, rem) - UDP_HEADER_LEN;
+    return 1;
+}
+
+int
+hgap_pcap_next_udp(struct hgap_pcap *pcap, uint16_t port,
+                   const void **payload, size_t *len)
+{
+    for (;;) {
+        size_t caplen;
+        uint16_t link;
+        int ret = pcap->ng ? pcapng_next_frame(pcap, &caplen, &link) :
+                             pcap_next_frame(pcap, &caplen, &link);
+        if (ret != 1) {
+            return ret;
+        }
+
+        if (frame_udp(pcap->buf, caplen, link, port, payload, len)) {
+            return 1;
+        }
+    }
+}
+
+uint64_t
+hgap_pcap_truncated(const struct hgap_pcap *pcap)
+{
+    return pcap->truncated;
+}
+
+void
+hgap_pcap_close(struct hgap_pcap *pcap)
+{
+    fclose(pcap->file);
+    free(pcap->buf);
+    free(pcap);
+}
+
+struct hgap_pcap_writer *
+hgap_pcap_writer_new(const char *path)
+{
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        return NULL;
+    }
+
+    struct {
+        uint32_t magic;
+        uint16_t major;
+        uint16_t minor;
+        int32_t thiszone;
+        uint32_t sigfigs;
+        uint32_t snaplen;
+        uint32_t link;
+    } hdr = {
+        .magic = PCAP_MAGIC_NS,
+        .major = 2,
+        .minor = 4,
+        .snaplen = 65535,
+        .link = LINK_RAW,
+    };
+    if (fwrite(&hdr, sizeof hdr, 1, file) != 1) {
+        int err = errno;
+        fclose(file);
+        errno = err;
+        return NULL;
+    }
+
+    struct hgap_pcap_writer *writer = xmalloc(sizeof *writer);
+    writer->file = file;
+    return writer;
+}
+
+// Internet checksum of the IPv4 header
+static uint16_t
+ipv4_checksum(const uint8_t *hdr, size_t len)
+{
+    uint32_t sum = 0;
+    for (size_t i = 0; i < len; i += 2) {
+        sum += be16(hdr + i);
+    }
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return (uint16_t) ~sum;
+}
+
+void
+hgap_pcap_write_udp(struct hgap_pcap_writer *writer, uint64_t ns,
+                    uint16_t port, const void *payload, size_t len)
+{
+    uint16_t udp_len = (uint16_t) (UDP_HEADER_LEN + len);
+    uint16_t ip_len = (uint16_t) (20 + udp_len);
+    uint8_t hdr[20 + UDP_HEADER_LEN] = {
+        // IPv4, no options, DF, TTL 64, UDP, 127.0.0.1 -> 127.0.0.1
+        0x45, 0, ip_len >> 8, ip_len & 0xff, 0, 0, 0x40, 0, 64, IPPROTO_UDP_,
+        0, 0, 127, 0, 0, 1, 127, 0, 0, 1,
+        // UDP, no checksum
+        port >> 8, port & 0xff, port >> 8, port & 0xff,
+        udp_len >> 8, udp_len & 0xff, 0, 0,
+    };
+    uint16_t csum = ipv4_checksum(hdr, 20);
+    hdr[10] = csum >> 8;
+    hdr[11] = csum & 0xff;
+
+    uint32_t rec[4] = {
+        (uint32_t) (ns / 1000000000),
+        (uint32_t) (ns % 1000000000),
+        ip_len,
+        ip_len,
+    };
+    fwrite(rec, sizeof rec, 1, writer->file);
+    fwrite(hdr, sizeof hdr, 1, writer->file);
+    fwrite(payload, 1, len, writer->file);
+}
+
+int
+hgap_pcap_writer_free(struct hgap_pcap_writer *writer)
+{
+    int ret = ferror(writer->file) ? -1 : 0;
+    int err = errno;
+    if (fclose(writer->file) != 0) {
+        ret = -1;
+        err = errno;
+    }
+    free(writer);
+
+    errno = err;
+    return ret;
+}
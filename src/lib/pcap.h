@@ -0,0 +1,91 @@
+/*
+ * This file is part of hairgap.
+ * Copyright (C) 2017  Florent MONJALET <florent.monjalet@cea.fr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HGAP_PCAP_H
+#define HGAP_PCAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Minimal reader of network captures, to feed the hairgap packets of a
+ * capture to the decoder offline (see hgap-pcap), without libpcap.
+ *
+ * Reads the pcap (microsecond and nanosecond, both byte orders) and pcapng
+ * formats, with Ethernet (VLAN tags included), Linux cooked (v1 and v2),
+ * BSD loopback and raw IP link types, and extracts the payloads of the UDP
+ * datagrams over IPv4 or IPv6 (without extension headers). IP fragments are
+ * skipped: hairgap datagrams fit in a frame.
+ *
+ * The writer produces pcap captures of raw IPv4 datagrams, e.g. synthetic
+ * transfers (see hgap-replay).
+ */
+
+struct hgap_pcap;
+
+/**
+ * Opens the capture file path.
+ *
+ * @return the reader, or NULL on failure (errno is set, EPROTO if it is
+ *     not a capture in a known format).
+ */
+struct hgap_pcap *hgap_pcap_open(const char *path);
+
+/**
+ * Reads the next UDP datagram sent to port (any port if 0).
+ *
+ * @param payload pointed to its payload, valid until the next call.
+ * @param len filled with the length of the payload, which is shorter than
+ *     the datagram if the capture truncated it.
+ * @return 1 if a datagram was read, 0 at the end of the capture, -1 if the
+ *     capture is corrupted or cannot be read.
+ */
+int hgap_pcap_next_udp(struct hgap_pcap *pcap, uint16_t port,
+                       const void **payload, size_t *len);
+
+/**
+ * Number of captured frames that were truncated, so far.
+ */
+uint64_t hgap_pcap_truncated(const struct hgap_pcap *pcap);
+
+void hgap_pcap_close(struct hgap_pcap *pcap);
+
+struct hgap_pcap_writer;
+
+/**
+ * Creates (or truncates) the pcap capture file path.
+ *
+ * @return the writer, or NULL on failure (errno is set).
+ */
+struct hgap_pcap_writer *hgap_pcap_writer_new(const char *path);
+
+/**
+ * Appends a UDP datagram from 127.0.0.1 to 127.0.0.1:port carrying the len
+ * bytes of payload, captured at ns.
+ */
+void hgap_pcap_write_udp(struct hgap_pcap_writer *writer, uint64_t ns,
+                         uint16_t port, const void *payload, size_t len);
+
+/**
+ * Flushes and closes the capture.
+ *
+ * @return 0, or -1 if some datagrams could not be written (errno is set).
+ */
+int hgap_pcap_writer_free(struct hgap_pcap_writer *writer);
+
+#endif // HGAP_PCAP_H
@@ -0,0 +1,235 @@
+/*
+ * This file is part of hairgap.
+ * Copyright (C) 2017  Florent MONJALET <florent.monjalet@cea.fr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "pktstore.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "common.h"
+
+// Packets are written in big batches
+#define HGAP_STORE_BUF_SIZE (4 * 1024 * 1024)
+
+struct hgap_store_writer {
+    FILE *file;
+    struct hgap_store_header hdr;
+    struct hgap_store_chunk *chunks;
+    size_t chunks_cap;
+    // Being written
+    struct hgap_store_chunk cur;
+    // Padding of the short packets up to the slot size
+    char *zeros;
+};
+
+struct hgap_store_writer *
+hgap_store_writer_new(const char *path, size_t pkt_size, uint32_t n_pkt,
+                      double redund, int timestamps)
+{
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        return NULL;
+    }
+    setvbuf(file, NULL, _IOFBF, HGAP_STORE_BUF_SIZE);
+
+    // The header goes there at the end
+    if (fseeko(file, HGAP_STORE_PKTS_OFF, SEEK_SET) == -1) {
+        int err = errno;
+        fclose(file);
+        errno = err;
+        return NULL;
+    }
+
+    struct hgap_store_writer *writer = xmalloc(sizeof *writer);
+    memset(writer, 0, sizeof *writer);
+    writer->file = file;
+    writer->hdr.magic = HGAP_STORE_MAGIC;
+    writer->hdr.version = HGAP_STORE_VERSION;
+    writer->hdr.pkt_size = pkt_size;
+    writer->hdr.n_pkt = n_pkt;
+    writer->hdr.redund = redund;
+    writer->hdr.timestamps = timestamps;
+    writer->zeros = xmalloc(pkt_size);
+    memset(writer->zeros, 0, pkt_size);
+
+    return writer;
+}
+
+int
+hgap_store_write_pkt(struct hgap_store_writer *writer, const void *pkt,
+                     size_t len)
+{
+    struct hgap_store_chunk *cur = &writer->cur;
+
+    if (len > writer->hdr.pkt_size ||
+        (cur->n_pkts > 0 && len != cur->pkt_len)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (fwrite(pkt, 1, len, writer->file) != len ||
+        fwrite(writer->zeros, 1, writer->hdr.pkt_size - len,
+               writer->file) != writer->hdr.pkt_size - len) {
+        return -1;
+    }
+
+    cur->pkt_len = len;
+    cur->n_pkts++;
+    writer->hdr.n_pkts++;
+    return 0;
+}
+
+void
+hgap_store_end_chunk(struct hgap_store_writer *writer, size_t size)
+{
+    if (writer->hdr.n_chunks == writer->chunks_cap) {
+        size_t cap = MAX(2 * writer->chunks_cap, 64);
+        struct hgap_store_chunk *chunks = xmalloc(cap * sizeof *chunks);
+        if (writer->chunks != NULL) {
+            memcpy(chunks, writer->chunks,
+                   writer->hdr.n_chunks * sizeof *chunks);
+        }
+        free(writer->chunks);
+        writer->chunks = chunks;
+        writer->chunks_cap = cap;
+    }
+
+    writer->chunks[writer->hdr.n_chunks++] = writer->cur;
+    writer->hdr.data_size += size;
+    writer->cur.first = writer->hdr.n_pkts;
+    writer->cur.n_pkts = 0;
+    writer->cur.pkt_len = 0;
+}
+
+int
+hgap_store_writer_free(struct hgap_store_writer *writer, int complete)
+{
+    FILE *file = writer->file;
+    struct hgap_store_header *hdr = &writer->hdr;
+    int ret = ferror(file) ? -1 : 0;
+    int err = errno;
+
+    if (ret == 0 && complete) {
+        // Aligned for the readers that map it
+        hdr->index_off = HGAP_STORE_PKTS_OFF + hdr->n_pkts * hdr->pkt_size;
+        hdr->index_off = (hdr->index_off + 7) & ~(uint64_t) 7;
+        if (fseeko(file, hdr->index_off, SEEK_SET) == -1 ||
+            fwrite(writer->chunks, sizeof *writer->chunks, hdr->n_chunks,
+                   file) != hdr->n_chunks ||
+            fflush(file) != 0 ||
+            fseeko(file, 0, SEEK_SET) == -1 ||
+            fwrite(hdr, sizeof *hdr, 1, file) != 1) {
+            ret = -1;
+            err = errno;
+        }
+    }
+    if (fclose(file) != 0 && ret == 0) {
+        ret = -1;
+        err = errno;
+    }
+
+    free(writer->zeros);
+    free(writer->chunks);
+    free(writer);
+
+    errno = err;
+    return ret;
+}
+
+// Checks that the mapped store is complete and consistent, its index being
+// within the mapping
+static int
+hgap_store_check(const struct hgap_store *store)
+{
+    const struct hgap_store_header *hdr = store->hdr;
+
+    if (hdr->magic != HGAP_STORE_MAGIC || hdr->version != HGAP_STORE_VERSION ||
+        hdr->pkt_size == 0 || hdr->pkt_size > HGAP_MAX_PKT_SIZE ||
+        hdr->index_off % 8 != 0 ||
+        hdr->n_pkts > (hdr->index_off - HGAP_STORE_PKTS_OFF) / hdr->pkt_size ||
+        hdr->n_chunks > (store->map_size - hdr->index_off) /
+                        sizeof (struct hgap_store_chunk)) {
+        return -1;
+    }
+
+    for (uint64_t i = 0; i < hdr->n_chunks; i++) {
+        const struct hgap_store_chunk *chunk = &store->chunks[i];
+        if (chunk->first > hdr->n_pkts ||
+            chunk->n_pkts > hdr->n_pkts - chunk->first ||
+            chunk->pkt_len > hdr->pkt_size) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+struct hgap_store *
+hgap_store_open(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return NULL;
+    }
+
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size >= HGAP_STORE_PKTS_OFF) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    } else {
+        errno = EPROTO;
+    }
+    close(fd);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+
+    struct hgap_store *store = xmalloc(sizeof *store);
+    store->hdr = map;
+    store->pkts = (const char *) map + HGAP_STORE_PKTS_OFF;
+    store->map_size = st.st_size;
+    store->chunks = NULL;
+    if (store->hdr->index_off >= HGAP_STORE_PKTS_OFF &&
+        store->hdr->index_off <= store->map_size) {
+        store->chunks = (const void *) ((const char *) map +
+                                        store->hdr->index_off);
+    }
+    if (store->chunks == NULL || hgap_store_check(store) == -1) {
+        hgap_store_close(store);
+        errno = EPROTO;
+        return NULL;
+    }
+
+    // Sent front to back, once
+    madvise(map, store->map_size, MADV_SEQUENTIAL);
+
+    return store;
+}
+
+void
+hgap_store_close(struct hgap_store *store)
+{
+    munmap((void *) store->hdr, store->map_size);
+    free(store);
+}
@@ -0,0 +1,133 @@
+/*
+ * This file is part of hairgap.
+ * Copyright (C) 2017  Florent MONJALET <florent.monjalet@cea.fr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HGAP_PKTSTORE_H
+#define HGAP_PKTSTORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Packet store: the finished packets of an encoded input, in a file that
+ * can be sent any number of times without encoding it again (see
+ * config->store_path). hgap_store writes it, hgap_send maps it and sends
+ * its packets as they are.
+ *
+ * The file is made of a header, the packets from HGAP_STORE_PKTS_OFF in
+ * fixed-size slots of pkt_size bytes, in the order they are to be sent,
+ * then an index giving the packets of each chunk. It is in host byte order.
+ * The header is written last, so that an interrupted store is not valid.
+ */
+
+#define HGAP_STORE_MAGIC 0x73706768 // "hgps" on little endian hosts
+#define HGAP_STORE_VERSION 1
+// Page aligned, so that the slots can be mapped
+#define HGAP_STORE_PKTS_OFF 4096
+
+struct hgap_store_header {
+    uint32_t magic;
+    uint32_t version;
+    // Size of the slots, i.e. of the largest packets
+    uint32_t pkt_size;
+    // Encoding parameters of the input
+    uint32_t n_pkt;
+    double redund;
+    // The packets leave room for a send timestamp (see config->timestamps)
+    uint32_t timestamps;
+    uint32_t reserved;
+    uint64_t n_chunks;
+    uint64_t n_pkts;
+    // Size of the input
+    uint64_t data_size;
+    // Offset of the index, n_chunks struct hgap_store_chunk
+    uint64_t index_off;
+};
+
+struct hgap_store_chunk {
+    // Slot of its first packet
+    uint64_t first;
+    uint32_t n_pkts;
+    // Size of its packets, the same for all the packets of a chunk
+    uint32_t pkt_len;
+};
+
+struct hgap_store_writer;
+
+/**
+ * Creates (or truncates) the store file path, for packets of at most
+ * pkt_size bytes.
+ *
+ * @return the writer, or NULL on failure (errno is set).
+ */
+struct hgap_store_writer *hgap_store_writer_new(const char *path,
+                                                size_t pkt_size,
+                                                uint32_t n_pkt, double redund,
+                                                int timestamps);
+
+/**
+ * Appends a packet of len bytes to the current chunk. All the packets of a
+ * chunk must have the same size.
+ *
+ * @return 0, or -1 on failure (errno is set).
+ */
+int hgap_store_write_pkt(struct hgap_store_writer *writer, const void *pkt,
+                         size_t len);
+
+/**
+ * Ends the current chunk, holding size bytes of the input.
+ */
+void hgap_store_end_chunk(struct hgap_store_writer *writer, size_t size);
+
+/**
+ * Closes the store. If complete, writes its index and header, otherwise the
+ * file is left invalid.
+ *
+ * @return 0, or -1 if the store could not be written (errno is set).
+ */
+int hgap_store_writer_free(struct hgap_store_writer *writer, int complete);
+
+/**
+ * A store mapped read-only.
+ */
+struct hgap_store {
+    const struct hgap_store_header *hdr;
+    const struct hgap_store_chunk *chunks;
+    const char *pkts;
+    size_t map_size;
+};
+
+/**
+ * Maps the store file path and checks it.
+ *
+ * @return the store, or NULL on failure (errno is set, EPROTO if it is not
+ *     a complete store of this version).
+ */
+struct hgap_store *hgap_store_open(const char *path);
+
+void hgap_store_close(struct hgap_store *store);
+
+/**
+ * Returns the packet in slot i.
+ */
+static inline const void *
+hgap_store_pkt(const struct hgap_store *store, uint64_t i)
+{
+    return store->pkts + i * store->hdr->pkt_size;
+}
+
+#endif // HGAP_PKTSTORE_H
@@ -0,0 +1,203 @@
+/*
+ * This file is part of hairgap.
+ * Copyright (C) 2017  Florent MONJALET <florent.monjalet@cea.fr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE // cpu_set_t, pthread_setaffinity_np
+
+#include "placement.h"
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+
+static const char *hgap_stage_names[HGAP_N_STAGES] = {
+    [HGAP_STAGE_READ] = "read",
+    [HGAP_STAGE_ENCODE] = "encode",
+    [HGAP_STAGE_SEND] = "send",
+    [HGAP_STAGE_NET] = "net",
+    [HGAP_STAGE_DECODE] = "decode",
+    [HGAP_STAGE_WRITE] = "write",
+};
+
+int
+hgap_config_place_stage(struct hgap_config *config, const char *spec)
+{
+    const char *eq = strchr(spec, '=');
+    if (eq == NULL) {
+        return HGAP_ERR_BAD_PLACEMENT;
+    }
+
+    for (int i = 0; i < HGAP_N_STAGES; i++) {
+        size_t len = strlen(hgap_stage_names[i]);
+        if ((size_t) (eq - spec) == len &&
+            strncmp(spec, hgap_stage_names[i], len) == 0) {
+            config->stage_cpus[i] = eq + 1;
+            return HGAP_SUCCESS;
+        }
+    }
+
+    return HGAP_ERR_BAD_PLACEMENT;
+}
+
+const char *
+hgap_stage_name(enum hgap_stage stage)
+{
+    return stage < HGAP_N_STAGES ? hgap_stage_names[stage] : "unknown";
+}
+
+static int
+hgap_is_net_stage(enum hgap_stage stage)
+{
+    return stage == HGAP_STAGE_SEND || stage == HGAP_STAGE_NET;
+}
+
+static int
+hgap_parse_cpu(const char **s, long *cpu)
+{
+    char *end;
+
+    if (!isdigit((unsigned char) **s)) {
+        return -1;
+    }
+    errno = 0;
+    *cpu = strtol(*s, &end, 10);
+    if (errno != 0 || *cpu >= CPU_SETSIZE) {
+        return -1;
+    }
+    *s = end;
+
+    return 0;
+}
+
+int
+hgap_parse_cpu_list(const char *list, cpu_set_t *set)
+{
+    const char *s = list;
+
+    CPU_ZERO(set);
+    for (;;) {
+        long first, last;
+        if (hgap_parse_cpu(&s, &first) == -1) {
+            return -1;
+        }
+        last = first;
+        if (*s == '-') {
+            s++;
+            if (hgap_parse_cpu(&s, &last) == -1 || last < first) {
+                return -1;
+            }
+        }
+
+        for (long cpu = first; cpu <= last; cpu++) {
+            CPU_SET(cpu, set);
+        }
+
+        if (*s == '\0') {
+            break;
+        } else if (*s != ',') {
+            return -1;
+        }
+        s++;
+    }
+
+    return CPU_COUNT(set) > 0 ? 0 : -1;
+}
+
+int
+hgap_stage_node(const struct hgap_config *config, enum hgap_stage stage)
+{
+    cpu_set_t set;
+    const char *list = config->stage_cpus[stage];
+
+    if (list == NULL || hgap_parse_cpu_list(list, &set) == -1) {
+        return -1;
+    }
+
+    int cpu = 0;
+    while (!CPU_ISSET(cpu, &set)) {
+        cpu++;
+    }
+
+    // The cpu directory holds a nodeN link to its node
+    char path[64];
+    snprintf(path, sizeof path, "/sys/devices/system/cpu/cpu%d", cpu);
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        return -1;
+    }
+
+    int node = -1;
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        if (strncmp(ent->d_name, "node", 4) == 0 &&
+            isdigit((unsigned char) ent->d_name[4])) {
+            node = atoi(ent->d_name + 4);
+            break;
+        }
+    }
+    closedir(dir);
+
+    return node;
+}
+
+void
+hgap_stage_enter(const struct hgap_config *config, enum hgap_stage stage)
+{
+    cpu_set_t set;
+    const char *list = config->stage_cpus[stage];
+    int ret;
+
+    if (list != NULL && hgap_parse_cpu_list(list, &set) == 0) {
+        ret = pthread_setaffinity_np(pthread_self(), sizeof set, &set);
+        if (ret != 0) {
+            WARN("Could not pin the %s thread to CPUs %s: %s\n",
+                 hgap_stage_name(stage), list, strerror(ret));
+        }
+    }
+
+    if (config->rt_prio > 0 && hgap_is_net_stage(stage)) {
+        struct sched_param param = { .sched_priority = config->rt_prio };
+        ret = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if (ret != 0) {
+            WARN("Could not run the %s thread with SCHED_FIFO: %s\n",
+                 hgap_stage_name(stage), strerror(ret));
+        }
+    }
+}
+
+void
+hgap_placement_save(struct hgap_thread_placement *placement)
+{
+    pthread_getaffinity_np(pthread_self(), sizeof placement->cpus,
+                           &placement->cpus);
+    pthread_getschedparam(pthread_self(), &placement->policy,
+                          &placement->param);
+}
+
+void
+hgap_placement_restore(const struct hgap_thread_placement *placement)
+{
+    pthread_setaffinity_np(pthread_self(), sizeof placement->cpus,
+                           &placement->cpus);
+    pthread_setschedparam(pthread_self(), placement->policy,
+                          &placement->param);
+}
@@ -0,0 +1,66 @@
+/*
+ * This file is part of hairgap.
+ * Copyright (C) 2017  Florent MONJALET <florent.monjalet@cea.fr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HGAP_PLACEMENT_H
+#define HGAP_PLACEMENT_H
+
+// cpu_set_t needs _GNU_SOURCE to be defined by the includer
+#include <sched.h>
+
+#include "hairgap.h"
+
+/**
+ * Placement of the pipeline threads (see stage_cpus and rt_prio in
+ * hairgap.h).
+ */
+
+/**
+ * Parses a CPU list in the cpuset format ("0-3,8").
+ *
+ * @return 0 on success, -1 if list is invalid or empty.
+ */
+int hgap_parse_cpu_list(const char *list, cpu_set_t *set);
+
+/**
+ * Returns the NUMA node of the first CPU stage is pinned to, -1 if the stage
+ * is not pinned or if the node is unknown.
+ */
+int hgap_stage_node(const struct hgap_config *config, enum hgap_stage stage);
+
+/**
+ * Places the calling thread as configured for stage: pins it to the CPUs of
+ * the stage and makes it SCHED_FIFO if it is a network stage and rt_prio is
+ * set. Failures are only warned about. A stage without CPUs keeps the
+ * affinity of the thread that created it.
+ */
+void hgap_stage_enter(const struct hgap_config *config, enum hgap_stage stage);
+
+/**
+ * Placement of a thread, to restore the calling thread of hgap_send and
+ * hgap_receive, which runs a stage itself.
+ */
+struct hgap_thread_placement {
+    cpu_set_t cpus;
+    int policy;
+    struct sched_param param;
+};
+
+void hgap_placement_save(struct hgap_thread_placement *placement);
+void hgap_placement_restore(const struct hgap_thread_placement *placement);
+
+#endif // HGAP_PLACEMENT_H
@@ -0,0 +1,65 @@
+/*
+ * This file is part of hairgap.
+ * Copyright (C) 2017  Florent MONJALET <florent.monjalet@cea.fr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HGAP_PROBES_H
+#define HGAP_PROBES_H
+
+/**
+ * USDT (systemtap/DTrace style) static tracepoints, in provider "hairgap", to
+ * trace a running transfer with bpftrace or perf without rebuilding, e.g.:
+ *
+ *     bpftrace -e 'usdt:./hairgapr:hairgap:chunk__written { @[pid] = count(); }'
+ *
+ * A probe is a single nop in the code and a note in the ELF, until a tracer
+ * attaches to it. Only built with HGAP_USDT defined, which the makefile does
+ * when sys/sdt.h (systemtap-sdt-dev) is available, USDT=0 to leave them out.
+ *
+ * Probes (arguments):
+ *   sender:
+ *     chunk__read          (chunk num, size)
+ *     chunk__encoded       (chunk num, size)
+ *     chunk__first__pkt    (chunk num)
+ *     chunk__last__pkt     (chunk num, packets emitted)
+ *     limiter__sleep       (deadline, CLOCK_MONOTONIC ns)
+ *   receiver:
+ *     pkt__received        (chunk num, packet id, size)
+ *     chunk__decodable     (chunk num, packets received)
+ *     chunk__reconstructed (chunk num, size)
+ *     chunk__written       (chunk num, size)
+ *   both:
+ *     channel__full        (channel address)
+ *     channel__empty       (channel address)
+ */
+
+#ifdef HGAP_USDT
+
+#include <sys/sdt.h>
+
+#define HGAP_PROBE1(name, a) DTRACE_PROBE1(hairgap, name, a)
+#define HGAP_PROBE2(name, a, b) DTRACE_PROBE2(hairgap, name, a, b)
+#define HGAP_PROBE3(name, a, b, c) DTRACE_PROBE3(hairgap, name, a, b, c)
+
+#else
+
+#define HGAP_PROBE1(name, a)
+#define HGAP_PROBE2(name, a, b)
+#define HGAP_PROBE3(name, a, b, c)
+
+#endif // HGAP_USDT
+
+#endif // HGAP_PROBES_H
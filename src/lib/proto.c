@@ -24,6 +24,7 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 
 #include <wirehair.h>
 
@@ -90,6 +91,34 @@ hgap_write_header(const struct hgap_header *hdr, void *buf)
     net_hdr->data_size = htobe32(hdr->data_size);
 }
 
+void
+hgap_pkt_stamp(void *pkt, size_t *size)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    uint64_t ns = htobe64(ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+    memcpy((char *) pkt + *size, &ns, sizeof ns);
+    *size += HGAP_TSTAMP_LEN;
+}
+
+int
+hgap_pkt_tstamp(const void *pkt, size_t size, uint64_t *ns)
+{
+    const struct hgap_header *net_hdr = pkt;
+
+    if (hgap_pkt_type((void *) pkt, size) != HGAP_PKT_DATA ||
+        size != HGAP_HEADER_LEN + be32toh(net_hdr->data_size) +
+                HGAP_TSTAMP_LEN) {
+        return 0;
+    }
+
+    uint64_t net_ns;
+    memcpy(&net_ns, (const char *) pkt + size - HGAP_TSTAMP_LEN, sizeof net_ns);
+    *ns = be64toh(net_ns);
+    return 1;
+}
+
 void
 hgap_header_begin(struct hgap_header *hdr)
 {
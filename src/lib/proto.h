@@ -38,6 +38,8 @@
 #define HGAP_SALVE_LEN 32
 #define HGAP_LITTLE_CHUNK_RETRIES 128
 #define HGAP_MIN_BUF (HGAP_HEADER_LEN + HGAP_CONTROL_LEN)
+// Send timestamp trailing the payload of data packets (see hgap_pkt_stamp)
+#define HGAP_TSTAMP_LEN sizeof(uint64_t)
 
 // A bit more than standard UDP MTU (FIXME should be adjusted)
 #define HGAP_MAX_PKT_SIZE 1500
@@ -98,6 +100,22 @@ enum hgap_pkt_t hgap_pkt_type(void *pkt, size_t len);
  */
 void hgap_write_header(const struct hgap_header *hdr, void *buf);
 
+/**
+ * Appends the send time (CLOCK_REALTIME, in ns) after the *size bytes of the
+ * data packet pkt, which must have room for HGAP_TSTAMP_LEN more bytes, and
+ * updates *size. Receivers that do not look for it ignore it: it lies past
+ * the payload announced by the header.
+ */
+void hgap_pkt_stamp(void *pkt, size_t *size);
+
+/**
+ * Reads the send time appended by hgap_pkt_stamp to the data packet pkt of
+ * size bytes.
+ *
+ * @return 1 if pkt carries one (then stored in *ns), 0 otherwise.
+ */
+int hgap_pkt_tstamp(const void *pkt, size_t size, uint64_t *ns);
+
 /**
  * Special header types
  */
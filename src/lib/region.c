@@ -0,0 +1,130 @@
+/*
+ * This file is part of hairgap.
+ * Copyright (C) 2017  Florent MONJALET <florent.monjalet@cea.fr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE // MAP_HUGETLB, MADV_HUGEPAGE
+
+#include "region.h"
+
+#include <limits.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <linux/mempolicy.h>
+
+#include "common.h"
+
+#define HGAP_HUGEPAGE_SIZE (2 * 1024 * 1024)
+
+#define round_up(x, align) (((x) + (align) - 1) / (align) * (align))
+
+static void *
+hgap_region_map(size_t size, int extra_flags)
+{
+    void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | extra_flags, -1, 0);
+    return mem == MAP_FAILED ? NULL : mem;
+}
+
+static void
+hgap_region_bind(void *mem, size_t size, int node)
+{
+    // Large enough for any sane node number
+    unsigned long nodemask[16] = { 0 };
+    size_t bits = sizeof (unsigned long) * CHAR_BIT;
+
+    if ((size_t) node >= sizeof nodemask * CHAR_BIT) {
+        return;
+    }
+    nodemask[node / bits] |= 1UL << (node % bits);
+
+    if (syscall(SYS_mbind, mem, size, MPOL_PREFERRED, nodemask,
+                sizeof nodemask * CHAR_BIT + 1, 0) == -1) {
+        PWARN("mbind");
+    }
+}
+
+static void
+hgap_region_prefault(void *mem, size_t size)
+{
+    if (mlock(mem, size) == 0) {
+        return;
+    }
+
+    // Typically RLIMIT_MEMLOCK, at least get the pages now
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    for (size_t off = 0; off < size; off += page_size) {
+        ((volatile char *) mem)[off] = 0;
+    }
+}
+
+void *
+hgap_region_alloc(struct hgap_region *region, size_t size, unsigned flags,
+                  int node)
+{
+    region->mem = NULL;
+    region->mapped = 0;
+
+    if (flags == 0 && node < 0) {
+        region->mem = xmalloc(size);
+        return region->mem;
+    }
+
+    if (flags & HGAP_ALLOC_HUGEPAGES) {
+        size_t huge_size = round_up(MAX(size, 1), HGAP_HUGEPAGE_SIZE);
+        if ((region->mem = hgap_region_map(huge_size, MAP_HUGETLB)) != NULL) {
+            region->mapped = huge_size;
+        }
+    }
+
+    if (region->mem == NULL) {
+        size_t page_size = sysconf(_SC_PAGESIZE);
+        region->mapped = round_up(MAX(size, 1), page_size);
+        region->mem = hgap_region_map(region->mapped, 0);
+        CHK_PERROR(region->mem != NULL);
+#ifdef MADV_HUGEPAGE
+        if (flags & HGAP_ALLOC_HUGEPAGES) {
+            madvise(region->mem, region->mapped, MADV_HUGEPAGE);
+        }
+#endif
+    }
+
+    // Before any page is touched
+    if (node >= 0) {
+        hgap_region_bind(region->mem, region->mapped, node);
+    }
+
+    if (flags & HGAP_ALLOC_PREFAULT) {
+        hgap_region_prefault(region->mem, region->mapped);
+    }
+
+    return region->mem;
+}
+
+void
+hgap_region_free(struct hgap_region *region)
+{
+    if (region->mapped != 0) {
+        munmap(region->mem, region->mapped);
+    } else {
+        free(region->mem);
+    }
+    region->mem = NULL;
+    region->mapped = 0;
+}
@@ -0,0 +1,53 @@
+/*
+ * This file is part of hairgap.
+ * Copyright (C) 2017  Florent MONJALET <florent.monjalet@cea.fr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HGAP_REGION_H
+#define HGAP_REGION_H
+
+#include <stddef.h>
+
+/**
+ * Memory region backing the pipeline buffers (channel storage, pool buffers),
+ * allocated according to the HGAP_ALLOC_* flags (see hairgap.h):
+ * - no flag: plain malloc,
+ * - HGAP_ALLOC_ALIGNED: page aligned anonymous mapping,
+ * - HGAP_ALLOC_HUGEPAGES: MAP_HUGETLB mapping, falling back to a transparent
+ *   huge pages hint (madvise(2)) when no huge page is reserved,
+ * - HGAP_ALLOC_PREFAULT: the region is locked in memory (mlock(2)), or at
+ *   least touched, so that its first use does not page-fault.
+ *
+ * A region can also be placed on a given NUMA node (mbind(2), preferred
+ * policy), which implies a mapping.
+ */
+struct hgap_region {
+    void *mem;
+    // Mapped size, 0 if allocated with malloc
+    size_t mapped;
+};
+
+/**
+ * Allocates size bytes in region, on NUMA node node if node >= 0. Exits on
+ * failure, like xmalloc.
+ *
+ * @return region->mem
+ */
+void *hgap_region_alloc(struct hgap_region *region, size_t size,
+                        unsigned flags, int node);
+void hgap_region_free(struct hgap_region *region);
+
+#endif // HGAP_REGION_H
@@ -15,120 +15,154 @@
  * You should have received a copy of the GNU General Public License
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
-
 #include "sender.h"
 
-#include <arpa/inet.h>
-#include <netinet/in.h>
-#include <pthread.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/socket.h>
+#include <sys/timerfd.h>
 #include <unistd.h>
 
 #include "common.h"
 #include "limiter.h"
+#include "probes.h"
 #include "proto.h"
+#include "transport.h"
+
+// Retries of a packet that cannot be sent for lack of local buffers
+#define HGAP_SENDER_MAX_RETRIES 16
+// First pause when the device queue is full (ENOBUFS), doubled on each retry
+// up to the max: a packet never stalls the link long enough for the receiver
+// to time out
+#define HGAP_SENDER_BACKOFF_NS (20 * 1000)
+#define HGAP_SENDER_MAX_BACKOFF_NS (1000 * 1000)
+// Longest wait for the socket buffer to drain (EAGAIN)
+#define HGAP_SENDER_POLL_MS 100
 
 struct hgap_sender {
-    struct sockaddr_in dstaddr;
-    int socket;
+    struct hgap_transport *tr;
 
-    uint32_t keepalive;
+    // Keepalive period, 0 if disabled
+    uint64_t keepalive_ns;
+    // When something was last sent, CLOCK_MONOTONIC ns
+    uint64_t last_send;
+    char ka_pkt[HGAP_HEADER_LEN];
 
     struct hgap_limiter *hlim;
-    pthread_t keepalive_thread;
-    int cont;
+    // Pacing pauses
+    int timerfd;
+
+    struct hgap_send_stats stats;
 };
 
-static void *
-keepalive_loop_thread(void *args)
+/**
+ * Sleeps until deadline (CLOCK_MONOTONIC, in ns).
+ */
+static void
+hgap_sender_sleep_until(struct hgap_sender *hs, uint64_t deadline)
 {
-    struct hgap_sender *hs = args;
-    uint32_t keepalive = hs->keepalive;
-    int *cont = &hs->cont;
-    struct hgap_header ka_hdr;
-    char ka_pkt[HGAP_HEADER_LEN];
-    
-    // Generate keepalive packet (header only)
-    hgap_header_keepalive(&ka_hdr);
-    hgap_write_header(&ka_hdr, ka_pkt);
-
-    // Stops when the shared cont variable is set to 0
-    while (*cont) {
-        // Wait the appropriate time
-        if (keepalive >= 1000) {
-            sleep(keepalive / 1000);
-        } else {
-            usleep(keepalive * 1000);
-        }
-
-        // FIXME: CHK_PERROR should disappear
-        // Send the keepalive
-        CHK_PERROR(hgap_sender_send(hs, ka_pkt, HGAP_HEADER_LEN) >= 0);
+    struct itimerspec its;
+    memset(&its, 0, sizeof its);
+    its.it_value.tv_sec = deadline / 1000000000;
+    its.it_value.tv_nsec = deadline % 1000000000;
+    CHK_PERROR(timerfd_settime(hs->timerfd, TFD_TIMER_ABSTIME, &its,
+                               NULL) != -1);
+
+    uint64_t expirations;
+    while (read(hs->timerfd, &expirations, sizeof expirations) == -1 &&
+           errno == EINTR) {
+        continue;
     }
+}
+
+/**
+ * Waits for the local congestion that made a send fail with err to clear
+ * up. A full socket buffer (EAGAIN) is waited for by the transport, but a
+ * full device queue (ENOBUFS) does not make the socket unwritable: only time
+ * helps, with an exponential backoff.
+ */
+static void
+hgap_sender_backpressure(struct hgap_sender *hs, int err, uint64_t *backoff)
+{
+    hs->stats.backpressure_waits++;
 
-    return NULL;
+    if (err == ENOBUFS) {
+        hgap_sender_sleep_until(hs, hgap_now_ns() + *backoff);
+        *backoff = MIN(*backoff * 2, HGAP_SENDER_MAX_BACKOFF_NS);
+    } else {
+        hgap_transport_wait_send(hs->tr, HGAP_SENDER_POLL_MS);
+    }
 }
 
 struct hgap_sender *
 hgap_sender_new(char *host, short port, uint64_t byterate, uint32_t keepalive)
 {
-    struct hgap_sender *hs = xmalloc(sizeof *hs);
-    hs->hlim = hgap_limiter_new(byterate);
+    return hgap_sender_new_transport(hgap_transport_udp_sender(host, port),
+                                     byterate, keepalive);
+}
 
-    // Open socket
-    hs->socket = socket(AF_INET, SOCK_DGRAM, 0);
-    if (hs->socket < 0) {
-        DBG("Socket creation error");
-        goto err_sock;
+struct hgap_sender *
+hgap_sender_new_transport(struct hgap_transport *tr, uint64_t byterate,
+                          uint32_t keepalive)
+{
+    if (tr == NULL) {
+        return NULL;
     }
 
-    // Create destination address
-    memset(&hs->dstaddr, 0, sizeof(hs->dstaddr));
-    hs->dstaddr.sin_family = AF_INET;
-    // TODO getaddrinfo
-    if ((hs->dstaddr.sin_addr.s_addr = inet_addr(host)) == 0) {
-        DBG("Invalid IP in hgap_sender\n");
-        goto err;
+    struct hgap_sender *hs = xmalloc(sizeof *hs);
+    hs->tr = tr;
+
+    hs->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (hs->timerfd == -1) {
+        DBG("Timer creation error\n");
+        hgap_transport_free(tr);
+        free(hs);
+        return NULL;
     }
+    hs->hlim = hgap_limiter_new(byterate);
 
-    hs->dstaddr.sin_port = htons(port);
-    hs->keepalive = keepalive;
-    hs->cont = 0;
-
-    // Start keepalive
-    if (hs->keepalive) {
-        // FIXME: ensure no weird race condition can be cause by sharing this
-        // non-locked flag with the keepalive_thread
-        hs->cont = 1;
-        int ret = pthread_create(&hs->keepalive_thread, NULL,
-                                 keepalive_loop_thread, hs);
-        if (ret != 0) {
-            DBG("Keepalive thread creation error\n");
-            goto err;
-        }
-    }
+    // Keepalive packet (header only)
+    struct hgap_header ka_hdr;
+    hgap_header_keepalive(&ka_hdr);
+    hgap_write_header(&ka_hdr, hs->ka_pkt);
+    hs->keepalive_ns = keepalive * 1000000ULL;
+    hs->last_send = hgap_now_ns();
+    memset(&hs->stats, 0, sizeof hs->stats);
 
     return hs;
-
-    // Error handling
-err:
-    close(hs->socket);
-err_sock:
-    free(hs);
-    return NULL;
 }
 
 ssize_t
-hgap_sender_send(struct hgap_sender *hs, void *pkt, size_t size)
+hgap_sender_send(struct hgap_sender *hs, const void *pkt, size_t size)
 {
-    ssize_t ret = sendto(hs->socket, pkt, size, 0,
-                         (struct sockaddr *)&hs->dstaddr, sizeof(hs->dstaddr));
+    uint64_t backoff = HGAP_SENDER_BACKOFF_NS;
+    unsigned retries = 0;
+    ssize_t ret;
+
+    while ((ret = hgap_transport_send(hs->tr, pkt, size)) == -1) {
+        if (errno == EINTR) {
+            continue;
+        }
+        if ((errno != ENOBUFS && errno != EAGAIN && errno != EWOULDBLOCK) ||
+            retries++ == HGAP_SENDER_MAX_RETRIES) {
+            hs->stats.local_drops++;
+            return -1;
+        }
+        hgap_sender_backpressure(hs, errno, &backoff);
+    }
 
-    if (ret >= 0) {
-        hgap_limiter_limit(hs->hlim, ret);
+    hs->stats.pkts_sent++;
+    hs->stats.bytes_sent += ret;
+    if (hs->keepalive_ns != 0) {
+        hs->last_send = hgap_now_ns();
+    }
+
+    uint64_t pause_until = hgap_limiter_limit(hs->hlim, ret);
+    if (pause_until != 0) {
+        hs->stats.limiter_sleeps++;
+        HGAP_PROBE1(limiter__sleep, pause_until);
+        hgap_sender_sleep_until(hs, pause_until);
     }
 
     return ret;
@@ -151,13 +185,38 @@ hgap_sender_control(struct hgap_sender *hs, void *pkt, size_t size)
     return 0;
 }
 
+uint64_t
+hgap_sender_idle_ns(struct hgap_sender *hs)
+{
+    if (hs->keepalive_ns == 0) {
+        return UINT64_MAX;
+    }
+
+    uint64_t idle = hgap_now_ns() - hs->last_send;
+    return idle < hs->keepalive_ns ? hs->keepalive_ns - idle : 0;
+}
+
+ssize_t
+hgap_sender_keepalive(struct hgap_sender *hs)
+{
+    if (hgap_sender_idle_ns(hs) != 0) {
+        return 0;
+    }
+
+    return hgap_sender_send(hs, hs->ka_pkt, HGAP_HEADER_LEN);
+}
+
+void
+hgap_sender_get_stats(struct hgap_sender *hs, struct hgap_send_stats *stats)
+{
+    *stats = hs->stats;
+}
+
 void
 hgap_sender_free(struct hgap_sender *hs)
 {
-    if (hs->cont) {
-        hs->cont = 0;
-        pthread_join(hs->keepalive_thread, NULL);
-    }
+    close(hs->timerfd);
+    hgap_transport_free(hs->tr);
     hgap_limiter_free(hs->hlim);
     free(hs);
 }
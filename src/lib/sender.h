@@ -24,29 +24,50 @@
 
 #include <sys/types.h>
 
+#include "hairgap.h"
+
 /**
  * The purpose of this structure is to encapsulate rate limiting + keepalive.
  * Apart from the encoder handwave and the encoder teardown, it takes pre-built
  * packets to send.
+ *
+ * Everything happens in the thread using the sender: sends pause on a timer
+ * when they go over the rate, and keepalives are sent by the caller when it
+ * has nothing else to send (see hgap_sender_idle_ns), so that they only go
+ * out on an idle link.
  */
 struct hgap_sender;
+struct hgap_transport;
 
 /**
- * Creates an hgap_sender that will send on socket at maximum rate byterate.
- * Creation starts the keepalive. If keepalive is 0, no keepalive is started.
+ * Creates an hgap_sender that will send on socket at maximum rate byterate,
+ * keeping the link alive with a packet every keepalive ms if it is idle. If
+ * keepalive is 0, no keepalive is sent.
  */
 struct hgap_sender *hgap_sender_new(char *host, short port, uint64_t byterate,
                                     uint32_t keepalive);
 
+/**
+ * Same as hgap_sender_new, sending through tr (see transport.h), which the
+ * sender then owns. Returns NULL if tr is NULL.
+ */
+struct hgap_sender *hgap_sender_new_transport(struct hgap_transport *tr,
+                                              uint64_t byterate,
+                                              uint32_t keepalive);
+
 /**
  * Free any memory associated with this hgap_sender
  */
 void hgap_sender_free(struct hgap_sender *hs);
 
 /**
- * Send a single packet.
+ * Send a single packet. When local buffers are full (EAGAIN, ENOBUFS), waits
+ * for them to drain and retries a few times before dropping the packet.
+ *
+ * @return the return value of sendto(2), -1 if the packet was dropped.
  */
-ssize_t hgap_sender_send(struct hgap_sender *hs, void *pkt, size_t size);
+ssize_t hgap_sender_send(struct hgap_sender *hs, const void *pkt,
+                         size_t size);
 
 /**
  * Send a control salve of a given packet, see encoding.h for control packet
@@ -60,4 +81,24 @@ ssize_t hgap_sender_send(struct hgap_sender *hs, void *pkt, size_t size);
  */
 ssize_t hgap_sender_control(struct hgap_sender *hs, void *pkt, size_t size);
 
+/**
+ * Returns the time in ns until a keepalive is due, 0 if it is due now and
+ * UINT64_MAX if keepalives are disabled. Callers waiting for something to
+ * send should wait at most that long, then call hgap_sender_keepalive.
+ */
+uint64_t hgap_sender_idle_ns(struct hgap_sender *hs);
+
+/**
+ * Sends a keepalive if one is due.
+ *
+ * @return the return value of sendto(2), 0 if no keepalive was due.
+ */
+ssize_t hgap_sender_keepalive(struct hgap_sender *hs);
+
+/**
+ * Fills stats with the counters of the packets sent so far.
+ */
+void hgap_sender_get_stats(struct hgap_sender *hs,
+                           struct hgap_send_stats *stats);
+
 #endif // HGAP_SENDER_H
@@ -0,0 +1,154 @@
+/*
+ * This file is part of hairgap.
+ * Copyright (C) 2017  Florent MONJALET <florent.monjalet@cea.fr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE // sync_file_range
+
+#include "syncer.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "common.h"
+
+struct hgap_syncer {
+    int fd;
+    off_t base;
+    size_t interval;
+
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    // Protected by mutex
+    size_t head;
+    int stop;
+
+    // Only used by the syncer thread: [prev, started) is being written back
+    size_t prev;
+    size_t started;
+};
+
+static void
+hgap_syncer_window(struct hgap_syncer *syncer, size_t end)
+{
+    int fd = syncer->fd;
+    off_t base = syncer->base;
+
+    // Start the writeback of the new window
+    if (sync_file_range(fd, base + syncer->started, end - syncer->started,
+                        SYNC_FILE_RANGE_WRITE) == -1) {
+        PWARN("sync_file_range");
+    }
+
+    // Wait for the previous one and drop it from the cache
+    if (syncer->started > syncer->prev) {
+        size_t len = syncer->started - syncer->prev;
+        if (sync_file_range(fd, base + syncer->prev, len,
+                            SYNC_FILE_RANGE_WAIT_BEFORE |
+                            SYNC_FILE_RANGE_WRITE |
+                            SYNC_FILE_RANGE_WAIT_AFTER) == -1) {
+            PWARN("sync_file_range");
+        }
+        posix_fadvise(fd, base + syncer->prev, len, POSIX_FADV_DONTNEED);
+    }
+
+    syncer->prev = syncer->started;
+    syncer->started = end;
+}
+
+static void *
+hgap_syncer_loop(void *arg)
+{
+    struct hgap_syncer *syncer = arg;
+
+    pthread_mutex_lock(&syncer->mutex);
+    for (;;) {
+        while (!syncer->stop &&
+               syncer->head - syncer->started < syncer->interval) {
+            pthread_cond_wait(&syncer->cond, &syncer->mutex);
+        }
+        if (syncer->stop) {
+            break;
+        }
+
+        size_t head = syncer->head;
+        pthread_mutex_unlock(&syncer->mutex);
+        hgap_syncer_window(syncer, head);
+        pthread_mutex_lock(&syncer->mutex);
+    }
+    pthread_mutex_unlock(&syncer->mutex);
+
+    return NULL;
+}
+
+struct hgap_syncer *
+hgap_syncer_new(int fd, off_t base, size_t interval)
+{
+    struct hgap_syncer *syncer = xmalloc(sizeof *syncer);
+
+    syncer->fd = fd;
+    syncer->base = base;
+    syncer->interval = interval;
+    syncer->head = 0;
+    syncer->stop = 0;
+    syncer->prev = 0;
+    syncer->started = 0;
+    pthread_mutex_init(&syncer->mutex, NULL);
+    pthread_cond_init(&syncer->cond, NULL);
+
+    CHK_PERROR(pthread_create(&syncer->thread, NULL, hgap_syncer_loop,
+                              syncer) == 0);
+
+    return syncer;
+}
+
+void
+hgap_syncer_advance(struct hgap_syncer *syncer, size_t head)
+{
+    pthread_mutex_lock(&syncer->mutex);
+    if (head > syncer->head) {
+        syncer->head = head;
+        if (head - syncer->started >= syncer->interval) {
+            pthread_cond_signal(&syncer->cond);
+        }
+    }
+    pthread_mutex_unlock(&syncer->mutex);
+}
+
+int
+hgap_syncer_finish(struct hgap_syncer *syncer)
+{
+    pthread_mutex_lock(&syncer->mutex);
+    syncer->stop = 1;
+    pthread_cond_signal(&syncer->cond);
+    pthread_mutex_unlock(&syncer->mutex);
+    pthread_join(syncer->thread, NULL);
+
+    int ret = HGAP_SUCCESS;
+    if (fsync(syncer->fd) == -1) {
+        PWARN("Output fsync failed");
+        ret = HGAP_ERR_BAD_OUT_FD;
+    }
+
+    pthread_cond_destroy(&syncer->cond);
+    pthread_mutex_destroy(&syncer->mutex);
+    free(syncer);
+
+    return ret;
+}
@@ -0,0 +1,56 @@
+/*
+ * This file is part of hairgap.
+ * Copyright (C) 2017  Florent MONJALET <florent.monjalet@cea.fr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HGAP_SYNCER_H
+#define HGAP_SYNCER_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * Background durability for an output file being written sequentially (or
+ * at least with a known contiguous write head).
+ *
+ * Writers only publish their write head, which never blocks on the disk. A
+ * dedicated thread flushes the data behind it by rolling windows of interval
+ * bytes: it starts the writeback of the new window (sync_file_range(2)),
+ * waits for the completion of the previous one and drops it from the page
+ * cache (posix_fadvise(2) DONTNEED), so that dirty pages never pile up.
+ */
+struct hgap_syncer;
+
+/**
+ * Starts syncing fd from offset base, every interval bytes.
+ */
+struct hgap_syncer *hgap_syncer_new(int fd, off_t base, size_t interval);
+
+/**
+ * Publishes the write head: head bytes from base have been written. Never
+ * blocks on I/O.
+ */
+void hgap_syncer_advance(struct hgap_syncer *syncer, size_t head);
+
+/**
+ * Stops the background thread, flushes everything (fsync(2)) and frees the
+ * syncer.
+ *
+ * @return HGAP_SUCCESS or HGAP_ERR_BAD_OUT_FD if the flush failed.
+ */
+int hgap_syncer_finish(struct hgap_syncer *syncer);
+
+#endif // HGAP_SYNCER_H
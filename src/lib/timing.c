@@ -0,0 +1,140 @@
+/*
+ * This file is part of hairgap.
+ * Copyright (C) 2017  Florent MONJALET <florent.monjalet@cea.fr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "timing.h"
+
+#ifdef HGAP_TIMING
+
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+
+#include "common.h"
+
+// Bucket i holds the durations in [2^i, 2^(i + 1)) ns
+#define HGAP_TIMING_BUCKETS 40
+// Chunks in flight for the end to end probes (power of 2)
+#define HGAP_TIMING_RING 1024
+
+struct hgap_timing_hist {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[HGAP_TIMING_BUCKETS];
+};
+
+static const char *hgap_timing_names[HGAP_TIMING_N_PROBES] = {
+    [HGAP_TIMING_READ] = "read",
+    [HGAP_TIMING_ENC_INIT] = "encode chunk",
+    [HGAP_TIMING_ENC_EMIT] = "encode packet",
+    [HGAP_TIMING_SEND] = "send packet",
+    [HGAP_TIMING_SEND_CHUNK] = "chunk read to sent",
+    [HGAP_TIMING_DEC_READ] = "decode packet",
+    [HGAP_TIMING_DEC_EMIT] = "decode chunk",
+    [HGAP_TIMING_WRITE] = "write",
+    [HGAP_TIMING_RECV_CHUNK] = "chunk received to written",
+};
+
+static struct hgap_timing_hist hgap_timing_hists[HGAP_TIMING_N_PROBES];
+// Start of the chunks in flight, for SEND_CHUNK and RECV_CHUNK
+static uint64_t hgap_timing_starts[2][HGAP_TIMING_RING];
+
+#define relaxed_add(p, v) __atomic_fetch_add((p), (v), __ATOMIC_RELAXED)
+#define relaxed_load(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+#define relaxed_store(p, v) __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+
+uint64_t
+hgap_timing_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void
+hgap_timing_record(enum hgap_timing_probe probe, uint64_t ns)
+{
+    struct hgap_timing_hist *hist = &hgap_timing_hists[probe];
+    size_t bucket = hgap_log2_bucket(ns, HGAP_TIMING_BUCKETS);
+
+    relaxed_add(&hist->count, 1);
+    relaxed_add(&hist->sum, ns);
+    relaxed_add(&hist->buckets[bucket], 1);
+
+    uint64_t max = relaxed_load(&hist->max);
+    while (ns > max &&
+           !__atomic_compare_exchange_n(&hist->max, &max, ns, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+static uint64_t *
+hgap_timing_start_slot(enum hgap_timing_probe probe, uint64_t num)
+{
+    CHK(probe == HGAP_TIMING_SEND_CHUNK || probe == HGAP_TIMING_RECV_CHUNK);
+    return &hgap_timing_starts[probe == HGAP_TIMING_RECV_CHUNK]
+                              [num % HGAP_TIMING_RING];
+}
+
+void
+hgap_timing_chunk_start(enum hgap_timing_probe probe, uint64_t num)
+{
+    relaxed_store(hgap_timing_start_slot(probe, num), hgap_timing_now());
+}
+
+void
+hgap_timing_chunk_end(enum hgap_timing_probe probe, uint64_t num)
+{
+    uint64_t start = relaxed_load(hgap_timing_start_slot(probe, num));
+    if (start != 0) {
+        hgap_timing_record(probe, hgap_timing_now() - start);
+    }
+}
+
+void
+hgap_timing_report(FILE *out, enum hgap_timing_probe first,
+                   enum hgap_timing_probe last)
+{
+    fprintf(out, "Timing (count, mean, max; histogram: bucket upper bound: "
+                 "%% of the samples):\n");
+    for (int p = first; p <= (int) last; p++) {
+        struct hgap_timing_hist *hist = &hgap_timing_hists[p];
+        if (hist->count == 0) {
+            continue;
+        }
+
+        fprintf(out, "    %s: %"PRIu64", ", hgap_timing_names[p],
+                hist->count);
+        hgap_print_ns(out, (double) hist->sum / hist->count);
+        fprintf(out, ", ");
+        hgap_print_ns(out, hist->max);
+        fprintf(out, ";");
+        for (int i = 0; i < HGAP_TIMING_BUCKETS; i++) {
+            if (hist->buckets[i] > 0) {
+                fprintf(out, " <");
+                hgap_print_ns(out, (double) (2ULL << i));
+                fprintf(out, ": %.1f", 100. * hist->buckets[i] / hist->count);
+            }
+        }
+        fprintf(out, "\n");
+
+        memset(hist, 0, sizeof *hist);
+    }
+}
+
+#endif // HGAP_TIMING
@@ -0,0 +1,102 @@
+/*
+ * This file is part of hairgap.
+ * Copyright (C) 2017  Florent MONJALET <florent.monjalet@cea.fr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HGAP_TIMING_H
+#define HGAP_TIMING_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * Per-stage timing, to find out where the CPU time goes in the pipelines:
+ * the work of each stage is timed with CLOCK_MONOTONIC_RAW and aggregated in
+ * a log2 histogram per probe, printed at the end of the transfer. Chunks are
+ * also timed end to end, from their reading to their last packet sent on the
+ * sender side, and from their first packet received to their writing on the
+ * receiver side.
+ *
+ * Only built with HGAP_TIMING defined (make timing): otherwise, the macros
+ * below expand to nothing and there is no cost at all.
+ *
+ * The histograms are global to the process and updated with relaxed
+ * atomics, so any thread can record in them.
+ */
+
+enum hgap_timing_probe {
+    // Sender side
+    HGAP_TIMING_READ,
+    HGAP_TIMING_ENC_INIT,
+    HGAP_TIMING_ENC_EMIT,
+    HGAP_TIMING_SEND,
+    HGAP_TIMING_SEND_CHUNK,
+    // Receiver side
+    HGAP_TIMING_DEC_READ,
+    HGAP_TIMING_DEC_EMIT,
+    HGAP_TIMING_WRITE,
+    HGAP_TIMING_RECV_CHUNK,
+    HGAP_TIMING_N_PROBES
+};
+
+#define HGAP_TIMING_SENDER_FIRST HGAP_TIMING_READ
+#define HGAP_TIMING_RECEIVER_FIRST HGAP_TIMING_DEC_READ
+
+#ifdef HGAP_TIMING
+
+uint64_t hgap_timing_now(void);
+
+/**
+ * Records a duration of ns nanoseconds for probe.
+ */
+void hgap_timing_record(enum hgap_timing_probe probe, uint64_t ns);
+
+/**
+ * Marks the start of chunk num for the end to end probe (SEND_CHUNK or
+ * RECV_CHUNK), hgap_timing_chunk_end records its duration. Only the last
+ * HGAP_TIMING_RING chunks started can be in flight.
+ */
+void hgap_timing_chunk_start(enum hgap_timing_probe probe, uint64_t num);
+void hgap_timing_chunk_end(enum hgap_timing_probe probe, uint64_t num);
+
+/**
+ * Prints the histograms of the probes from first to last (included) that
+ * recorded something, and resets them.
+ */
+void hgap_timing_report(FILE *out, enum hgap_timing_probe first,
+                        enum hgap_timing_probe last);
+
+#define HGAP_TIMING_START(t) uint64_t t = hgap_timing_now()
+#define HGAP_TIMING_END(probe, t) \
+    hgap_timing_record((probe), hgap_timing_now() - (t))
+#define HGAP_TIMING_CHUNK_START(probe, num) \
+    hgap_timing_chunk_start((probe), (num))
+#define HGAP_TIMING_CHUNK_END(probe, num) \
+    hgap_timing_chunk_end((probe), (num))
+#define HGAP_TIMING_REPORT(out, first, last) \
+    hgap_timing_report((out), (first), (last))
+
+#else
+
+#define HGAP_TIMING_START(t)
+#define HGAP_TIMING_END(probe, t)
+#define HGAP_TIMING_CHUNK_START(probe, num) ((void) (num))
+#define HGAP_TIMING_CHUNK_END(probe, num) ((void) (num))
+#define HGAP_TIMING_REPORT(out, first, last)
+
+#endif // HGAP_TIMING
+
+#endif // HGAP_TIMING_H
@@ -0,0 +1,146 @@
+/*
+ * This file is part of hairgap.
+ * Copyright (C) 2017  Florent MONJALET <florent.monjalet@cea.fr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "trace.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "proto.h"
+
+// Records are small, write them in big batches
+#define HGAP_TRACE_BUF_SIZE (1024 * 1024)
+
+struct hgap_trace {
+    FILE *file;
+    uint64_t start_ns;
+};
+
+struct hgap_trace_reader {
+    FILE *file;
+};
+
+struct hgap_trace *
+hgap_trace_new(const char *path)
+{
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        return NULL;
+    }
+    setvbuf(file, NULL, _IOFBF, HGAP_TRACE_BUF_SIZE);
+
+    struct hgap_trace *trace = xmalloc(sizeof *trace);
+    trace->file = file;
+    trace->start_ns = hgap_now_ns();
+
+    struct hgap_trace_header hdr = {
+        .magic = HGAP_TRACE_MAGIC,
+        .version = HGAP_TRACE_VERSION,
+        .start_ns = trace->start_ns,
+    };
+    if (fwrite(&hdr, sizeof hdr, 1, file) != 1) {
+        int err = errno;
+        fclose(file);
+        free(trace);
+        errno = err;
+        return NULL;
+    }
+
+    return trace;
+}
+
+void
+hgap_trace_pkt(struct hgap_trace *trace, uint64_t ns, const void *pkt,
+               size_t len)
+{
+    struct hgap_trace_rec rec;
+    struct hgap_pkt parsed;
+
+    memset(&rec, 0, sizeof rec);
+    rec.ns = ns - trace->start_ns;
+    rec.len = len;
+    if (len >= HGAP_HEADER_LEN) {
+        // The header is recorded as is, even if the payload is short
+        hgap_pkt_parse(&parsed, pkt, len);
+        rec.chunk_num = parsed.hdr.chunk_num;
+        rec.chunk_size = parsed.hdr.chunk_size;
+        rec.data_id = parsed.hdr.data_id;
+        rec.data_size = parsed.hdr.data_size;
+    }
+
+    fwrite(&rec, sizeof rec, 1, trace->file);
+}
+
+int
+hgap_trace_free(struct hgap_trace *trace)
+{
+    int ret = ferror(trace->file) ? -1 : 0;
+    int err = errno;
+    if (fclose(trace->file) != 0) {
+        ret = -1;
+        err = errno;
+    }
+    free(trace);
+
+    errno = err;
+    return ret;
+}
+
+struct hgap_trace_reader *
+hgap_trace_reader_new(const char *path)
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return NULL;
+    }
+    setvbuf(file, NULL, _IOFBF, HGAP_TRACE_BUF_SIZE);
+
+    struct hgap_trace_header hdr;
+    if (fread(&hdr, sizeof hdr, 1, file) != 1 ||
+        hdr.magic != HGAP_TRACE_MAGIC || hdr.version != HGAP_TRACE_VERSION) {
+        fclose(file);
+        errno = EPROTO;
+        return NULL;
+    }
+
+    struct hgap_trace_reader *reader = xmalloc(sizeof *reader);
+    reader->file = file;
+    return reader;
+}
+
+int
+hgap_trace_reader_next(struct hgap_trace_reader *reader,
+                       struct hgap_trace_rec *rec)
+{
+    size_t n = fread(rec, 1, sizeof *rec, reader->file);
+    if (n == sizeof *rec) {
+        return 1;
+    }
+
+    return n == 0 && !ferror(reader->file) ? 0 : -1;
+}
+
+void
+hgap_trace_reader_free(struct hgap_trace_reader *reader)
+{
+    fclose(reader->file);
+    free(reader);
+}
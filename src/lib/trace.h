@@ -0,0 +1,106 @@
+/*
+ * This file is part of hairgap.
+ * Copyright (C) 2017  Florent MONJALET <florent.monjalet@cea.fr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HGAP_TRACE_H
+#define HGAP_TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Packet arrival traces: the receiver logs the header of every packet it
+ * receives (no payload), in arrival order, so that a transfer can be
+ * replayed offline through the decoder with exactly the same losses and
+ * reordering (see hgap-replay).
+ *
+ * A trace is a struct hgap_trace_header followed by one struct
+ * hgap_trace_rec per packet, in host byte order.
+ */
+
+#define HGAP_TRACE_MAGIC 0x72746768 // "hgtr" on little endian hosts
+#define HGAP_TRACE_VERSION 1
+
+struct hgap_trace_header {
+    uint32_t magic;
+    uint32_t version;
+    // CLOCK_MONOTONIC time the records are relative to
+    uint64_t start_ns;
+};
+
+/**
+ * A received packet: its header fields (see struct hgap_header) and its
+ * size. Packets too small for a header are recorded with their size only.
+ */
+struct hgap_trace_rec {
+    // Since start_ns; the packets of a receive burst share it
+    uint64_t ns;
+    uint64_t chunk_num;
+    uint32_t chunk_size;
+    uint32_t data_id;
+    uint32_t data_size;
+    uint32_t len;
+};
+
+struct hgap_trace;
+
+/**
+ * Creates (or truncates) the trace file path and writes its header.
+ *
+ * @return the trace, or NULL on failure (errno is set).
+ */
+struct hgap_trace *hgap_trace_new(const char *path);
+
+/**
+ * Records the packet pkt of len bytes, received at ns (CLOCK_MONOTONIC).
+ * Write errors are only reported by hgap_trace_free.
+ */
+void hgap_trace_pkt(struct hgap_trace *trace, uint64_t ns, const void *pkt,
+                    size_t len);
+
+/**
+ * Flushes and closes the trace.
+ *
+ * @return 0, or -1 if some records could not be written (errno is set).
+ */
+int hgap_trace_free(struct hgap_trace *trace);
+
+/**
+ * Reads a trace back, record by record.
+ */
+struct hgap_trace_reader;
+
+/**
+ * Opens the trace file path and checks its header.
+ *
+ * @return the reader, or NULL on failure (errno is set, EPROTO if it is not
+ *     a trace of this version).
+ */
+struct hgap_trace_reader *hgap_trace_reader_new(const char *path);
+
+/**
+ * Reads the next record in *rec.
+ *
+ * @return 1 if a record was read, 0 at the end of the trace, -1 on error
+ *     (including a truncated record).
+ */
+int hgap_trace_reader_next(struct hgap_trace_reader *reader,
+                           struct hgap_trace_rec *rec);
+
+void hgap_trace_reader_free(struct hgap_trace_reader *reader);
+
+#endif // HGAP_TRACE_H
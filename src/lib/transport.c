@@ -0,0 +1,349 @@
+/*
+ * This file is part of hairgap.
+ * Copyright (C) 2017  Florent MONJALET <florent.monjalet@cea.fr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE // recvmmsg
+
+#include "transport.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <linux/sock_diag.h>
+
+#include "common.h"
+#include "memlink.h"
+
+struct hgap_udp_transport {
+    struct hgap_transport tr;
+    int sockfd;
+    struct sockaddr_in dstaddr;
+    // Receiving side: busy polling, current SO_RCVTIMEO
+    int busy_poll;
+    uint64_t rcvtimeo;
+};
+
+#define UDP(tr) ((struct hgap_udp_transport *) (tr))
+
+static ssize_t
+hgap_udp_send(struct hgap_transport *tr, const void *pkt, size_t size)
+{
+    return sendto(UDP(tr)->sockfd, pkt, size, 0,
+                  (struct sockaddr *) &UDP(tr)->dstaddr,
+                  sizeof UDP(tr)->dstaddr);
+}
+
+static void
+hgap_udp_wait_send(struct hgap_transport *tr, int timeout_ms)
+{
+    struct pollfd pfd = { .fd=UDP(tr)->sockfd, .events=POLLOUT };
+    poll(&pfd, 1, timeout_ms);
+}
+
+static void
+hgap_udp_set_timeout(struct hgap_udp_transport *udp, uint64_t timeout)
+{
+    struct timeval tv;
+
+    tv.tv_sec = timeout / 1000000;
+    tv.tv_usec = timeout % 1000000;
+
+    CHK_PERROR(setsockopt(udp->sockfd, SOL_SOCKET, SO_RCVTIMEO,
+                &tv, sizeof(tv)) != -1);
+    udp->rcvtimeo = timeout;
+}
+
+/**
+ * Busy-polling counterpart of recvmmsg(2) with MSG_WAITFORONE: retries
+ * non-blocking receives until at least a packet is there. When timeout is
+ * not 0, fails with ETIMEDOUT after timeout us without packets.
+ */
+static int
+hgap_udp_busy_recv(int sockfd, struct mmsghdr *msgs, size_t n,
+                   uint64_t timeout)
+{
+    uint64_t deadline = 0;
+
+    for (;;) {
+        int n_recv = recvmmsg(sockfd, msgs, n, MSG_DONTWAIT, NULL);
+        if (n_recv != -1 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+            return n_recv;
+        }
+
+        if (timeout != 0) {
+            uint64_t now = hgap_now_ns() / 1000;
+            if (deadline == 0) {
+                deadline = now + timeout;
+            } else if (now >= deadline) {
+                errno = ETIMEDOUT;
+                return -1;
+            }
+        }
+        hgap_cpu_relax();
+    }
+}
+
+static int
+hgap_udp_recv(struct hgap_transport *tr, struct mmsghdr *msgs, size_t n,
+              int flags, uint64_t timeout)
+{
+    struct hgap_udp_transport *udp = UDP(tr);
+
+    if (flags & HGAP_TRANSPORT_DONTWAIT) {
+        return recvmmsg(udp->sockfd, msgs, n, MSG_DONTWAIT, NULL);
+    } else if (udp->busy_poll) {
+        return hgap_udp_busy_recv(udp->sockfd, msgs, n, timeout);
+    }
+
+    if (timeout != udp->rcvtimeo) {
+        hgap_udp_set_timeout(udp, timeout);
+    }
+    int n_recv = recvmmsg(udp->sockfd, msgs, n, MSG_WAITFORONE, NULL);
+    if (n_recv == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        errno = ETIMEDOUT;
+    }
+    return n_recv;
+}
+
+static int
+hgap_udp_fd(struct hgap_transport *tr)
+{
+    return UDP(tr)->sockfd;
+}
+
+/**
+ * The drop counter also comes with the packets queued after a drop (see
+ * SO_RXQ_OVFL), but the drops at the end of the transfer are only seen
+ * here.
+ */
+static uint32_t
+hgap_udp_drops(struct hgap_transport *tr)
+{
+#ifdef SO_MEMINFO
+    uint32_t meminfo[SK_MEMINFO_VARS];
+    socklen_t len = sizeof meminfo;
+    if (getsockopt(UDP(tr)->sockfd, SOL_SOCKET, SO_MEMINFO, meminfo,
+                   &len) == 0 &&
+        len > SK_MEMINFO_DROPS * sizeof *meminfo) {
+        return meminfo[SK_MEMINFO_DROPS];
+    }
+#else
+    FAKE_USE(tr);
+#endif
+    return 0;
+}
+
+static void
+hgap_udp_free(struct hgap_transport *tr)
+{
+    close(UDP(tr)->sockfd);
+    free(tr);
+}
+
+static const struct hgap_transport_ops hgap_udp_sender_ops = {
+    .send=hgap_udp_send,
+    .wait_send=hgap_udp_wait_send,
+    .free=hgap_udp_free,
+};
+
+static const struct hgap_transport_ops hgap_udp_receiver_ops = {
+    .recv=hgap_udp_recv,
+    .fd=hgap_udp_fd,
+    .drops=hgap_udp_drops,
+    .free=hgap_udp_free,
+};
+
+struct hgap_transport *
+hgap_transport_udp_sender(const char *host, short port)
+{
+    struct hgap_udp_transport *udp = xmalloc(sizeof *udp);
+    memset(udp, 0, sizeof *udp);
+    udp->tr.ops = &hgap_udp_sender_ops;
+
+    // Non-blocking, so that waits on a full socket buffer are accounted
+    udp->sockfd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if (udp->sockfd < 0) {
+        DBG("Socket creation error");
+        free(udp);
+        return NULL;
+    }
+
+    udp->dstaddr.sin_family = AF_INET;
+    // TODO getaddrinfo
+    if ((udp->dstaddr.sin_addr.s_addr = inet_addr(host)) == 0) {
+        DBG("Invalid IP in hgap_sender\n");
+        hgap_udp_free(&udp->tr);
+        return NULL;
+    }
+    udp->dstaddr.sin_port = htons(port);
+
+    return &udp->tr;
+}
+
+static int
+hgap_udp_open_socket(const char *addr, short port)
+{
+    struct sockaddr_in servaddr;
+    socklen_t socklen = sizeof(servaddr);
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sockfd == -1) {
+        perror("socket");
+        goto err;
+    }
+
+    memset(&servaddr, 0, sizeof(servaddr));
+    servaddr.sin_family = AF_INET;
+    if ((servaddr.sin_addr.s_addr = inet_addr(addr)) == INADDR_NONE) {
+        goto err;
+    }
+
+    servaddr.sin_port = htons(port);
+
+    if (bind(sockfd, (struct sockaddr *) &servaddr, socklen) == -1) {
+        perror("socket");
+        goto err;
+    }
+
+    if (0) {
+err:
+        if (sockfd != -1) {
+            close(sockfd);
+        }
+        sockfd = -1;
+    }
+
+    return sockfd;
+}
+
+/**
+ * Sizes the socket receive buffer to hold size bytes of packets, so that we
+ * do not depend on the sysctl defaults. SO_RCVBUFFORCE (CAP_NET_ADMIN) is
+ * tried first, then SO_RCVBUF, capped by net.core.rmem_max. Never shrinks it.
+ */
+static void
+hgap_udp_set_rcvbuf(int sockfd, size_t size)
+{
+    int cur;
+    socklen_t len = sizeof cur;
+    int val = MIN(size, INT_MAX / 2);
+
+    // The kernel doubles the requested value to account for its overhead
+    CHK_PERROR(getsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &cur, &len) != -1);
+    if (cur / 2 >= val) {
+        return;
+    }
+
+    if (setsockopt(sockfd, SOL_SOCKET, SO_RCVBUFFORCE, &val,
+                   sizeof val) == -1 &&
+        setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &val, sizeof val) == -1) {
+        PWARN("SO_RCVBUF");
+        return;
+    }
+
+    CHK_PERROR(getsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &cur, &len) != -1);
+    if (cur / 2 < val) {
+        WARN("Socket receive buffer limited to %d bytes (wanted %d), "
+             "consider raising net.core.rmem_max\n", cur / 2, val);
+    } else {
+        DBG("Socket receive buffer: %d bytes\n", cur / 2);
+    }
+}
+
+static void
+hgap_udp_set_busy_poll(int sockfd, unsigned busy_poll)
+{
+    int val = busy_poll;
+    // Above net.core.busy_poll, needs CAP_NET_ADMIN
+    if (setsockopt(sockfd, SOL_SOCKET, SO_BUSY_POLL, &val, sizeof val) == -1) {
+        PWARN("SO_BUSY_POLL");
+    }
+
+#ifdef SO_PREFER_BUSY_POLL
+    val = 1;
+    if (setsockopt(sockfd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &val,
+                   sizeof val) == -1) {
+        PWARN("SO_PREFER_BUSY_POLL");
+    }
+#endif
+}
+
+struct hgap_transport *
+hgap_transport_udp_receiver(const struct hgap_config *config)
+{
+    int sockfd = hgap_udp_open_socket(config->addr, config->port);
+    if (sockfd == -1) {
+        return NULL;
+    }
+
+    struct hgap_udp_transport *udp = xmalloc(sizeof *udp);
+    memset(udp, 0, sizeof *udp);
+    udp->tr.ops = &hgap_udp_receiver_ops;
+    udp->sockfd = sockfd;
+    udp->busy_poll = config->busy_poll > 0;
+
+    // The kernel accounts twice the packets it holds
+    hgap_udp_set_rcvbuf(sockfd, hgap_transport_rcvbuf_mem(config) / 2);
+
+    int one = 1;
+    if (setsockopt(sockfd, SOL_SOCKET, SO_RXQ_OVFL, &one, sizeof one) == -1) {
+        PWARN("SO_RXQ_OVFL, kernel drops will not be reported");
+    }
+
+    if (config->busy_poll > 0) {
+        hgap_udp_set_busy_poll(sockfd, config->busy_poll);
+    }
+
+    if (config->timestamps &&
+        setsockopt(sockfd, SOL_SOCKET, SO_TIMESTAMPNS, &one,
+                   sizeof one) == -1) {
+        PWARN("SO_TIMESTAMPNS, delays will be measured in user space");
+    }
+
+    return &udp->tr;
+}
+
+size_t
+hgap_transport_rcvbuf_mem(const struct hgap_config *config)
+{
+    return config->memlink != NULL ? 0 : config->mem_limit / 4;
+}
+
+struct hgap_transport *
+hgap_transport_sender(const struct hgap_config *config)
+{
+    if (config->memlink != NULL) {
+        return hgap_memlink_sender(config->memlink);
+    }
+    return hgap_transport_udp_sender(config->addr, config->port);
+}
+
+struct hgap_transport *
+hgap_transport_receiver(const struct hgap_config *config)
+{
+    if (config->memlink != NULL) {
+        return hgap_memlink_receiver(config->memlink);
+    }
+    return hgap_transport_udp_receiver(config);
+}
@@ -0,0 +1,164 @@
+/*
+ * This file is part of hairgap.
+ * Copyright (C) 2017  Florent MONJALET <florent.monjalet@cea.fr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HGAP_TRANSPORT_H
+#define HGAP_TRANSPORT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include "hairgap.h"
+
+/**
+ * Network endpoints of the sender (hgap_sender) and of the receiver (the net
+ * stage), behind a set of operations so that they do not depend on UDP:
+ * packets can also go through an in-memory link (see memlink.h), to
+ * benchmark whole transfers without the network stack.
+ *
+ * A transport is either a sending or a receiving endpoint, the operations
+ * of the other side are NULL. Receives fill mmsghdrs as recvmmsg(2) does;
+ * the ancillary data (drop counter, receive time) is only provided by UDP,
+ * other transports set msg_controllen to 0.
+ */
+
+// Do not wait for packets (see recv)
+#define HGAP_TRANSPORT_DONTWAIT 0x1
+
+struct hgap_transport;
+// Only visible with _GNU_SOURCE, needed by the receiving side only
+struct mmsghdr;
+
+struct hgap_transport_ops {
+    /**
+     * Sends a packet, as sendto(2). Fails with EAGAIN (or ENOBUFS) when the
+     * local buffers are full, see wait_send.
+     */
+    ssize_t (*send)(struct hgap_transport *tr, const void *pkt, size_t size);
+
+    /**
+     * Waits at most timeout_ms for the transport to take packets again after
+     * send failed with EAGAIN.
+     */
+    void (*wait_send)(struct hgap_transport *tr, int timeout_ms);
+
+    /**
+     * Receives up to n packets, as recvmmsg(2) with MSG_WAITFORONE: waits for
+     * the first one, failing with ETIMEDOUT after timeout us (0 waits
+     * forever), and takes the ones already there. With
+     * HGAP_TRANSPORT_DONTWAIT in flags, fails with EAGAIN instead of waiting.
+     *
+     * @return the number of packets received, -1 on failure (errno is set).
+     */
+    int (*recv)(struct hgap_transport *tr, struct mmsghdr *msgs, size_t n,
+                int flags, uint64_t timeout);
+
+    /**
+     * File descriptor that polls readable when packets may be there, to wait
+     * for them in an event loop after a recv with HGAP_TRANSPORT_DONTWAIT.
+     */
+    int (*fd)(struct hgap_transport *tr);
+
+    /**
+     * Packets dropped so far by the receiving side for lack of room (the
+     * kernel drops of a socket).
+     */
+    uint32_t (*drops)(struct hgap_transport *tr);
+
+    void (*free)(struct hgap_transport *tr);
+};
+
+struct hgap_transport {
+    const struct hgap_transport_ops *ops;
+};
+
+/**
+ * UDP sending endpoint, to host:port.
+ *
+ * @return the transport, or NULL on failure.
+ */
+struct hgap_transport *hgap_transport_udp_sender(const char *host,
+                                                 short port);
+
+/**
+ * UDP receiving endpoint, bound to config->addr:config->port, its socket set
+ * up after the config (receive buffer sized by hgap_transport_rcvbuf_mem,
+ * kernel drop counter, busy_poll, timestamps).
+ *
+ * @return the transport, or NULL on failure.
+ */
+struct hgap_transport *hgap_transport_udp_receiver(
+        const struct hgap_config *config);
+
+/**
+ * Memory of the socket receive buffer of the receiver, as the kernel accounts
+ * it, taken out of config->mem_limit: a quarter of it (half of the share of
+ * the packets), none for the in-memory link.
+ */
+size_t hgap_transport_rcvbuf_mem(const struct hgap_config *config);
+
+/**
+ * Endpoints of a transfer: the in-memory link config->memlink if set, UDP
+ * otherwise.
+ */
+struct hgap_transport *hgap_transport_sender(const struct hgap_config *config);
+struct hgap_transport *hgap_transport_receiver(
+        const struct hgap_config *config);
+
+static inline ssize_t
+hgap_transport_send(struct hgap_transport *tr, const void *pkt, size_t size)
+{
+    return tr->ops->send(tr, pkt, size);
+}
+
+static inline void
+hgap_transport_wait_send(struct hgap_transport *tr, int timeout_ms)
+{
+    tr->ops->wait_send(tr, timeout_ms);
+}
+
+static inline int
+hgap_transport_recv(struct hgap_transport *tr, struct mmsghdr *msgs, size_t n,
+                    int flags, uint64_t timeout)
+{
+    return tr->ops->recv(tr, msgs, n, flags, timeout);
+}
+
+static inline int
+hgap_transport_fd(struct hgap_transport *tr)
+{
+    return tr->ops->fd(tr);
+}
+
+static inline uint32_t
+hgap_transport_drops(struct hgap_transport *tr)
+{
+    return tr->ops->drops(tr);
+}
+
+static inline void
+hgap_transport_free(struct hgap_transport *tr)
+{
+    if (tr != NULL) {
+        tr->ops->free(tr);
+    }
+}
+
+#endif // HGAP_TRANSPORT_H
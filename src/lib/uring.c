@@ -0,0 +1,216 @@
+/*
+ * This file is part of hairgap.
+ * Copyright (C) 2017  Florent MONJALET <florent.monjalet@cea.fr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "uring.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <linux/io_uring.h>
+
+#include "common.h"
+
+#define load_acquire(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+struct hgap_uring {
+    int fd;
+
+    // Submission queue
+    void *sq_ring;
+    size_t sq_ring_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+
+    // Completion queue (may share the submission queue mapping)
+    void *cq_ring;
+    size_t cq_ring_size;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+};
+
+static int
+sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                   unsigned flags)
+{
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                         flags, NULL, 0);
+}
+
+struct hgap_uring *
+hgap_uring_new(unsigned entries)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof params);
+
+    int fd = sys_io_uring_setup(entries, &params);
+    if (fd == -1) {
+        return NULL;
+    }
+
+    struct hgap_uring *ring = xmalloc(sizeof *ring);
+    memset(ring, 0, sizeof *ring);
+    ring->fd = fd;
+
+    ring->sq_ring_size = params.sq_off.array +
+                         params.sq_entries * sizeof (unsigned);
+    ring->cq_ring_size = params.cq_off.cqes +
+                         params.cq_entries * sizeof (struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->sq_ring_size = MAX(ring->sq_ring_size, ring->cq_ring_size);
+        ring->cq_ring_size = 0;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        goto err;
+    }
+
+    if (ring->cq_ring_size == 0) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, fd,
+                             IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            goto err_sq;
+        }
+    }
+
+    ring->sqes_size = params.sq_entries * sizeof (struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        goto err_cq;
+    }
+
+    char *sq = ring->sq_ring;
+    ring->sq_head = (unsigned *) (sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) (sq + params.sq_off.array);
+
+    char *cq = ring->cq_ring;
+    ring->cq_head = (unsigned *) (cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+    return ring;
+
+err_cq:
+    if (ring->cq_ring_size != 0) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+err_sq:
+    munmap(ring->sq_ring, ring->sq_ring_size);
+err:
+    close(fd);
+    free(ring);
+    return NULL;
+}
+
+void
+hgap_uring_free(struct hgap_uring *ring)
+{
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring_size != 0) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+    free(ring);
+}
+
+int
+hgap_uring_writev(struct hgap_uring *ring, int fd, const struct iovec *iov,
+                  int iovcnt, off_t offset, uint64_t user_data)
+{
+    unsigned tail = *ring->sq_tail;
+    unsigned mask = *ring->sq_mask;
+
+    if (tail - load_acquire(ring->sq_head) > mask) {
+        return -EBUSY;
+    }
+
+    unsigned idx = tail & mask;
+    struct io_uring_sqe *sqe = &ring->sqes[idx];
+    memset(sqe, 0, sizeof *sqe);
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = fd;
+    sqe->off = offset;
+    sqe->addr = (uintptr_t) iov;
+    sqe->len = iovcnt;
+    sqe->user_data = user_data;
+
+    ring->sq_array[idx] = idx;
+    store_release(ring->sq_tail, tail + 1);
+
+    int ret;
+    do {
+        ret = sys_io_uring_enter(ring->fd, 1, 0, 0);
+    } while (ret == -1 && errno == EINTR);
+
+    if (ret == 1 || load_acquire(ring->sq_head) != tail) {
+        // Consumed, it will complete
+        return 0;
+    }
+
+    // Withdrawn, so that the next submission does not pick it up once the
+    // caller has reused its buffer
+    int err = ret == -1 ? errno : EAGAIN;
+    store_release(ring->sq_tail, tail);
+    return -err;
+}
+
+int
+hgap_uring_wait(struct hgap_uring *ring, uint64_t *user_data, int *res)
+{
+    unsigned head = *ring->cq_head;
+
+    while (head == load_acquire(ring->cq_tail)) {
+        if (sys_io_uring_enter(ring->fd, 0, 1, IORING_ENTER_GETEVENTS) == -1 &&
+            errno != EINTR) {
+            return -errno;
+        }
+    }
+
+    struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+    *user_data = cqe->user_data;
+    *res = cqe->res;
+    store_release(ring->cq_head, head + 1);
+
+    return 0;
+}
@@ -0,0 +1,62 @@
+/*
+ * This file is part of hairgap.
+ * Copyright (C) 2017  Florent MONJALET <florent.monjalet@cea.fr>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HGAP_URING_H
+#define HGAP_URING_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/**
+ * Minimal io_uring wrapper (raw syscalls, no liburing dependency), only
+ * providing what the asynchronous writer needs: queue vectored writes and
+ * reap their completions. Single threaded use only.
+ */
+struct hgap_uring;
+
+/**
+ * Sets up a ring able to hold entries requests in flight.
+ *
+ * @return the ring, or NULL if io_uring is not available on this system
+ *     (errno is set).
+ */
+struct hgap_uring *hgap_uring_new(unsigned entries);
+void hgap_uring_free(struct hgap_uring *ring);
+
+/**
+ * Queues and submits a pwritev(2)-like request. The iovec array and the
+ * buffers must stay valid until the request completes.
+ *
+ * @return 0 on success, -errno on failure (e.g. -EBUSY if the ring is full).
+ *     On failure, the request is not queued and will never complete.
+ */
+int hgap_uring_writev(struct hgap_uring *ring, int fd, const struct iovec *iov,
+                      int iovcnt, off_t offset, uint64_t user_data);
+
+/**
+ * Waits for a request to complete.
+ *
+ * @param user_data filled with the user_data of the completed request.
+ * @param res filled with the result of the request (as returned by
+ *     pwritev(2), -errno on error).
+ * @return 0 on success, -errno on failure.
+ */
+int hgap_uring_wait(struct hgap_uring *ring, uint64_t *user_data, int *res);
+
+#endif // HGAP_URING_H
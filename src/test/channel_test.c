@@ -19,13 +19,18 @@
 #include <sys/time.h>
 
 #include <assert.h>
+#include <inttypes.h>
 #include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
+#include "bufpool.h"
 #include "channel.h"
 #include "common.h"
+#include "membudget.h"
 
 uint32_t send_amount = 0;
 struct timeval t1, t2;
@@ -89,6 +94,207 @@ void test_simple_concurrent(size_t elt_size, size_t capacity) {
     INFO("Throughput: %lf elt/s\n", throughput);
 }
 
+void batch_producer(struct channel *chan) {
+    size_t slot_size = channel_slot_size(chan);
+    uint32_t i = 0;
+    void *run = NULL;
+
+    gettimeofday(&t1, NULL);
+    while (i < send_amount) {
+        size_t n = channel_reserve_n(chan, 1 + i % 48, &run);
+        assert(n > 0);
+        n = MIN(n, send_amount - i);
+        for (size_t j = 0; j < n; j++) {
+            *(uint32_t *)((char *) run + j * slot_size) = i++;
+        }
+        assert(channel_send_reserved_n(chan, run, n) == 1);
+    }
+}
+
+void test_batch_concurrent(size_t elt_size, size_t capacity,
+                           unsigned alloc_flags) {
+    struct channel *chan = channel_new_flags(elt_size, capacity, alloc_flags,
+                                             -1);
+    size_t slot_size = channel_slot_size(chan);
+    assert(slot_size >= elt_size);
+    struct channel_stats stats;
+    assert(channel_get_stats(chan, &stats) == 0);
+    channel_enable_stats(chan);
+    uint32_t next = 0;
+    void *run = NULL;
+    pthread_t send_thread;
+    CHK_PERROR(pthread_create(&send_thread, NULL,
+                       (void*(*)(void*)) batch_producer, chan) == 0);
+
+    while (next < send_amount) {
+        size_t n = channel_peek_n(chan, 32, &run);
+        assert(n > 0 && n <= 32);
+        for (size_t j = 0; j < n; j++) {
+            assert(*(uint32_t *)((char *) run + j * slot_size) == next);
+            next++;
+        }
+        assert(channel_ack_n(chan, run, n) == 1);
+    }
+    gettimeofday(&t2, NULL);
+
+    pthread_join(send_thread, NULL);
+    assert(channel_get_stats(chan, &stats) == 1);
+    assert(stats.sent == send_amount && stats.received == send_amount);
+    uint64_t samples = 0;
+    for (size_t i = 0; i < CHANNEL_STATS_BUCKETS; i++) {
+        samples += stats.occupancy[i];
+    }
+    assert(samples > 0 && samples <= send_amount);
+    channel_free(chan);
+
+    double tdiff = (t2.tv_sec - t1.tv_sec) +
+                   (t2.tv_usec - t1.tv_usec) / 1000000.;
+    INFO("Throughput: %lf elt/s\n", send_amount / tdiff);
+}
+
+void delayed_producer(struct channel *chan) {
+    uint32_t val = 42;
+    usleep(50 * 1000);
+    CHK(channel_send(chan, &val));
+}
+
+void test_poll_recv(void) {
+    struct channel *chan = channel_new(sizeof(uint32_t), 4);
+    uint32_t val = 0;
+
+    // Empty: times out, after the timeout
+    uint64_t start = hgap_now_ns();
+    assert(channel_poll_recv(chan, 20 * 1000 * 1000) == 0);
+    assert(hgap_now_ns() - start >= 20 * 1000 * 1000);
+
+    // Woken up by a send before the timeout
+    pthread_t send_thread;
+    CHK_PERROR(pthread_create(&send_thread, NULL,
+                       (void*(*)(void*)) delayed_producer, chan) == 0);
+    assert(channel_poll_recv(chan, 5000ULL * 1000 * 1000) == 1);
+    pthread_join(send_thread, NULL);
+    assert(channel_poll_recv(chan, 0) == 1);
+    assert(channel_recv(chan, &val) && val == 42);
+
+    // Poisoned: receiving does not block (it fails)
+    channel_poison(chan);
+    assert(channel_poll_recv(chan, UINT64_MAX) == 1);
+    assert(!channel_recv(chan, &val));
+
+    channel_free(chan);
+}
+
+void test_membudget(void) {
+    struct hgap_membudget *budget = hgap_membudget_new(1000);
+    assert(hgap_membudget_limit(budget) == 1000);
+
+    // Always granted when nothing is accounted, even over the limit
+    assert(hgap_membudget_try_acquire(budget, 5000));
+    assert(!hgap_membudget_try_acquire(budget, 1));
+    hgap_membudget_release(budget, 5000);
+
+    assert(hgap_membudget_try_acquire(budget, 600));
+    assert(hgap_membudget_try_acquire(budget, 400));
+    assert(!hgap_membudget_try_acquire(budget, 1));
+    hgap_membudget_release(budget, 400);
+    assert(hgap_membudget_acquire(budget, 300));
+    assert(!hgap_membudget_try_acquire(budget, 101));
+
+    // Charging goes over the limit, acquisitions wait for the releases
+    hgap_membudget_charge(budget, 1000);
+    assert(!hgap_membudget_try_acquire(budget, 1));
+    hgap_membudget_release(budget, 1000);
+    assert(hgap_membudget_try_acquire(budget, 100));
+    // Over-release is clamped
+    hgap_membudget_release(budget, 10000);
+    assert(hgap_membudget_try_acquire(budget, 1000));
+
+    hgap_membudget_poison(budget);
+    assert(!hgap_membudget_acquire(budget, 1));
+    hgap_membudget_free(budget);
+
+    assert(hgap_membudget_depth(1000, 100, 2, 64) == 10);
+    assert(hgap_membudget_depth(1000, 600, 2, 64) == 2);
+    assert(hgap_membudget_depth(1000, 1, 2, 64) == 64);
+    assert(hgap_membudget_depth(1000, 0, 2, 64) == 64);
+}
+
+void test_bufpool(void) {
+    struct hgap_membudget *budget = hgap_membudget_new(100);
+    struct bufpool *pool = bufpool_new(budget, 0, 0, -1);
+    assert(bufpool_max_bufs(pool) == BUFPOOL_MIN_BUFS);
+    bufpool_free(pool);
+
+    // The first BUFPOOL_MIN_BUFS buffers do not depend on the budget
+    pool = bufpool_new(budget, 4, 0, -1);
+    assert(bufpool_max_bufs(pool) == 4);
+    void *bufs[BUFPOOL_MIN_BUFS];
+    for (size_t i = 0; i < BUFPOOL_MIN_BUFS; i++) {
+        bufs[i] = bufpool_get(pool, 1000);
+        assert(bufs[i] != NULL);
+        memset(bufs[i], 0, 1000);
+    }
+    assert(!hgap_membudget_try_acquire(budget, 1));
+
+    // Over budget: the next buffer is a recycled one
+    assert(bufpool_put(pool, bufs[0]));
+    assert(bufpool_get(pool, 1000) == bufs[0]);
+
+    // Poisoned: getting does not block (it fails)
+    bufpool_poison(pool);
+    assert(bufpool_get(pool, 1000) == NULL);
+    bufpool_free(pool);
+
+    // The pool gave its memory back
+    assert(hgap_membudget_try_acquire(budget, 100));
+    hgap_membudget_free(budget);
+}
+
+/**
+ * Moves whole elements through the channel (as packets are moved in the
+ * pipelines), as opposed to the counter-only tests above.
+ */
+void bench_producer(struct channel *chan) {
+    size_t elt_size = channel_elt_size(chan);
+    void *data = NULL;
+
+    gettimeofday(&t1, NULL);
+    for (uint32_t i = 0; i < send_amount; i++) {
+        data = channel_reserve(chan);
+        assert(data != NULL);
+        memset(data, (int) i, elt_size);
+        *(uint32_t *)data = i;
+        assert(channel_send_reserved(chan, data) == 1);
+    }
+}
+
+void bench_throughput(size_t elt_size, size_t capacity, uint64_t spin_ns,
+                      uint64_t yield_ns) {
+    struct channel *chan = channel_new(elt_size, capacity);
+    channel_set_wait_policy(chan, spin_ns, yield_ns);
+    void *buf = xmalloc(elt_size);
+    pthread_t send_thread;
+    CHK_PERROR(pthread_create(&send_thread, NULL,
+                       (void*(*)(void*)) bench_producer, chan) == 0);
+
+    for (uint32_t next = 0; next < send_amount; next++) {
+        assert(channel_recv(chan, buf) == 1);
+        assert(*(uint32_t *)buf == next);
+    }
+    gettimeofday(&t2, NULL);
+
+    pthread_join(send_thread, NULL);
+    channel_free(chan);
+    free(buf);
+
+    double tdiff = (t2.tv_sec - t1.tv_sec) +
+                   (t2.tv_usec - t1.tv_usec) / 1000000.;
+    INFO("%zu bytes elements, capacity %zu, spin %"PRIu64" ns, "
+         "yield %"PRIu64" ns: %lf elt/s, %lf MB/s\n",
+         elt_size, capacity, spin_ns, yield_ns, send_amount / tdiff,
+         send_amount * elt_size / tdiff / (1024 * 1024));
+}
+
 int
 main() {
     INFO("Test 1\n");
@@ -103,6 +309,29 @@ main() {
     test_simple_concurrent(sizeof(uint32_t), 2);
     INFO("Test 5\n");
     test_simple_concurrent(1500, 2);
+    INFO("Test 6\n");
+    send_amount = 1 * 1024 * 1024;
+    test_batch_concurrent(1500, 1024, 0);
+    INFO("Test 7\n");
+    test_batch_concurrent(sizeof(uint32_t), 5, 0);
+    INFO("Test 8\n");
+    test_batch_concurrent(1500, 1024,
+                          HGAP_ALLOC_ALIGNED | HGAP_ALLOC_HUGEPAGES |
+                          HGAP_ALLOC_PREFAULT);
+    INFO("Test 9\n");
+    test_batch_concurrent(sizeof(uint32_t), 5, HGAP_ALLOC_ALIGNED);
+    INFO("Test 10\n");
+    test_poll_recv();
+    INFO("Test 11\n");
+    test_membudget();
+    INFO("Test 12\n");
+    test_bufpool();
+    INFO("Benchmark\n");
+    send_amount = 1 * 1024 * 1024;
+    bench_throughput(1500, 1024, 0, 0);
+    bench_throughput(1500, 64, 0, 0);
+    bench_throughput(1500, 64, 20 * 1000, 0);
+    bench_throughput(1500, 64, 20 * 1000, 100 * 1000);
     //test_slow_send_recv();
     return EXIT_SUCCESS;
 }
@@ -17,13 +17,20 @@
  */
 
 #include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/mman.h>
 #include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include "common.h"
 #include "hairgap.h"
+#include "livestats.h"
+#include "memlink.h"
 #include "proto.h"
 #include "string.h"
 
@@ -45,6 +52,10 @@ test_check_config_sender() {
     assert(hgap_check_config_sender(&config) == HGAP_ERR_MTU_TOO_SMALL);
     config.pkt_size = HGAP_MAX_PKT_SIZE + 1;
     assert(hgap_check_config_sender(&config) == HGAP_ERR_MTU_TOO_BIG);
+    config.timestamps = 1;
+    config.pkt_size = HGAP_HEADER_LEN + HGAP_TSTAMP_LEN;
+    assert(hgap_check_config_sender(&config) == HGAP_ERR_MTU_TOO_SMALL);
+    config.timestamps = 0;
     config.pkt_size = HGAP_DEF_PKT_SIZE;
 
     config.in = NULL;
@@ -60,6 +71,37 @@ test_check_config_sender() {
     config.redund = 0.5;
     assert(hgap_check_config_sender(&config) == HGAP_ERR_BAD_REDUND);
     config.redund = HGAP_DEF_REDUND;
+
+    // No address needed to encode into a store
+    config.addr = NULL;
+    assert(hgap_check_config_store(&config) == HGAP_ERR_BAD_OUT_FD);
+    config.store_path = "store";
+    assert(hgap_check_config_store(&config) == HGAP_SUCCESS);
+    config.pkt_size = 1;
+    assert(hgap_check_config_store(&config) == HGAP_ERR_MTU_TOO_SMALL);
+    config.pkt_size = HGAP_DEF_PKT_SIZE;
+
+    // Sending a store only needs an address, its encoding is its own
+    config.in = NULL;
+    config.n_pkt = 0;
+    assert(hgap_check_config_sender(&config) == HGAP_ERR_INVALID_ADDR);
+    config.addr = "127.0.0.1";
+    assert(hgap_check_config_sender(&config) == HGAP_SUCCESS);
+    config.rt_prio = -1;
+    assert(hgap_check_config_sender(&config) == HGAP_ERR_BAD_PLACEMENT);
+    config.rt_prio = 0;
+    config.addr = NULL;
+    config.in = HGAP_DEF_IN_FILE;
+    config.n_pkt = HGAP_DEF_N_PKT;
+    config.store_path = NULL;
+
+    // Nor to send on an in-memory link
+    struct hgap_memlink_params params;
+    memset(&params, 0, sizeof params);
+    config.memlink = hgap_memlink_new(&params);
+    assert(config.memlink);
+    assert(hgap_check_config_sender(&config) == HGAP_SUCCESS);
+    hgap_memlink_free(config.memlink);
 }
 
 void
@@ -79,6 +121,22 @@ test_check_config_receiver() {
     config.out = NULL;
     assert(hgap_check_config_receiver(&config) == HGAP_ERR_BAD_OUT_FD);
     config.out = HGAP_DEF_OUT_FILE;
+
+    config.n_writers = HGAP_MAX_N_WRITERS;
+    assert(hgap_check_config_receiver(&config) == HGAP_SUCCESS);
+    config.n_writers = HGAP_MAX_N_WRITERS + 1;
+    assert(hgap_check_config_receiver(&config) == HGAP_ERR_BAD_N_WRITERS);
+    config.n_writers = -1;
+    assert(hgap_check_config_receiver(&config) == HGAP_ERR_BAD_N_WRITERS);
+    config.n_writers = HGAP_DEF_N_WRITERS;
+
+    struct hgap_memlink_params params;
+    memset(&params, 0, sizeof params);
+    config.addr = NULL;
+    config.memlink = hgap_memlink_new(&params);
+    assert(config.memlink);
+    assert(hgap_check_config_receiver(&config) == HGAP_SUCCESS);
+    hgap_memlink_free(config.memlink);
 }
 
 void
@@ -107,13 +165,27 @@ test_check_send_receive(struct hgap_config *config, size_t tr_size) {
 
     int send_result = HGAP_ERR_INTERNAL;
     int receive_result = HGAP_ERR_INTERNAL;
+    void *thread_ret = NULL;
+    struct hgap_send_stats send_stats;
+    struct hgap_recv_stats recv_stats;
+    memset(&send_stats, 0, sizeof send_stats);
+    memset(&recv_stats, 0, sizeof recv_stats);
+    config->send_stats = &send_stats;
+    config->recv_stats = &recv_stats;
+
+    if (config->store_path != NULL) {
+        // Encoded beforehand, hgap_send then sends the store
+        assert(hgap_store(config) == HGAP_SUCCESS);
+    }
 
     pthread_t receive_thread;
     CHK_PERROR(pthread_create(&receive_thread, NULL,
                        (void*(*)(void*)) hgap_receive, config) == 0);
-    usleep(100);
+    // Let the receiver bind before the handwave is sent
+    usleep(100 * 1000);
     send_result = hgap_send(config);
-    pthread_join(receive_thread, (void **)&receive_result);
+    pthread_join(receive_thread, &thread_ret);
+    receive_result = (int) (intptr_t) thread_ret;
 
     gettimeofday(&t2, NULL);
     double t1d = ((double) t1.tv_sec) + ((double) t1.tv_usec) / 1000000;
@@ -132,6 +204,35 @@ test_check_send_receive(struct hgap_config *config, size_t tr_size) {
         exit(-1);
     }
 
+    assert(send_stats.pkts_sent > 0);
+    assert(send_stats.bytes_sent > tr_size);
+    assert(recv_stats.pkts_received > 0);
+    assert(recv_stats.pkts_received <= send_stats.pkts_sent);
+    assert(recv_stats.chunks > 0);
+    assert(recv_stats.pkts_needed + recv_stats.pkts_margin <=
+           recv_stats.pkts_received);
+    if (config->timestamps) {
+        assert(recv_stats.stamped_pkts > 0);
+        assert(recv_stats.stamped_pkts <= recv_stats.pkts_received);
+        assert(recv_stats.delay_min <= recv_stats.delay_max);
+    } else {
+        assert(recv_stats.stamped_pkts == 0);
+    }
+    if (config->memlink != NULL) {
+        // Everything is accounted for, and nothing lost by the host
+        struct hgap_memlink_stats link_stats;
+        hgap_memlink_get_stats(config->memlink, &link_stats);
+        assert(link_stats.sent <= send_stats.pkts_sent);
+        assert(link_stats.delivered == recv_stats.pkts_received);
+        assert(recv_stats.kernel_drops == 0);
+        assert(send_stats.local_drops == 0);
+        if (link_stats.lost > 0) {
+            assert(recv_stats.link_losses > 0);
+        }
+    }
+    config->send_stats = NULL;
+    config->recv_stats = NULL;
+
     fclose(config->in);
     fclose(config->out);
 
@@ -155,10 +256,124 @@ test_check_send_receive(struct hgap_config *config, size_t tr_size) {
     fprintf(stderr, "\n");
 }
 
+void
+test_live_stats() {
+    const char *name = "hgap_test";
+
+    // The segment of a running transfer is not taken over
+    struct hgap_live *live = hgap_live_new(name, HGAP_LIVE_RECEIVER);
+    assert(live);
+    assert(hgap_live_new(name, HGAP_LIVE_RECEIVER) == NULL && errno == EEXIST);
+
+    // The one of a transfer killed before removing it is
+    pid_t pid = fork();
+    CHK_PERROR(pid != -1);
+    if (pid == 0) {
+        _exit(0);
+    }
+    CHK_PERROR(waitpid(pid, NULL, 0) == pid);
+    live->pid = pid;
+    struct hgap_live *stale = live;
+    live = hgap_live_new(name, HGAP_LIVE_RECEIVER);
+    assert(live);
+    assert(live->pid == (uint32_t) getpid());
+    munmap(stale, sizeof *stale);
+
+    hgap_live_free(live);
+}
+
+void
+bench_receivers(struct hgap_config *config) {
+    size_t tr_size = 100L * 1024L * 1024L;
+
+    INFO("Benchmark: threaded receiver\n");
+    config->single_thread = 0;
+    test_check_send_receive(config, tr_size);
+
+    INFO("Benchmark: single-threaded receiver\n");
+    config->single_thread = 1;
+    test_check_send_receive(config, tr_size);
+    config->single_thread = 0;
+}
+
+/**
+ * Transfer over a fresh in-memory link with these parameters, checking what
+ * the link did.
+ */
+void
+test_check_memlink(struct hgap_config *config,
+                   const struct hgap_memlink_params *params, size_t tr_size) {
+    INFO("In-memory link test\n");
+
+    config->memlink = hgap_memlink_new(params);
+    assert(config->memlink);
+    test_check_send_receive(config, tr_size);
+
+    struct hgap_memlink_stats stats;
+    hgap_memlink_get_stats(config->memlink, &stats);
+    INFO("Link: %"PRIu64" packets sent, %"PRIu64" lost, %"PRIu64" dropped "
+         "by the queue, %"PRIu64" reordered, %"PRIu64" delivered\n",
+         stats.sent, stats.lost, stats.queue_drops, stats.reordered,
+         stats.delivered);
+    assert(stats.sent > 0);
+    assert(stats.delivered <= stats.sent - stats.lost - stats.queue_drops);
+    if (params->loss_model == HGAP_LOSS_NONE) {
+        assert(stats.lost == 0);
+    } else {
+        assert(stats.lost > 0);
+    }
+    if (params->reorder > 0) {
+        assert(stats.reordered > 0);
+    }
+
+    hgap_memlink_free(config->memlink);
+    config->memlink = NULL;
+}
+
+/**
+ * Throughput and margins over a lossy in-memory link, for a few chunk
+ * sizes, packet sizes and redundancies. The losses are the same on every
+ * run.
+ */
+void
+bench_memlink(struct hgap_config *config) {
+    static const uint32_t n_pkts[] = { 100, 1000 };
+    static const size_t pkt_sizes[] = { 512, HGAP_DEF_PKT_SIZE };
+    static const double redunds[] = { 1.1, 1.5 };
+    size_t tr_size = 10L * 1024L * 1024L;
+
+    struct hgap_memlink_params params;
+    memset(&params, 0, sizeof params);
+    params.seed = 1;
+    params.loss_model = HGAP_LOSS_BERNOULLI;
+    params.loss = 0.01;
+
+    for (size_t i = 0; i < sizeof n_pkts / sizeof *n_pkts; i++) {
+        for (size_t j = 0; j < sizeof pkt_sizes / sizeof *pkt_sizes; j++) {
+            for (size_t k = 0; k < sizeof redunds / sizeof *redunds; k++) {
+                INFO("Benchmark: in-memory link, n_pkt %"PRIu32", pkt_size "
+                     "%zu, redund %.1f\n", n_pkts[i], pkt_sizes[j],
+                     redunds[k]);
+                config->n_pkt = n_pkts[i];
+                config->pkt_size = pkt_sizes[j];
+                config->redund = redunds[k];
+                test_check_memlink(config, &params, tr_size);
+            }
+        }
+    }
+
+    config->n_pkt = HGAP_DEF_N_PKT;
+    config->pkt_size = HGAP_DEF_PKT_SIZE;
+    config->redund = HGAP_DEF_REDUND;
+}
+
+/**
+ * Runs the behavior checks, or with --bench (make bench) only the
+ * benchmarks.
+ */
 int
-main() {
-    test_check_config_sender();
-    test_check_config_receiver();
+main(int argc, char **argv) {
+    int bench = argc > 1 && strcmp(argv[1], "--bench") == 0;
 
     struct hgap_config config;
     hgap_defaults(&config);
@@ -167,6 +382,16 @@ main() {
     config.mem_limit = 1 * 1024 * 1024;
     //config.byterate = 10 * 1024 * 1024;
 
+    if (bench) {
+        bench_memlink(&config);
+        bench_receivers(&config);
+        return EXIT_SUCCESS;
+    }
+
+    test_check_config_sender();
+    test_check_config_receiver();
+    test_live_stats();
+
     fprintf(stderr, "\n");
     size_t tr_size;
 
@@ -181,6 +406,44 @@ main() {
     tr_size = 1;
     test_check_send_receive(&config, tr_size);
 
+    config.timestamps = 1;
+    tr_size = 10L * 1024L * 1024L;
+    test_check_send_receive(&config, tr_size);
+    config.timestamps = 0;
+
+    char store_path[] = "/tmp/hgap_test_storeXXXXXX";
+    CHK_PERROR(close(mkstemp(store_path)) == 0);
+    config.store_path = store_path;
+    tr_size = 10L * 1024L * 1024L;
+    test_check_send_receive(&config, tr_size);
+    config.timestamps = 1;
+    test_check_send_receive(&config, tr_size);
+    config.timestamps = 0;
+    config.store_path = NULL;
+    unlink(store_path);
+
+    struct hgap_memlink_params params;
+    memset(&params, 0, sizeof params);
+    params.seed = 42;
+    tr_size = 10L * 1024L * 1024L;
+    test_check_memlink(&config, &params, tr_size);
+
+    params.loss_model = HGAP_LOSS_BERNOULLI;
+    params.loss = 0.05;
+    test_check_memlink(&config, &params, tr_size);
+
+    // Bursts of 4 packets on average, 2% of the packets lost
+    params.loss_model = HGAP_LOSS_GILBERT_ELLIOTT;
+    params.ge_p = 0.005;
+    params.ge_r = 0.25;
+    params.ge_loss_bad = 1.0;
+    params.reorder = 0.01;
+    params.reorder_distance = 3;
+    params.rate = 200 * 1024 * 1024;
+    config.single_thread = 1;
+    test_check_memlink(&config, &params, tr_size);
+    config.single_thread = 0;
+
     tr_size = 300L * 1024L * 1024L;
     test_check_send_receive(&config, tr_size);
 
@@ -0,0 +1,13 @@
+#!/bin/bash
+source "$TEST_BASE"
+writers_test1() {
+    init_test 200
+    echo -n "parallel writers test 1, options: $*"
+    $HAIRGAPR -w 4 127.0.0.1 > $TO & rpid=$! && usleep 1000000
+    $HAIRGAPS $* 127.0.0.1 < $FROM
+    wait "$rpid"
+    RET=$?
+    check_md5 &&
+    check_ret_ok $RET
+}
+writers_test1 $*
@@ -0,0 +1,13 @@
+#!/bin/bash
+source "$TEST_BASE"
+placement_test1() {
+    init_test 200
+    echo -n "pinned pipeline threads test 1, options: $*"
+    $HAIRGAPR -a net=0 -a decode=0 -a write=0 127.0.0.1 > $TO & rpid=$! && usleep 1000000
+    $HAIRGAPS -a read=0 -a encode=0 -a send=0 $* 127.0.0.1 < $FROM
+    wait "$rpid"
+    RET=$?
+    check_md5 &&
+    check_ret_ok $RET
+}
+placement_test1 $*
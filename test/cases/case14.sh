@@ -0,0 +1,13 @@
+#!/bin/bash
+source "$TEST_BASE"
+single_thread_test1() {
+    init_test 200
+    echo -n "single-threaded receiver test 1, options: $*"
+    $HAIRGAPR -S 127.0.0.1 > $TO & rpid=$! && usleep 1000000
+    $HAIRGAPS $* 127.0.0.1 < $FROM
+    wait "$rpid"
+    RET=$?
+    check_md5 &&
+    check_ret_ok $RET
+}
+single_thread_test1 $*
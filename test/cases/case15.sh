@@ -0,0 +1,19 @@
+#!/bin/bash
+source "$TEST_BASE"
+live_stats_test1() {
+    init_test 200
+    echo -n "live stats test 1, options: $*"
+    $HAIRGAPR -L hgap-test-rx 127.0.0.1 > $TO & rpid=$! && usleep 1000000
+    $HGAP_PATH/hgap-stat -w -j -i 0.2 hgap-test-rx > $DIR/stats &
+    spid=$!
+    $HAIRGAPS $* 127.0.0.1 < $FROM
+    wait "$rpid"
+    RET=$?
+    wait "$spid" || fail "hgap-stat failed"
+    check_md5 &&
+    check_ret_ok $RET &&
+    grep -q '"done": true.*"bytes_written": 209715200,' $DIR/stats ||
+        fail "bad live stats"
+    [ ! -e /dev/shm/hgap-hgap-test-rx ] || fail "segment not removed"
+}
+live_stats_test1 $*
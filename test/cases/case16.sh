@@ -0,0 +1,16 @@
+#!/bin/bash
+source "$TEST_BASE"
+timestamps_test1() {
+    init_test 200
+    echo -n "send timestamps test 1, options: $*"
+    $HAIRGAPR -T 127.0.0.1 > $TO 2> $DIR/rlog & rpid=$! && usleep 1000000
+    $HAIRGAPS -T $* 127.0.0.1 < $FROM
+    wait "$rpid"
+    RET=$?
+    check_md5 &&
+    check_ret_ok $RET &&
+    grep -q "timestamped packets, one-way delay" $DIR/rlog &&
+    grep -q "Arrival spacing (us):" $DIR/rlog ||
+        fail "no latency report"
+}
+timestamps_test1 $*
@@ -0,0 +1,17 @@
+#!/bin/bash
+source "$TEST_BASE"
+trace_test1() {
+    init_test 200
+    echo -n "trace and replay test 1, options: $*"
+    $HAIRGAPR -r $DIR/trace 127.0.0.1 > $TO & rpid=$! && usleep 1000000
+    $HAIRGAPS $* 127.0.0.1 < $FROM
+    wait "$rpid"
+    RET=$?
+    check_md5 &&
+    check_ret_ok $RET &&
+    $HGAP_PATH/hgap-replay $DIR/trace > $DIR/replay ||
+        fail "replay failed"
+    grep -q "chunks (200.000 MB) decoded" $DIR/replay ||
+        fail "bad replay"
+}
+trace_test1 $*
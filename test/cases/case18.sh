@@ -0,0 +1,18 @@
+#!/bin/bash
+source "$TEST_BASE"
+pcap_test1() {
+    init_test 200
+    echo -n "capture decoding test 1, options: $*"
+    $HAIRGAPR -r $DIR/trace 127.0.0.1 > $TO & rpid=$! && usleep 1000000
+    $HAIRGAPS $* 127.0.0.1 < $FROM
+    wait "$rpid"
+    RET=$?
+    check_md5 &&
+    check_ret_ok $RET &&
+    $HGAP_PATH/hgap-replay -w $DIR/capture $DIR/trace > /dev/null &&
+    $HGAP_PATH/hgap-pcap $DIR/capture > $DIR/decoded ||
+        fail "capture decoding failed"
+    grep -q "chunks (200.000 MB) decoded" $DIR/decoded ||
+        fail "bad capture decoding"
+}
+pcap_test1 $*
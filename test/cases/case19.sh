@@ -0,0 +1,17 @@
+#!/bin/bash
+source "$TEST_BASE"
+store_test1() {
+    init_test 200
+    echo -n "packet store test 1, options: $*"
+    $HAIRGAPS $* -w $DIR/store < $FROM || fail "encoding failed"
+    for i in 1 2; do
+        $HAIRGAPR 127.0.0.1 > $TO & rpid=$! && sleep 1
+        $HAIRGAPS -s $DIR/store 127.0.0.1 < /dev/null
+        wait "$rpid"
+        RET=$?
+        check_md5 &&
+        check_ret_ok $RET ||
+            fail "store sent $i times"
+    done
+}
+store_test1 $*
@@ -0,0 +1,20 @@
+#!/bin/bash
+source "$TEST_BASE"
+async_writes_test1() {
+    init_test 200
+    echo -n "async and direct writes test 1, options: $*"
+    # Random data with an unaligned tail, so that misplaced writes show up
+    dd if=/dev/urandom of=$FROM bs=1M count=200 2> /dev/null
+    head -c 12345 /dev/urandom >> $FROM
+    for ropts in "-q 4" "-D" "-D -q 8"; do
+        echo -n "" > $TO
+        $HAIRGAPR $ropts 127.0.0.1 > $TO & rpid=$! && sleep 1
+        $HAIRGAPS $* 127.0.0.1 < $FROM
+        wait "$rpid"
+        RET=$?
+        check_md5 &&
+        check_ret_ok $RET ||
+            fail "hairgapr $ropts"
+    done
+}
+async_writes_test1 $*
@@ -0,0 +1,18 @@
+#!/bin/bash
+source "$TEST_BASE"
+syncer_test1() {
+    init_test 200
+    echo -n "background sync test 1, options: $*"
+    dd if=/dev/urandom of=$FROM bs=1M count=200 2> /dev/null
+    for ropts in "-s 8" "-w 4 -s 8"; do
+        echo -n "" > $TO
+        $HAIRGAPR $ropts 127.0.0.1 > $TO & rpid=$! && sleep 1
+        $HAIRGAPS $* 127.0.0.1 < $FROM
+        wait "$rpid"
+        RET=$?
+        check_md5 &&
+        check_ret_ok $RET ||
+            fail "hairgapr $ropts"
+    done
+}
+syncer_test1 $*